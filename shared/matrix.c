@@ -61,17 +61,16 @@ WL_EXPORT void
 weston_matrix_multiply(struct weston_matrix *m, const struct weston_matrix *n)
 {
 	struct weston_matrix tmp;
-	const float *row, *column;
-	div_t d;
+	const float *column;
 	int i, j;
 
-	for (i = 0; i < 16; i++) {
-		tmp.d[i] = 0;
-		d = div(i, 4);
-		row = m->d + d.quot * 4;
-		column = n->d + d.rem;
+	for (i = 0; i < 4; i++) {
+		column = m->d + i * 4;
 		for (j = 0; j < 4; j++)
-			tmp.d[i] += row[j] * column[j * 4];
+			tmp.d[i * 4 + j] = n->d[j] * column[0] +
+					   n->d[4 + j] * column[1] +
+					   n->d[8 + j] * column[2] +
+					   n->d[12 + j] * column[3];
 	}
 	tmp.type = m->type | n->type;
 	memcpy(m, &tmp, sizeof tmp);
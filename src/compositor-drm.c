@@ -69,6 +69,22 @@
 
 static int option_current_mode = 0;
 
+/* Plane properties the atomic commit path sets, see plane_prop_names */
+enum drm_plane_prop {
+	PLANE_PROP_TYPE = 0,
+	PLANE_PROP_FB_ID,
+	PLANE_PROP_CRTC_ID,
+	PLANE_PROP_SRC_X,
+	PLANE_PROP_SRC_Y,
+	PLANE_PROP_SRC_W,
+	PLANE_PROP_SRC_H,
+	PLANE_PROP_CRTC_X,
+	PLANE_PROP_CRTC_Y,
+	PLANE_PROP_CRTC_W,
+	PLANE_PROP_CRTC_H,
+	PLANE_PROP_COUNT
+};
+
 enum output_config {
 	OUTPUT_CONFIG_INVALID = 0,
 	OUTPUT_CONFIG_OFF,
@@ -112,6 +128,15 @@ struct drm_compositor {
 	int sprites_are_broken;
 	int sprites_hidden;
 
+	/* Every frame is one atomic commit per output, covering all of
+	 * its planes. The primary and cursor planes then are on
+	 * plane_list, only overlays are on sprite_list. */
+	int atomic_modeset;
+	struct wl_list plane_list;
+	/* sprite_list is sorted by zpos, all distinct, so overlays can
+	 * be stacked by the order they are handed out in */
+	int overlays_stacked;
+
 	int cursors_are_broken;
 
 	int use_pixman;
@@ -165,7 +190,10 @@ struct drm_output {
 	drmModePropertyPtr dpms_prop;
 	uint32_t format;
 
-	int vblank_pending;
+	/* A frame is finished once all the events queued with it arrived:
+	 * its page flip plus a vblank for every sprite it updated. */
+	uint32_t frame_seq;
+	int frame_events;
 	int page_flip_pending;
 	int destroy_pending;
 
@@ -178,13 +206,21 @@ struct drm_output {
 	struct drm_fb *current, *next;
 	struct backlight *backlight;
 
+	/* The dumb buffers are rendered in turn, so each misses the
+	 * damage of the frame rendered into the other one. */
 	struct drm_fb *dumb[2];
 	pixman_image_t *image[2];
 	int current_image;
+	uint32_t pixman_frame;
 	pixman_region32_t previous_damage;
 
 	struct vaapi_recorder *recorder;
 	struct wl_listener recorder_frame_listener;
+
+	/* Atomic modesetting only */
+	struct drm_sprite *kms_primary;
+	struct drm_sprite *kms_cursor;
+	struct drm_fb *cursor_fb[2];
 };
 
 /*
@@ -199,9 +235,14 @@ struct drm_sprite {
 	struct drm_fb *current, *next;
 	struct drm_output *output;
 	struct drm_compositor *compositor;
+	uint32_t frame_seq; /* output frame its vblank event belongs to */
 
 	uint32_t possible_crtcs;
 	uint32_t plane_id;
+	uint32_t type;
+	uint32_t props[PLANE_PROP_COUNT];
+	int has_zpos;
+	uint64_t zpos;
 	uint32_t count_formats;
 
 	int32_t src_x, src_y;
@@ -229,6 +270,14 @@ static const char *default_card = NULL;
 static void
 drm_output_set_cursor(struct drm_output *output);
 
+#ifdef HAVE_DRM_ATOMIC
+static int
+drm_output_atomic_test(struct drm_output *output);
+
+static int
+drm_output_atomic_commit(struct drm_output *output);
+#endif
+
 static int
 drm_sprite_crtc_supported(struct weston_output *output_base, uint32_t supported)
 {
@@ -508,6 +557,14 @@ drm_output_prepare_scanout_view(struct weston_output *_output,
 
 	drm_fb_set_buffer(output->next, buffer);
 
+#ifdef HAVE_DRM_ATOMIC
+	if (c->atomic_modeset && drm_output_atomic_test(output) < 0) {
+		drm_output_release_fb(output, output->next);
+		output->next = NULL;
+		return NULL;
+	}
+#endif
+
 	return &output->fb_plane;
 }
 
@@ -538,26 +595,41 @@ static void
 drm_output_render_pixman(struct drm_output *output, pixman_region32_t *damage)
 {
 	struct weston_compositor *ec = output->base.compositor;
-	pixman_region32_t total_damage, previous_damage;
-
-	pixman_region32_init(&total_damage);
-	pixman_region32_init(&previous_damage);
-
-	pixman_region32_copy(&previous_damage, damage);
-
-	pixman_region32_union(&total_damage, damage, &output->previous_damage);
-	pixman_region32_copy(&output->previous_damage, &previous_damage);
+	pixman_region32_t stale;
 
 	output->current_image ^= 1;
 
+	/* The buffer misses the previous frame's damage, or everything
+	 * if it was never rendered into. The renderer's shadow image has
+	 * all of it, so only this frame's damage needs to be composited
+	 * and the rest is just copied over. */
+	pixman_region32_init(&stale);
+	if (output->pixman_frame < ARRAY_LENGTH(output->dumb))
+		pixman_region32_init_rect(&stale,
+					  output->base.x, output->base.y,
+					  output->base.width,
+					  output->base.height);
+	else
+		pixman_region32_copy(&stale, &output->previous_damage);
+
 	output->next = output->dumb[output->current_image];
 	pixman_renderer_output_set_buffer(&output->base,
 					  output->image[output->current_image]);
 
-	ec->renderer->repaint_output(&output->base, &total_damage);
+	/* A new shadow image, after a mode switch, has nothing to copy */
+	if (output->pixman_frame == 0) {
+		ec->renderer->repaint_output(&output->base, &stale);
+	} else {
+		pixman_renderer_output_set_hw_extra_damage(&output->base,
+							   &stale);
+		ec->renderer->repaint_output(&output->base, damage);
+	}
+
+	pixman_renderer_output_set_hw_extra_damage(&output->base, NULL);
+	pixman_region32_fini(&stale);
 
-	pixman_region32_fini(&total_damage);
-	pixman_region32_fini(&previous_damage);
+	pixman_region32_copy(&output->previous_damage, damage);
+	output->pixman_frame++;
 }
 
 static void
@@ -629,6 +701,30 @@ drm_output_repaint(struct weston_output *output_base,
 		output_base->set_dpms(output_base, WESTON_DPMS_ON);
 	}
 
+#ifdef HAVE_DRM_ATOMIC
+	if (compositor->atomic_modeset) {
+		if (!output->kms_cursor)
+			drm_output_set_cursor(output);
+
+		if (drm_output_atomic_commit(output) < 0) {
+			weston_log("atomic commit failed: %m\n");
+			wl_list_for_each(s, &compositor->sprite_list, link) {
+				if (s->output != output)
+					continue;
+				drm_output_release_fb(output, s->next);
+				s->next = NULL;
+			}
+			goto err_pageflip;
+		}
+
+		output->page_flip_pending = 1;
+		output->frame_seq++;
+		output->frame_events = 1;
+
+		return 0;
+	}
+#endif
+
 	if (drmModePageFlip(compositor->drm.fd, output->crtc_id,
 			    output->next->fb_id,
 			    DRM_MODE_PAGE_FLIP_EVENT, output) < 0) {
@@ -637,6 +733,8 @@ drm_output_repaint(struct weston_output *output_base,
 	}
 
 	output->page_flip_pending = 1;
+	output->frame_seq++;
+	output->frame_events = 1;
 
 	drm_output_set_cursor(output);
 
@@ -676,13 +774,15 @@ drm_output_repaint(struct weston_output *output_base,
 		 */
 		vbl.request.signal = (unsigned long)s;
 		ret = drmWaitVBlank(compositor->drm.fd, &vbl);
+		s->output = output;
 		if (ret) {
 			weston_log("vblank event request failed: %d: %s\n",
 				ret, strerror(errno));
+			continue;
 		}
 
-		s->output = output;
-		output->vblank_pending = 1;
+		s->frame_seq = output->frame_seq;
+		output->frame_events++;
 	}
 
 	return 0;
@@ -722,6 +822,9 @@ drm_output_start_repaint_loop(struct weston_output *output_base)
 		goto finish_frame;
 	}
 
+	output->frame_seq++;
+	output->frame_events = 1;
+
 	return;
 
 finish_frame:
@@ -741,39 +844,68 @@ drm_output_update_msc(struct drm_output *output, unsigned int seq)
 	output->base.msc = (msc_hi << 32) + seq;
 }
 
+static void
+drm_output_destroy(struct weston_output *output_base);
+
+/*
+ * Called for every event queued with the output's current frame. Only
+ * the last one to arrive finishes the frame, so frame callbacks go out
+ * once and carry the time the whole frame was on screen, whichever of
+ * the page flip and the sprite vblanks comes in last.
+ */
+static void
+drm_output_frame_event(struct drm_output *output, unsigned int frame,
+		       unsigned int sec, unsigned int usec)
+{
+	struct timespec ts;
+
+	drm_output_update_msc(output, frame);
+
+	if (--output->frame_events > 0)
+		return;
+
+	if (output->destroy_pending) {
+		drm_output_destroy(&output->base);
+		return;
+	}
+
+	ts.tv_sec = sec;
+	ts.tv_nsec = usec * 1000;
+	weston_output_finish_frame(&output->base, &ts);
+
+	/* We can't call this from frame_notify, because the output's
+	 * repaint needed flag is cleared just after that */
+	if (output->recorder)
+		weston_output_schedule_repaint(&output->base);
+}
+
 static void
 vblank_handler(int fd, unsigned int frame, unsigned int sec, unsigned int usec,
 	       void *data)
 {
 	struct drm_sprite *s = (struct drm_sprite *)data;
 	struct drm_output *output = s->output;
-	struct timespec ts;
-
-	drm_output_update_msc(output, frame);
-	output->vblank_pending = 0;
 
 	drm_output_release_fb(output, s->current);
 	s->current = s->next;
 	s->next = NULL;
 
-	if (!output->page_flip_pending) {
-		ts.tv_sec = sec;
-		ts.tv_nsec = usec * 1000;
-		weston_output_finish_frame(&output->base, &ts);
-	}
-}
+	/* A vblank left over from an earlier frame must not finish the
+	 * current one early */
+	if (s->frame_seq != output->frame_seq || output->frame_events == 0)
+		return;
 
-static void
-drm_output_destroy(struct weston_output *output_base);
+	drm_output_frame_event(output, frame, sec, usec);
+}
 
 static void
 page_flip_handler(int fd, unsigned int frame,
 		  unsigned int sec, unsigned int usec, void *data)
 {
 	struct drm_output *output = (struct drm_output *) data;
-	struct timespec ts;
-
-	drm_output_update_msc(output, frame);
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	struct drm_sprite *s;
 
 	/* We don't set page_flip_pending on start_repaint_loop, in that case
 	 * we just want to page flip to the current buffer to get an accurate
@@ -782,22 +914,23 @@ page_flip_handler(int fd, unsigned int frame,
 		drm_output_release_fb(output, output->current);
 		output->current = output->next;
 		output->next = NULL;
+
+		/* With atomic commits the overlays changed in the same
+		 * flip, there are no separate vblank events for them */
+		if (c->atomic_modeset) {
+			wl_list_for_each(s, &c->sprite_list, link) {
+				if (s->output != output)
+					continue;
+				drm_output_release_fb(output, s->current);
+				s->current = s->next;
+				s->next = NULL;
+			}
+		}
 	}
 
 	output->page_flip_pending = 0;
 
-	if (output->destroy_pending)
-		drm_output_destroy(&output->base);
-	else if (!output->vblank_pending) {
-		ts.tv_sec = sec;
-		ts.tv_nsec = usec * 1000;
-		weston_output_finish_frame(&output->base, &ts);
-
-		/* We can't call this from frame_notify, because the output's
-		 * repaint needed flag is cleared just after that */
-		if (output->recorder)
-			weston_output_schedule_repaint(&output->base);
-	}
+	drm_output_frame_event(output, frame, sec, usec);
 }
 
 static uint32_t
@@ -836,52 +969,75 @@ drm_view_transform_supported(struct weston_view *ev)
 		(ev->transform.matrix.type < WESTON_MATRIX_TRANSFORM_ROTATE);
 }
 
-static struct weston_plane *
-drm_output_prepare_overlay_view(struct weston_output *output_base,
-				struct weston_view *ev)
+/* Whether the view could be shown on an overlay at all, before trying
+ * to import its buffer */
+static int
+drm_view_overlay_candidate(struct weston_output *output_base,
+			   struct weston_view *ev)
 {
-	struct weston_compositor *ec = output_base->compositor;
-	struct drm_compositor *c =(struct drm_compositor *) ec;
+	struct drm_compositor *c =
+		(struct drm_compositor *) output_base->compositor;
 	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
-	struct drm_sprite *s;
-	int found = 0;
-	struct gbm_bo *bo;
-	pixman_region32_t dest_rect, src_rect;
-	pixman_box32_t *box, tbox;
-	uint32_t format;
-	wl_fixed_t sx1, sy1, sx2, sy2;
 
 	if (c->gbm == NULL)
-		return NULL;
+		return 0;
 
 	if (viewport->buffer.transform != output_base->transform)
-		return NULL;
+		return 0;
 
 	if (viewport->buffer.scale != output_base->current_scale)
-		return NULL;
+		return 0;
 
 	if (c->sprites_are_broken)
-		return NULL;
+		return 0;
 
 	if (ev->output_mask != (1u << output_base->id))
-		return NULL;
+		return 0;
 
 	if (ev->surface->buffer_ref.buffer == NULL)
-		return NULL;
+		return 0;
 
 	if (ev->alpha != 1.0f)
-		return NULL;
+		return 0;
 
 	if (wl_shm_buffer_get(ev->surface->buffer_ref.buffer->resource))
-		return NULL;
+		return 0;
 
 	if (!drm_view_transform_supported(ev))
+		return 0;
+
+	return 1;
+}
+
+static struct weston_plane *
+drm_output_prepare_overlay_view(struct weston_output *output_base,
+				struct weston_view *ev)
+{
+	struct weston_compositor *ec = output_base->compositor;
+	struct drm_compositor *c =(struct drm_compositor *) ec;
+	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
+	struct drm_sprite *s;
+	int found = 0;
+	struct gbm_bo *bo;
+	pixman_region32_t dest_rect, src_rect;
+	pixman_box32_t *box, tbox;
+	uint32_t format;
+	wl_fixed_t sx1, sy1, sx2, sy2;
+
+	if (!drm_view_overlay_candidate(output_base, ev))
 		return NULL;
 
+	/* Views come top down and sprite_list is sorted by zpos, so each
+	 * view gets an overlay below the ones of the views above it */
 	wl_list_for_each(s, &c->sprite_list, link) {
 		if (!drm_sprite_crtc_supported(output_base, s->possible_crtcs))
 			continue;
 
+		/* An atomic commit only covers the planes of its output */
+		if (c->atomic_modeset && s->current &&
+		    s->output != (struct drm_output *) output_base)
+			continue;
+
 		if (!s->next) {
 			found = 1;
 			break;
@@ -977,33 +1133,55 @@ drm_output_prepare_overlay_view(struct weston_output *output_base,
 	s->src_h = (tbox.y2 - tbox.y1) << 8;
 	pixman_region32_fini(&src_rect);
 
+	s->output = (struct drm_output *) output_base;
+
+#ifdef HAVE_DRM_ATOMIC
+	if (c->atomic_modeset && drm_output_atomic_test(s->output) < 0) {
+		drm_output_release_fb(s->output, s->next);
+		s->next = NULL;
+		return NULL;
+	}
+#endif
+
 	return &s->plane;
 }
 
-static struct weston_plane *
-drm_output_prepare_cursor_view(struct weston_output *output_base,
-			       struct weston_view *ev)
+/* Whether the view could go on the cursor plane, if it is free */
+static int
+drm_view_cursor_candidate(struct weston_output *output_base,
+			  struct weston_view *ev)
 {
 	struct drm_compositor *c =
 		(struct drm_compositor *) output_base->compositor;
 	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
-	struct drm_output *output = (struct drm_output *) output_base;
 
 	if (c->gbm == NULL)
-		return NULL;
-	if (output->base.transform != WL_OUTPUT_TRANSFORM_NORMAL)
-		return NULL;
+		return 0;
+	if (output_base->transform != WL_OUTPUT_TRANSFORM_NORMAL)
+		return 0;
 	if (viewport->buffer.scale != output_base->current_scale)
-		return NULL;
-	if (output->cursor_view)
-		return NULL;
+		return 0;
 	if (ev->output_mask != (1u << output_base->id))
-		return NULL;
+		return 0;
 	if (c->cursors_are_broken)
-		return NULL;
+		return 0;
 	if (ev->surface->buffer_ref.buffer == NULL ||
 	    !wl_shm_buffer_get(ev->surface->buffer_ref.buffer->resource) ||
 	    ev->surface->width > 64 || ev->surface->height > 64)
+		return 0;
+
+	return 1;
+}
+
+static struct weston_plane *
+drm_output_prepare_cursor_view(struct weston_output *output_base,
+			       struct weston_view *ev)
+{
+	struct drm_output *output = (struct drm_output *) output_base;
+
+	if (output->cursor_view)
+		return NULL;
+	if (!drm_view_cursor_candidate(output_base, ev))
 		return NULL;
 
 	output->cursor_view = ev;
@@ -1011,18 +1189,53 @@ drm_output_prepare_cursor_view(struct weston_output *output_base,
 	return &output->cursor_plane;
 }
 
+/* Copies the buffer of the cursor view into the other cursor bo, if it
+ * changed. Returns 1 if it did, cursor_bo[current_cursor] then is the
+ * one to show. */
+static int
+drm_output_update_cursor_bo(struct drm_output *output, struct weston_view *ev)
+{
+	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	EGLint stride;
+	struct gbm_bo *bo;
+	uint32_t buf[c->cursor_width * c->cursor_height];
+	unsigned char *s;
+	int i;
+
+	if (!buffer ||
+	    !pixman_region32_not_empty(&output->cursor_plane.damage))
+		return 0;
+
+	pixman_region32_fini(&output->cursor_plane.damage);
+	pixman_region32_init(&output->cursor_plane.damage);
+	output->current_cursor ^= 1;
+	bo = output->cursor_bo[output->current_cursor];
+	memset(buf, 0, sizeof buf);
+	stride = wl_shm_buffer_get_stride(buffer->shm_buffer);
+	s = wl_shm_buffer_get_data(buffer->shm_buffer);
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	for (i = 0; i < ev->surface->height; i++)
+		memcpy(buf + i * c->cursor_width, s + i * stride,
+		       ev->surface->width * 4);
+	wl_shm_buffer_end_access(buffer->shm_buffer);
+
+	if (gbm_bo_write(bo, buf, sizeof buf) < 0)
+		weston_log("failed update cursor: %m\n");
+
+	return 1;
+}
+
 static void
 drm_output_set_cursor(struct drm_output *output)
 {
 	struct weston_view *ev = output->cursor_view;
-	struct weston_buffer *buffer;
 	struct drm_compositor *c =
 		(struct drm_compositor *) output->base.compositor;
-	EGLint handle, stride;
+	EGLint handle;
 	struct gbm_bo *bo;
-	uint32_t buf[c->cursor_width * c->cursor_height];
-	unsigned char *s;
-	int i, x, y;
+	int x, y;
 
 	output->cursor_view = NULL;
 	if (ev == NULL) {
@@ -1030,26 +1243,8 @@ drm_output_set_cursor(struct drm_output *output)
 		return;
 	}
 
-	buffer = ev->surface->buffer_ref.buffer;
-
-	if (buffer &&
-	    pixman_region32_not_empty(&output->cursor_plane.damage)) {
-		pixman_region32_fini(&output->cursor_plane.damage);
-		pixman_region32_init(&output->cursor_plane.damage);
-		output->current_cursor ^= 1;
+	if (drm_output_update_cursor_bo(output, ev)) {
 		bo = output->cursor_bo[output->current_cursor];
-		memset(buf, 0, sizeof buf);
-		stride = wl_shm_buffer_get_stride(buffer->shm_buffer);
-		s = wl_shm_buffer_get_data(buffer->shm_buffer);
-		wl_shm_buffer_begin_access(buffer->shm_buffer);
-		for (i = 0; i < ev->surface->height; i++)
-			memcpy(buf + i * c->cursor_width, s + i * stride,
-			       ev->surface->width * 4);
-		wl_shm_buffer_end_access(buffer->shm_buffer);
-
-		if (gbm_bo_write(bo, buf, sizeof buf) < 0)
-			weston_log("failed update cursor: %m\n");
-
 		handle = gbm_bo_get_handle(bo).s32;
 		if (drmModeSetCursor(c->drm.fd, output->crtc_id, handle,
 				c->cursor_width, c->cursor_height)) {
@@ -1071,6 +1266,358 @@ drm_output_set_cursor(struct drm_output *output)
 	}
 }
 
+#ifdef HAVE_DRM_ATOMIC
+static int
+drm_sprite_add_state(drmModeAtomicReq *req, struct drm_sprite *s,
+		     uint32_t crtc_id, uint32_t fb_id)
+{
+	int ret = 0;
+
+	ret |= drmModeAtomicAddProperty(req, s->plane_id,
+					s->props[PLANE_PROP_FB_ID], fb_id);
+	ret |= drmModeAtomicAddProperty(req, s->plane_id,
+					s->props[PLANE_PROP_CRTC_ID], crtc_id);
+	if (fb_id == 0)
+		return ret < 0 ? -1 : 0;
+
+	ret |= drmModeAtomicAddProperty(req, s->plane_id,
+					s->props[PLANE_PROP_SRC_X], s->src_x);
+	ret |= drmModeAtomicAddProperty(req, s->plane_id,
+					s->props[PLANE_PROP_SRC_Y], s->src_y);
+	ret |= drmModeAtomicAddProperty(req, s->plane_id,
+					s->props[PLANE_PROP_SRC_W], s->src_w);
+	ret |= drmModeAtomicAddProperty(req, s->plane_id,
+					s->props[PLANE_PROP_SRC_H], s->src_h);
+	ret |= drmModeAtomicAddProperty(req, s->plane_id,
+					s->props[PLANE_PROP_CRTC_X], s->dest_x);
+	ret |= drmModeAtomicAddProperty(req, s->plane_id,
+					s->props[PLANE_PROP_CRTC_Y], s->dest_y);
+	ret |= drmModeAtomicAddProperty(req, s->plane_id,
+					s->props[PLANE_PROP_CRTC_W], s->dest_w);
+	ret |= drmModeAtomicAddProperty(req, s->plane_id,
+					s->props[PLANE_PROP_CRTC_H], s->dest_h);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/* Adds the primary plane showing fb and the overlays of the output as
+ * assign_planes left them. */
+static int
+drm_output_atomic_add_planes(struct drm_output *output,
+			     drmModeAtomicReq *req, struct drm_fb *fb)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	struct weston_mode *mode = output->base.current_mode;
+	struct drm_sprite *p = output->kms_primary;
+	struct drm_sprite *s;
+	uint32_t fb_id;
+
+	p->src_x = 0;
+	p->src_y = 0;
+	p->src_w = mode->width << 16;
+	p->src_h = mode->height << 16;
+	p->dest_x = 0;
+	p->dest_y = 0;
+	p->dest_w = mode->width;
+	p->dest_h = mode->height;
+	if (drm_sprite_add_state(req, p, output->crtc_id, fb->fb_id) < 0)
+		return -1;
+
+	wl_list_for_each(s, &c->sprite_list, link) {
+		if (s->output != output || (!s->current && !s->next))
+			continue;
+
+		fb_id = 0;
+		if (s->next && !c->sprites_hidden)
+			fb_id = s->next->fb_id;
+
+		if (drm_sprite_add_state(req, s, fb_id ? output->crtc_id : 0,
+					 fb_id) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int
+drm_output_atomic_add_cursor(struct drm_output *output,
+			     drmModeAtomicReq *req)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	struct weston_view *ev = output->cursor_view;
+	struct drm_sprite *p = output->kms_cursor;
+
+	output->cursor_view = NULL;
+	if (ev == NULL)
+		return drm_sprite_add_state(req, p, 0, 0);
+
+	drm_output_update_cursor_bo(output, ev);
+
+	p->src_x = 0;
+	p->src_y = 0;
+	p->src_w = c->cursor_width << 16;
+	p->src_h = c->cursor_height << 16;
+	p->dest_x = (ev->geometry.x - output->base.x) *
+		output->base.current_scale;
+	p->dest_y = (ev->geometry.y - output->base.y) *
+		output->base.current_scale;
+	p->dest_w = c->cursor_width;
+	p->dest_h = c->cursor_height;
+	output->cursor_plane.x = p->dest_x;
+	output->cursor_plane.y = p->dest_y;
+
+	return drm_sprite_add_state(req, p, output->crtc_id,
+				    output->cursor_fb[output->current_cursor]->fb_id);
+}
+
+/* Asks the kernel whether the planes assigned so far can be shown
+ * together, without changing anything. */
+static int
+drm_output_atomic_test(struct drm_output *output)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	struct drm_fb *fb = output->next ? output->next : output->current;
+	drmModeAtomicReq *req;
+	int ret;
+
+	/* The first frame is a legacy mode set, nothing to test with */
+	if (!fb)
+		return -1;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+
+	ret = drm_output_atomic_add_planes(output, req, fb);
+	if (ret == 0)
+		ret = drmModeAtomicCommit(c->drm.fd, req,
+					  DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	drmModeAtomicFree(req);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/* Flips the primary plane to output->next and updates the overlays and
+ * the cursor, all at the same vblank. */
+static int
+drm_output_atomic_commit(struct drm_output *output)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	drmModeAtomicReq *req;
+	int ret;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+
+	ret = drm_output_atomic_add_planes(output, req, output->next);
+	if (ret == 0 && output->kms_cursor)
+		ret = drm_output_atomic_add_cursor(output, req);
+	if (ret == 0)
+		ret = drmModeAtomicCommit(c->drm.fd, req,
+					  DRM_MODE_PAGE_FLIP_EVENT |
+					  DRM_MODE_ATOMIC_NONBLOCK, output);
+	drmModeAtomicFree(req);
+
+	return ret < 0 ? -1 : 0;
+}
+#endif
+
+/* Most overlays planned for one output */
+#define DRM_MAX_OVERLAYS 8
+
+/* The views an output repaint tries to put on overlays */
+struct drm_overlay_plan {
+	struct weston_view *views[DRM_MAX_OVERLAYS];
+	int count;
+	int free; /* overlays the output can use */
+};
+
+struct drm_overlay_candidate {
+	struct weston_view *view;
+	uint64_t score;
+};
+
+static int
+drm_overlay_plan_has(struct drm_overlay_plan *plan, struct weston_view *ev)
+{
+	int i;
+
+	for (i = 0; i < plan->count; i++)
+		if (plan->views[i] == ev)
+			return 1;
+
+	return 0;
+}
+
+static int
+drm_output_free_overlays(struct drm_output *output)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	struct drm_sprite *s;
+	int count = 0;
+
+	wl_list_for_each(s, &c->sprite_list, link) {
+		if (!drm_sprite_crtc_supported(&output->base, s->possible_crtcs))
+			continue;
+		if (s->next)
+			continue;
+		if (c->atomic_modeset && s->current && s->output != output)
+			continue;
+		count++;
+	}
+
+	return count < DRM_MAX_OVERLAYS ? count : DRM_MAX_OVERLAYS;
+}
+
+/* What putting the view on an overlay saves: the area of it the renderer
+ * would otherwise composite, times in how many of the last 32 repaints
+ * it was damaged. A view that never changes saves nothing. */
+static uint64_t
+drm_view_overlay_score(struct weston_output *output, struct weston_view *ev)
+{
+	pixman_region32_t visible;
+	pixman_box32_t *box;
+	uint64_t area;
+
+	pixman_region32_init(&visible);
+	pixman_region32_intersect(&visible, &ev->transform.boundingbox,
+				  &output->region);
+	box = pixman_region32_extents(&visible);
+	area = (uint64_t) (box->x2 - box->x1) * (box->y2 - box->y1);
+	pixman_region32_fini(&visible);
+
+	return area * __builtin_popcount(ev->surface->damage_history);
+}
+
+/* Adds ev to the plan, along with every view above it that overlaps it
+ * or one of the views added for it: overlays are shown above the
+ * primary plane, so none of those can stay there. Fails if one of them
+ * can't go on an overlay or there are not enough free, or if overlays
+ * would overlap and their stacking is not known. */
+static int
+drm_overlay_plan_add(struct drm_overlay_plan *plan,
+		     struct weston_output *output, struct weston_view *ev)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct drm_compositor *c = (struct drm_compositor *) ec;
+	struct weston_view *added[DRM_MAX_OVERLAYS], *above;
+	pixman_region32_t region, overlap;
+	int count = 0, ret = -1;
+
+	if (plan->count == plan->free)
+		return -1;
+
+	added[count++] = ev;
+	pixman_region32_init(&overlap);
+	pixman_region32_init(&region);
+	pixman_region32_copy(&region, &ev->transform.boundingbox);
+
+	for (above = container_of(ev->link.prev, struct weston_view, link);
+	     &above->link != &ec->view_list;
+	     above = container_of(above->link.prev, struct weston_view, link)) {
+		if (above->occluded)
+			continue;
+
+		pixman_region32_intersect(&overlap, &region,
+					  &above->transform.boundingbox);
+		if (!pixman_region32_not_empty(&overlap))
+			continue;
+
+		/* The cursor plane is on top of everything */
+		if (drm_view_cursor_candidate(output, above))
+			continue;
+
+		if (!c->overlays_stacked)
+			goto out;
+
+		if (drm_overlay_plan_has(plan, above))
+			continue;
+
+		if (!drm_view_overlay_candidate(output, above) ||
+		    plan->count + count == plan->free)
+			goto out;
+
+		added[count++] = above;
+		pixman_region32_union(&region, &region,
+				      &above->transform.boundingbox);
+	}
+
+	memcpy(&plan->views[plan->count], added, count * sizeof added[0]);
+	plan->count += count;
+	ret = 0;
+
+out:
+	pixman_region32_fini(&region);
+	pixman_region32_fini(&overlap);
+
+	return ret;
+}
+
+static int
+compare_overlay_candidates(const void *a, const void *b)
+{
+	const struct drm_overlay_candidate *ca = a, *cb = b;
+
+	if (ca->score == cb->score)
+		return 0;
+
+	return ca->score < cb->score ? 1 : -1;
+}
+
+/* Picks the views to put on the free overlays, the ones saving the most
+ * compositing first. */
+static void
+drm_output_plan_overlays(struct drm_output *output,
+			 struct drm_overlay_plan *plan)
+{
+	struct weston_compositor *ec = output->base.compositor;
+	struct drm_overlay_candidate *candidates, *cand;
+	struct weston_view *ev;
+	struct wl_array array;
+	uint64_t score;
+	int i, n;
+
+	plan->count = 0;
+	plan->free = drm_output_free_overlays(output);
+	if (plan->free == 0)
+		return;
+
+	wl_array_init(&array);
+
+	wl_list_for_each(ev, &ec->view_list, link) {
+		if (ev->occluded ||
+		    !drm_view_overlay_candidate(&output->base, ev))
+			continue;
+
+		score = drm_view_overlay_score(&output->base, ev);
+		if (score == 0)
+			continue;
+
+		cand = wl_array_add(&array, sizeof *cand);
+		if (!cand)
+			break;
+		cand->view = ev;
+		cand->score = score;
+	}
+
+	candidates = array.data;
+	n = array.size / sizeof *candidates;
+	qsort(candidates, n, sizeof *candidates, compare_overlay_candidates);
+
+	for (i = 0; i < n && plan->count < plan->free; i++)
+		if (!drm_overlay_plan_has(plan, candidates[i].view))
+			drm_overlay_plan_add(plan, &output->base,
+					     candidates[i].view);
+
+	wl_array_release(&array);
+}
+
 static void
 drm_assign_planes(struct weston_output *output)
 {
@@ -1079,20 +1626,22 @@ drm_assign_planes(struct weston_output *output)
 	struct weston_view *ev, *next;
 	pixman_region32_t overlap, surface_overlap;
 	struct weston_plane *primary, *next_plane;
+	struct drm_overlay_plan plan;
 
 	/*
-	 * Find a surface for each sprite in the output using some heuristics:
-	 * 1) size
-	 * 2) frequency of update
-	 * 3) opacity (though some hw might support alpha blending)
-	 * 4) clipping (this can be fixed with color keys)
-	 *
-	 * The idea is to save on blitting since this should save power.
+	 * The overlays go to the views that save the most blitting, by
+	 * size and frequency of update, see drm_output_plan_overlays().
 	 * If we can get a large video surface on the sprite for example,
 	 * the main display surface may not need to update at all, and
 	 * the client buffer can be used directly for the sprite surface
 	 * as we do for flipping full screen surfaces.
+	 *
+	 * A planned view that turns out not to work on its overlay goes
+	 * to the primary plane, and so does every view below overlapping
+	 * it, as before.
 	 */
+	drm_output_plan_overlays((struct drm_output *) output, &plan);
+
 	pixman_region32_init(&overlap);
 	primary = &c->base.primary_plane;
 
@@ -1115,6 +1664,13 @@ drm_assign_planes(struct weston_output *output)
 		else
 			es->keep_buffer = 0;
 
+		/* Nothing of it is visible, so it is not worth a plane and
+		 * does not force the views below it onto the primary one. */
+		if (ev->occluded) {
+			weston_view_move_to_plane(ev, primary);
+			continue;
+		}
+
 		pixman_region32_init(&surface_overlap);
 		pixman_region32_intersect(&surface_overlap, &overlap,
 					  &ev->transform.boundingbox);
@@ -1126,7 +1682,7 @@ drm_assign_planes(struct weston_output *output)
 			next_plane = drm_output_prepare_cursor_view(output, ev);
 		if (next_plane == NULL)
 			next_plane = drm_output_prepare_scanout_view(output, ev);
-		if (next_plane == NULL)
+		if (next_plane == NULL && drm_overlay_plan_has(&plan, ev))
 			next_plane = drm_output_prepare_overlay_view(output, ev);
 		if (next_plane == NULL)
 			next_plane = primary;
@@ -1150,10 +1706,11 @@ drm_output_destroy(struct weston_output *output_base)
 	struct drm_compositor *c =
 		(struct drm_compositor *) output->base.compositor;
 	drmModeCrtcPtr origcrtc = output->original_crtc;
+	struct drm_sprite *s;
 
-	if (output->page_flip_pending) {
+	if (output->frame_events > 0) {
 		output->destroy_pending = 1;
-		weston_log("destroy output while page flip pending\n");
+		weston_log("destroy output while frame events pending\n");
 		return;
 	}
 
@@ -1165,6 +1722,25 @@ drm_output_destroy(struct weston_output *output_base)
 	/* Turn off hardware cursor */
 	drmModeSetCursor(c->drm.fd, output->crtc_id, 0, 0, 0);
 
+	if (c->atomic_modeset) {
+		wl_list_for_each(s, &c->sprite_list, link) {
+			if (s->output != output)
+				continue;
+			drmModeSetPlane(c->drm.fd, s->plane_id,
+					output->crtc_id, 0, 0,
+					0, 0, 0, 0, 0, 0, 0, 0);
+			drm_output_release_fb(output, s->current);
+			drm_output_release_fb(output, s->next);
+			s->current = NULL;
+			s->next = NULL;
+			s->output = NULL;
+		}
+	}
+	if (output->kms_primary)
+		output->kms_primary->output = NULL;
+	if (output->kms_cursor)
+		output->kms_cursor->output = NULL;
+
 	/* Restore original CRTC state */
 	drmModeSetCrtc(c->drm.fd, origcrtc->crtc_id, origcrtc->buffer_id,
 		       origcrtc->x, origcrtc->y,
@@ -1350,6 +1926,22 @@ init_drm(struct drm_compositor *ec, struct udev_device *device)
 	else
 		ec->cursor_height = 64;
 
+#ifdef HAVE_DRM_ATOMIC
+	if (ec->atomic_modeset) {
+		ret = drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+		if (ret == 0)
+			ret = drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1);
+		if (ret != 0) {
+			drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 0);
+			ec->atomic_modeset = 0;
+		}
+	}
+#else
+	ec->atomic_modeset = 0;
+#endif
+	weston_log("atomic modesetting: %s\n",
+		   ec->atomic_modeset ? "yes" : "no");
+
 	return 0;
 }
 
@@ -1636,6 +2228,8 @@ drm_output_init_pixman(struct drm_output *output, struct drm_compositor *c)
 
 	/* FIXME error checking */
 
+	output->pixman_frame = 0;
+
 	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
 		output->dumb[i] = drm_fb_create_dumb(c, w, h);
 		if (!output->dumb[i])
@@ -1652,8 +2246,7 @@ drm_output_init_pixman(struct drm_output *output, struct drm_compositor *c)
 	if (pixman_renderer_output_create(&output->base) < 0)
 		goto err;
 
-	pixman_region32_init_rect(&output->previous_damage,
-				  output->base.x, output->base.y, output->base.width, output->base.height);
+	pixman_region32_init(&output->previous_damage);
 
 	return 0;
 
@@ -1942,6 +2535,57 @@ get_gbm_format_from_section(struct weston_config_section *section,
 	return ret;
 }
 
+#ifdef HAVE_DRM_ATOMIC
+/* Claims a primary and, if the cursor bos are there, a cursor plane
+ * for the output. Without a primary plane the compositor falls back to
+ * legacy modesetting. */
+static void
+drm_output_init_atomic(struct drm_output *output, struct drm_compositor *ec)
+{
+	struct drm_sprite *p;
+	int i;
+
+	wl_list_for_each(p, &ec->plane_list, link) {
+		if (p->output || !(p->possible_crtcs & (1 << output->pipe)))
+			continue;
+
+		if (p->type == DRM_PLANE_TYPE_PRIMARY && !output->kms_primary)
+			output->kms_primary = p;
+		else if (p->type == DRM_PLANE_TYPE_CURSOR &&
+			 !output->kms_cursor)
+			output->kms_cursor = p;
+		else
+			continue;
+
+		p->output = output;
+	}
+
+	if (!output->kms_primary) {
+		weston_log("no primary plane for %s, "
+			   "disabling atomic modesetting\n", output->base.name);
+		ec->atomic_modeset = 0;
+		ec->sprites_are_broken = 1;
+		return;
+	}
+
+	if (!output->kms_cursor)
+		return;
+
+	/* The cursor is shown through the legacy ioctls then */
+	for (i = 0; i < 2 && output->cursor_bo[i]; i++) {
+		output->cursor_fb[i] =
+			drm_fb_get_from_bo(output->cursor_bo[i], ec,
+					   GBM_FORMAT_ARGB8888);
+		if (!output->cursor_fb[i])
+			break;
+	}
+	if (i < 2) {
+		output->kms_cursor->output = NULL;
+		output->kms_cursor = NULL;
+	}
+}
+#endif
+
 static int
 create_output_for_connector(struct drm_compositor *ec,
 			    drmModeRes *resources,
@@ -2118,6 +2762,11 @@ create_output_for_connector(struct drm_compositor *ec,
 		goto err_output;
 	}
 
+#ifdef HAVE_DRM_ATOMIC
+	if (ec->atomic_modeset)
+		drm_output_init_atomic(output, ec);
+#endif
+
 	output->backlight = backlight_init(drm_device,
 					   connector->connector_type);
 	if (output->backlight) {
@@ -2141,6 +2790,8 @@ create_output_for_connector(struct drm_compositor *ec,
 	output->base.assign_planes = drm_assign_planes;
 	output->base.set_dpms = drm_set_dpms;
 	output->base.switch_mode = drm_output_switch_mode;
+	/* finish_frame is driven by page flip events */
+	output->base.vblank_stamps = 1;
 
 	output->base.gamma_size = output->original_crtc->gamma_size;
 	output->base.set_gamma = drm_output_set_gamma;
@@ -2183,6 +2834,93 @@ err_free:
 	return -1;
 }
 
+#ifdef HAVE_DRM_ATOMIC
+static const char * const plane_prop_names[] = {
+	[PLANE_PROP_TYPE] = "type",
+	[PLANE_PROP_FB_ID] = "FB_ID",
+	[PLANE_PROP_CRTC_ID] = "CRTC_ID",
+	[PLANE_PROP_SRC_X] = "SRC_X",
+	[PLANE_PROP_SRC_Y] = "SRC_Y",
+	[PLANE_PROP_SRC_W] = "SRC_W",
+	[PLANE_PROP_SRC_H] = "SRC_H",
+	[PLANE_PROP_CRTC_X] = "CRTC_X",
+	[PLANE_PROP_CRTC_Y] = "CRTC_Y",
+	[PLANE_PROP_CRTC_W] = "CRTC_W",
+	[PLANE_PROP_CRTC_H] = "CRTC_H",
+};
+
+/* Looks up the ids of the plane properties and the plane type */
+static int
+drm_sprite_get_props(struct drm_compositor *ec, struct drm_sprite *sprite)
+{
+	drmModeObjectProperties *props;
+	drmModePropertyRes *prop;
+	uint32_t i, j, found = 0;
+
+	props = drmModeObjectGetProperties(ec->drm.fd, sprite->plane_id,
+					   DRM_MODE_OBJECT_PLANE);
+	if (!props)
+		return -1;
+
+	for (i = 0; i < props->count_props; i++) {
+		prop = drmModeGetProperty(ec->drm.fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		for (j = 0; j < PLANE_PROP_COUNT; j++) {
+			if (strcmp(prop->name, plane_prop_names[j]) != 0)
+				continue;
+
+			sprite->props[j] = prop->prop_id;
+			if (j == PLANE_PROP_TYPE)
+				sprite->type = props->prop_values[i];
+			found++;
+		}
+
+		/* Optional, we only read the stacking the driver has */
+		if (strcmp(prop->name, "zpos") == 0) {
+			sprite->has_zpos = 1;
+			sprite->zpos = props->prop_values[i];
+		}
+
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+
+	return found == PLANE_PROP_COUNT ? 0 : -1;
+}
+#endif
+
+/* Keeps sprite_list sorted from the topmost overlay down */
+static void
+drm_sprite_list_insert(struct drm_compositor *ec, struct drm_sprite *sprite)
+{
+	struct drm_sprite *s;
+
+	wl_list_for_each(s, &ec->sprite_list, link)
+		if (s->zpos < sprite->zpos)
+			break;
+
+	wl_list_insert(s->link.prev, &sprite->link);
+}
+
+static int
+drm_sprites_stacked(struct drm_compositor *ec)
+{
+	struct drm_sprite *s, *prev = NULL;
+
+	wl_list_for_each(s, &ec->sprite_list, link) {
+		if (!s->has_zpos)
+			return 0;
+		if (prev && prev->zpos == s->zpos)
+			return 0;
+		prev = s;
+	}
+
+	return 1;
+}
+
 static void
 create_sprites(struct drm_compositor *ec)
 {
@@ -2221,14 +2959,38 @@ create_sprites(struct drm_compositor *ec)
 		memcpy(sprite->formats, plane->formats,
 		       plane->count_formats * sizeof(plane->formats[0]));
 		drmModeFreePlane(plane);
+
+#ifdef HAVE_DRM_ATOMIC
+		if (ec->atomic_modeset &&
+		    drm_sprite_get_props(ec, sprite) < 0) {
+			weston_log("plane %u lacks atomic properties, "
+				   "ignoring it\n", sprite->plane_id);
+			free(sprite);
+			continue;
+		}
+
+		/* With universal planes the primary and cursor planes
+		 * are listed too, outputs claim them */
+		if (ec->atomic_modeset &&
+		    sprite->type != DRM_PLANE_TYPE_OVERLAY) {
+			wl_list_insert(&ec->plane_list, &sprite->link);
+			continue;
+		}
+#endif
+
 		weston_plane_init(&sprite->plane, &ec->base, 0, 0);
 		weston_compositor_stack_plane(&ec->base, &sprite->plane,
 					      &ec->base.primary_plane);
 
-		wl_list_insert(&ec->sprite_list, &sprite->link);
+		drm_sprite_list_insert(ec, sprite);
 	}
 
 	drmModeFreePlaneResources(plane_res);
+
+	ec->overlays_stacked = ec->atomic_modeset && drm_sprites_stacked(ec);
+	if (ec->atomic_modeset && !ec->overlays_stacked)
+		weston_log("overlay planes have no distinct zpos, "
+			   "overlapping views are kept off them\n");
 }
 
 static void
@@ -2250,6 +3012,9 @@ destroy_sprites(struct drm_compositor *compositor)
 		weston_plane_release(&sprite->plane);
 		free(sprite);
 	}
+
+	wl_list_for_each_safe(sprite, next, &compositor->plane_list, link)
+		free(sprite);
 }
 
 static int
@@ -2792,6 +3557,8 @@ drm_compositor_create(struct wl_display *display,
 					GBM_FORMAT_XRGB8888,
 					&ec->format) == -1)
 		goto err_base;
+	weston_config_section_get_bool(section, "atomic-modesetting",
+				       &ec->atomic_modeset, 1);
 
 	ec->use_pixman = param->use_pixman;
 
@@ -2835,6 +3602,11 @@ drm_compositor_create(struct wl_display *display,
 		goto err_udev_dev;
 	}
 
+	/* Atomic commits are tested before they are made, so a plane
+	 * configuration the hardware can't do is never shown */
+	if (ec->atomic_modeset)
+		ec->sprites_are_broken = 0;
+
 	if (ec->use_pixman) {
 		if (init_pixman(ec) < 0) {
 			weston_log("failed to initialize pixman renderer\n");
@@ -2858,6 +3630,7 @@ drm_compositor_create(struct wl_display *display,
 						  switch_vt_binding, ec);
 
 	wl_list_init(&ec->sprite_list);
+	wl_list_init(&ec->plane_list);
 	create_sprites(ec);
 
 	if (udev_input_init(&ec->input,
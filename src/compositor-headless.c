@@ -25,19 +25,61 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/time.h>
 
 #include "compositor.h"
+#include "pixman-renderer.h"
+
+/* With --dump, every repaint of the pixman renderer appends one record
+ * to the dump file: a struct headless_dump_frame, then for each of its
+ * rectangles a struct headless_dump_rect followed by the rectangle's
+ * rows of x8r8g8b8 pixels, (x2 - x1) * 4 bytes each, tightly packed.
+ * Without --dump-damage there is a single rectangle covering the whole
+ * output. All fields are in host byte order.
+ */
+#define HEADLESS_DUMP_MAGIC 0x57484446 /* "WHDF" */
+
+struct headless_dump_frame {
+	uint32_t magic;
+	uint32_t sequence;
+	uint32_t width;
+	uint32_t height;
+	uint32_t n_rects;
+	uint32_t pad;
+	uint64_t time_ns; /* presentation clock */
+};
+
+struct headless_dump_rect {
+	int32_t x1, y1, x2, y2;
+};
+
+struct headless_parameters {
+	int width;
+	int height;
+	int use_pixman;
+	char *dump_path;
+	int dump_fd;
+	int dump_damage;
+};
 
 struct headless_compositor {
 	struct weston_compositor base;
 	struct weston_seat fake_seat;
+	int use_pixman;
+	int dump_fd; /* -1 when not dumping */
+	int dump_damage;
+	uint32_t dump_sequence;
 };
 
 struct headless_output {
 	struct weston_output base;
 	struct weston_mode mode;
 	struct wl_event_source *finish_frame_timer;
+	uint32_t *image_buf;
+	pixman_image_t *image;
 };
 
 
@@ -58,15 +100,110 @@ finish_frame_handler(void *data)
 	return 1;
 }
 
+static int
+write_all(int fd, const void *data, size_t size)
+{
+	const char *p = data;
+	ssize_t len;
+
+	while (size > 0) {
+		len = write(fd, p, size);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0)
+			return -1;
+		p += len;
+		size -= len;
+	}
+
+	return 0;
+}
+
+static int
+headless_output_dump(struct headless_output *output,
+		     pixman_region32_t *damage)
+{
+	struct headless_compositor *c =
+		(struct headless_compositor *) output->base.compositor;
+	struct headless_dump_frame frame;
+	struct headless_dump_rect rect;
+	pixman_region32_t region;
+	pixman_box32_t *boxes;
+	struct timespec ts;
+	int width = output->base.current_mode->width;
+	int n, i, y, ret = 0;
+
+	pixman_region32_init(&region);
+	if (c->dump_damage) {
+		/* The output sits at 0,0 with scale 1 and no transform, so
+		 * global and buffer coordinates are the same. */
+		pixman_region32_intersect(&region, damage,
+					  &output->base.region);
+	} else {
+		pixman_region32_copy(&region, &output->base.region);
+	}
+	boxes = pixman_region32_rectangles(&region, &n);
+
+	clock_gettime(c->base.presentation_clock, &ts);
+
+	memset(&frame, 0, sizeof frame);
+	frame.magic = HEADLESS_DUMP_MAGIC;
+	frame.sequence = c->dump_sequence++;
+	frame.width = width;
+	frame.height = output->base.current_mode->height;
+	frame.n_rects = n;
+	frame.time_ns = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+	if (write_all(c->dump_fd, &frame, sizeof frame) < 0)
+		ret = -1;
+
+	for (i = 0; i < n && ret == 0; i++) {
+		rect.x1 = boxes[i].x1;
+		rect.y1 = boxes[i].y1;
+		rect.x2 = boxes[i].x2;
+		rect.y2 = boxes[i].y2;
+		if (write_all(c->dump_fd, &rect, sizeof rect) < 0)
+			ret = -1;
+
+		/* Whole rows are contiguous in the buffer */
+		if (rect.x1 == 0 && rect.x2 == width) {
+			if (write_all(c->dump_fd,
+				      output->image_buf + rect.y1 * width,
+				      (rect.y2 - rect.y1) * width * 4) < 0)
+				ret = -1;
+			continue;
+		}
+
+		for (y = rect.y1; y < rect.y2 && ret == 0; y++)
+			if (write_all(c->dump_fd,
+				      output->image_buf + y * width + rect.x1,
+				      (rect.x2 - rect.x1) * 4) < 0)
+				ret = -1;
+	}
+
+	pixman_region32_fini(&region);
+
+	return ret;
+}
+
 static int
 headless_output_repaint(struct weston_output *output_base,
 		       pixman_region32_t *damage)
 {
 	struct headless_output *output = (struct headless_output *) output_base;
 	struct weston_compositor *ec = output->base.compositor;
+	struct headless_compositor *c = (struct headless_compositor *) ec;
 
 	ec->renderer->repaint_output(&output->base, damage);
 
+	if (c->dump_fd >= 0 && output->image &&
+	    headless_output_dump(output, damage) < 0) {
+		weston_log("headless: failed to dump frame: %m, "
+			   "stopping the dump\n");
+		close(c->dump_fd);
+		c->dump_fd = -1;
+	}
+
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
@@ -79,8 +216,18 @@ static void
 headless_output_destroy(struct weston_output *output_base)
 {
 	struct headless_output *output = (struct headless_output *) output_base;
+	struct headless_compositor *c =
+		(struct headless_compositor *) output->base.compositor;
 
 	wl_event_source_remove(output->finish_frame_timer);
+
+	if (c->use_pixman) {
+		pixman_renderer_output_destroy(&output->base);
+		if (output->image)
+			pixman_image_unref(output->image);
+		free(output->image_buf);
+	}
+
 	free(output);
 
 	return;
@@ -124,9 +271,40 @@ headless_compositor_create_output(struct headless_compositor *c,
 	output->base.set_dpms = NULL;
 	output->base.switch_mode = NULL;
 
+	if (c->use_pixman) {
+		output->image_buf = malloc(width * height * 4);
+		if (!output->image_buf)
+			goto err_output;
+
+		output->image = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+							 width, height,
+							 output->image_buf,
+							 width * 4);
+		if (!output->image)
+			goto err_buf;
+
+		if (pixman_renderer_output_create(&output->base) < 0)
+			goto err_image;
+
+		pixman_renderer_output_set_buffer(&output->base,
+						  output->image);
+	}
+
 	wl_list_insert(c->base.output_list.prev, &output->base.link);
 
 	return 0;
+
+err_image:
+	pixman_image_unref(output->image);
+err_buf:
+	free(output->image_buf);
+err_output:
+	wl_event_source_remove(output->finish_frame_timer);
+	wl_list_init(&output->base.link);
+	weston_output_destroy(&output->base);
+	free(output);
+
+	return -1;
 }
 
 static int
@@ -161,12 +339,55 @@ headless_destroy(struct weston_compositor *ec)
 	headless_input_destroy(c);
 	weston_compositor_shutdown(ec);
 
+	if (c->dump_fd >= 0)
+		close(c->dump_fd);
+
 	free(ec);
 }
 
+static int
+headless_dump_open(struct headless_compositor *c,
+		   struct headless_parameters *param)
+{
+	c->dump_fd = -1;
+	c->dump_damage = param->dump_damage;
+
+	/* An fd from the parent, e.g. a memfd a test harness reads the
+	 * frames back from */
+	if (param->dump_fd >= 0) {
+		c->dump_fd = param->dump_fd;
+		fcntl(c->dump_fd, F_SETFD, FD_CLOEXEC);
+	} else if (param->dump_path) {
+		c->dump_fd = open(param->dump_path,
+				  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+				  0644);
+		if (c->dump_fd < 0) {
+			weston_log("headless: failed to open %s: %m\n",
+				   param->dump_path);
+			return -1;
+		}
+	} else {
+		return 0;
+	}
+
+	if (!c->use_pixman) {
+		weston_log("headless: frame dumps need --use-pixman\n");
+		close(c->dump_fd);
+		c->dump_fd = -1;
+		return -1;
+	}
+
+	weston_log("headless: dumping %s to %s\n",
+		   c->dump_damage ? "damage" : "frames",
+		   param->dump_path ? param->dump_path : "the given fd");
+
+	return 0;
+}
+
 static struct weston_compositor *
 headless_compositor_create(struct wl_display *display,
-			   int width, int height, const char *display_name,
+			   struct headless_parameters *param,
+			   const char *display_name,
 			   int *argc, char *argv[],
 			   struct weston_config *config)
 {
@@ -176,6 +397,9 @@ headless_compositor_create(struct wl_display *display,
 	if (c == NULL)
 		return NULL;
 
+	c->use_pixman = param->use_pixman;
+	c->dump_fd = -1;
+
 	if (weston_compositor_init(&c->base, display, argc, argv, config) < 0)
 		goto err_free;
 
@@ -188,14 +412,27 @@ headless_compositor_create(struct wl_display *display,
 	c->base.destroy = headless_destroy;
 	c->base.restore = headless_restore;
 
-	if (headless_compositor_create_output(c, width, height) < 0)
-		goto err_input;
+	/* The pixman renderer has to be there before the output */
+	if (c->use_pixman) {
+		if (pixman_renderer_init(&c->base) < 0)
+			goto err_input;
+	} else {
+		if (noop_renderer_init(&c->base) < 0)
+			goto err_input;
+	}
 
-	if (noop_renderer_init(&c->base) < 0)
+	if (headless_dump_open(c, param) < 0)
 		goto err_input;
 
+	if (headless_compositor_create_output(c, param->width,
+					      param->height) < 0)
+		goto err_dump;
+
 	return &c->base;
 
+err_dump:
+	if (c->dump_fd >= 0)
+		close(c->dump_fd);
 err_input:
 	headless_input_destroy(c);
 err_compositor:
@@ -209,17 +446,29 @@ WL_EXPORT struct weston_compositor *
 backend_init(struct wl_display *display, int *argc, char *argv[],
 	     struct weston_config *config)
 {
-	int width = 1024, height = 640;
+	struct headless_parameters param = {
+		.width = 1024,
+		.height = 640,
+		.dump_fd = -1,
+	};
+	struct weston_compositor *ec;
 	char *display_name = NULL;
 
 	const struct weston_option headless_options[] = {
-		{ WESTON_OPTION_INTEGER, "width", 0, &width },
-		{ WESTON_OPTION_INTEGER, "height", 0, &height },
+		{ WESTON_OPTION_INTEGER, "width", 0, &param.width },
+		{ WESTON_OPTION_INTEGER, "height", 0, &param.height },
+		{ WESTON_OPTION_BOOLEAN, "use-pixman", 0, &param.use_pixman },
+		{ WESTON_OPTION_STRING, "dump", 0, &param.dump_path },
+		{ WESTON_OPTION_INTEGER, "dump-fd", 0, &param.dump_fd },
+		{ WESTON_OPTION_BOOLEAN, "dump-damage", 0, &param.dump_damage },
 	};
 
 	parse_options(headless_options,
 		      ARRAY_LENGTH(headless_options), argc, argv);
 
-	return headless_compositor_create(display, width, height, display_name,
-					  argc, argv, config);
+	ec = headless_compositor_create(display, &param, display_name,
+					argc, argv, config);
+	free(param.dump_path);
+
+	return ec;
 }
@@ -59,6 +59,8 @@
 #include "../shared/os-compatibility.h"
 #include "git-version.h"
 #include "version.h"
+#include "view-grid.h"
+#include "frame-profiler.h"
 
 #include "postcompositor-rift.h"
 
@@ -403,6 +405,12 @@ weston_view_create(struct weston_surface *surface)
 	if (view == NULL)
 		return NULL;
 
+	view->grid_entry = zalloc(sizeof *view->grid_entry);
+	if (view->grid_entry == NULL) {
+		free(view);
+		return NULL;
+	}
+
 	view->surface = surface;
 
 	/* Assign to surface */
@@ -411,6 +419,7 @@ weston_view_create(struct weston_surface *surface)
 	wl_signal_init(&view->destroy_signal);
 	wl_list_init(&view->link);
 	wl_list_init(&view->layer_link.link);
+	wl_list_init(&view->plane_link);
 
 	view->plane = NULL;
 	view->layer_link.layer = NULL;
@@ -430,6 +439,10 @@ weston_view_create(struct weston_surface *surface)
 	wl_list_init(&view->geometry.child_list);
 	pixman_region32_init(&view->transform.boundingbox);
 	view->transform.dirty = 1;
+	wl_list_insert(&surface->compositor->transform_dirty_list,
+		       &view->transform.dirty_link);
+	view_grid_entry_init(view->grid_entry);
+	view->grid_entry->data = view;
 
 	view->output = NULL;
 
@@ -997,6 +1010,9 @@ weston_surface_assign_output(struct weston_surface *es)
 	}
 	pixman_region32_fini(&region);
 
+	/* Mapped subsurfaces get views of their own in the view list */
+	if (!es->output != !new_output)
+		es->compositor->view_list_needs_rebuild = 1;
 	es->output = new_output;
 	weston_surface_update_output_mask(es, mask);
 }
@@ -1171,6 +1187,8 @@ weston_view_update_transform(struct weston_view *view)
 		weston_view_update_transform(parent);
 
 	view->transform.dirty = 0;
+	wl_list_remove(&view->transform.dirty_link);
+	wl_list_init(&view->transform.dirty_link);
 
 	weston_view_damage_below(view);
 
@@ -1200,6 +1218,10 @@ weston_view_update_transform(struct weston_view *view)
 		pixman_region32_fini(&mask);
 	}
 
+	view_grid_update(view->surface->compositor->view_grid,
+			 view->grid_entry,
+			 pixman_region32_extents(&view->transform.masked_boundingbox));
+
 	weston_view_damage_below(view);
 
 	weston_view_assign_output(view);
@@ -1224,6 +1246,8 @@ weston_view_geometry_dirty(struct weston_view *view)
 		return;
 
 	view->transform.dirty = 1;
+	wl_list_insert(&view->surface->compositor->transform_dirty_list,
+		       &view->transform.dirty_link);
 
 	wl_list_for_each(child, &view->geometry.child_list,
 			 geometry.parent_link)
@@ -1485,28 +1509,58 @@ weston_compositor_get_time(void)
        return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+struct view_pick {
+	struct weston_compositor *compositor;
+	wl_fixed_t x, y;
+	struct weston_view *view;
+	wl_fixed_t vx, vy;
+};
+
+static int
+view_pick_test(struct view_grid_entry *entry, void *data)
+{
+	struct weston_view *view = entry->data;
+	struct view_pick *pick = data;
+	wl_fixed_t vx, vy;
+
+	/* Only views in the current view list count, and of those the
+	 * topmost one */
+	if (view->view_list_serial != pick->compositor->view_list_serial)
+		return 0;
+	if (pick->view &&
+	    view->view_list_index >= pick->view->view_list_index)
+		return 0;
+
+	weston_view_from_global_fixed(view, pick->x, pick->y, &vx, &vy);
+	if (pixman_region32_contains_point(&view->transform.masked_boundingbox,
+					   wl_fixed_to_int(pick->x),
+					   wl_fixed_to_int(pick->y), NULL) &&
+	    pixman_region32_contains_point(&view->surface->input,
+					   wl_fixed_to_int(vx),
+					   wl_fixed_to_int(vy), NULL)) {
+		pick->view = view;
+		pick->vx = vx;
+		pick->vy = vy;
+	}
+
+	return 0;
+}
+
 WL_EXPORT struct weston_view *
 weston_compositor_pick_view(struct weston_compositor *compositor,
 			    wl_fixed_t x, wl_fixed_t y,
 			    wl_fixed_t *vx, wl_fixed_t *vy)
 {
-	struct weston_view *view;
-        int ix = wl_fixed_to_int(x);
-        int iy = wl_fixed_to_int(y);
+	struct view_pick pick = { compositor, x, y, NULL, 0, 0 };
 
-	wl_list_for_each(view, &compositor->view_list, link) {
-		weston_view_from_global_fixed(view, x, y, vx, vy);
-		if (pixman_region32_contains_point(
-			&view->transform.masked_boundingbox,
-						   ix, iy, NULL) &&
-		    pixman_region32_contains_point(&view->surface->input,
-						   wl_fixed_to_int(*vx),
-						   wl_fixed_to_int(*vy),
-						   NULL))
-			return view;
-	}
+	view_grid_for_each_at(compositor->view_grid,
+			      wl_fixed_to_int(x), wl_fixed_to_int(y),
+			      view_pick_test, &pick);
 
-	return NULL;
+	*vx = pick.vx;
+	*vy = pick.vy;
+
+	return pick.view;
 }
 
 static void
@@ -1535,6 +1589,7 @@ weston_view_unmap(struct weston_view *view)
 	weston_layer_entry_remove(&view->layer_link);
 	wl_list_remove(&view->link);
 	wl_list_init(&view->link);
+	view->view_list_serial = 0;
 	view->output_mask = 0;
 	weston_surface_assign_output(view->surface);
 
@@ -1561,6 +1616,8 @@ weston_surface_unmap(struct weston_surface *surface)
 
 	wl_list_for_each(view, &surface->views, surface_link)
 		weston_view_unmap(view);
+	if (surface->output)
+		surface->compositor->view_list_needs_rebuild = 1;
 	surface->output = NULL;
 }
 
@@ -1593,6 +1650,9 @@ weston_view_destroy(struct weston_view *view)
 	pixman_region32_fini(&view->transform.boundingbox);
 	pixman_region32_fini(&view->transform.masked_boundingbox);
 	pixman_region32_fini(&view->transform.masked_opaque);
+	view_grid_remove(view->grid_entry);
+	free(view->grid_entry);
+	wl_list_remove(&view->transform.dirty_link);
 
 	weston_view_set_transform_parent(view, NULL);
 
@@ -1758,6 +1818,9 @@ weston_output_damage(struct weston_output *output)
 static void
 surface_flush_damage(struct weston_surface *surface)
 {
+	surface->damage_history = (surface->damage_history << 1) |
+		pixman_region32_not_empty(&surface->damage);
+
 	if (surface->buffer_ref.buffer &&
 	    wl_shm_buffer_get(surface->buffer_ref.buffer->resource))
 		surface->compositor->renderer->flush_damage(surface);
@@ -1798,6 +1861,42 @@ view_accumulate_damage(struct weston_view *view,
 	pixman_region32_union(opaque, opaque, &view->transform.masked_opaque);
 }
 
+static void
+compositor_cull_views(struct weston_compositor *ec)
+{
+	struct weston_view *ev;
+	pixman_region32_t opaque;
+	pixman_box32_t *box;
+
+	pixman_region32_init(&opaque);
+	ec->culled_views = 0;
+
+	wl_list_for_each(ev, &ec->view_list, link) {
+		box = pixman_region32_extents(&ev->transform.masked_boundingbox);
+		ev->occluded = pixman_region32_not_empty(&opaque) &&
+			pixman_region32_contains_rectangle(&opaque, box) ==
+			PIXMAN_REGION_IN;
+
+		if (ev->occluded) {
+			/* Everything above the view is opaque, keep the
+			 * clip right for weston_view_damage_below(). */
+			pixman_region32_copy(&ev->clip,
+					     &ev->transform.masked_boundingbox);
+			ec->culled_views++;
+			continue;
+		}
+
+		if (pixman_region32_not_empty(&ev->transform.masked_opaque))
+			pixman_region32_union(&opaque, &opaque,
+					      &ev->transform.masked_opaque);
+	}
+
+	pixman_region32_fini(&opaque);
+
+	ec->culled_views_total += ec->culled_views;
+	ec->culled_repaints++;
+}
+
 static void
 compositor_accumulate_damage(struct weston_compositor *ec)
 {
@@ -1805,6 +1904,22 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 	struct weston_view *ev;
 	pixman_region32_t opaque, clip;
 
+	/* Sort the views into per plane buckets, keeping their stacking
+	 * order, so each plane only walks its own views below instead of
+	 * the whole view list once per plane.
+	 */
+	wl_list_for_each(plane, &ec->plane_list, link)
+		wl_list_init(&plane->view_list);
+
+	wl_list_for_each(ev, &ec->view_list, link) {
+		ev->surface->touched = 0;
+		if (ev->plane && !ev->occluded)
+			wl_list_insert(ev->plane->view_list.prev,
+				       &ev->plane_link);
+		else
+			wl_list_init(&ev->plane_link);
+	}
+
 	pixman_region32_init(&clip);
 
 	wl_list_for_each(plane, &ec->plane_list, link) {
@@ -1812,12 +1927,8 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 
 		pixman_region32_init(&opaque);
 
-		wl_list_for_each(ev, &ec->view_list, link) {
-			if (ev->plane != plane)
-				continue;
-
+		wl_list_for_each(ev, &plane->view_list, plane_link)
 			view_accumulate_damage(ev, &opaque);
-		}
 
 		pixman_region32_union(&clip, &clip, &opaque);
 		pixman_region32_fini(&opaque);
@@ -1825,9 +1936,6 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 
 	pixman_region32_fini(&clip);
 
-	wl_list_for_each(ev, &ec->view_list, link)
-		ev->surface->touched = 0;
-
 	wl_list_for_each(ev, &ec->view_list, link) {
 		if (ev->surface->touched)
 			continue;
@@ -1950,11 +2058,58 @@ view_list_add(struct weston_compositor *compositor,
 	}
 }
 
+/* Shells reorder compositor->layer_list directly, so rather than
+ * tracking that, compare it with the order of the last build */
+static int
+view_list_layers_changed(struct weston_compositor *compositor)
+{
+	struct weston_layer *layer;
+	int i = 0;
+
+	wl_list_for_each(layer, &compositor->layer_list, link) {
+		if (i == WESTON_VIEW_LIST_LAYERS ||
+		    i == compositor->view_list_layer_count ||
+		    compositor->view_list_layers[i] != layer)
+			return 1;
+		i++;
+	}
+
+	return i != compositor->view_list_layer_count;
+}
+
 static void
 weston_compositor_build_view_list(struct weston_compositor *compositor)
 {
 	struct weston_view *view;
 	struct weston_layer *layer;
+	int index = 0;
+
+	if (!compositor->view_list_needs_rebuild &&
+	    !view_list_layers_changed(compositor)) {
+		/* Nothing was added, removed or restacked: only bring
+		 * the views that moved up to date. Dirty views outside
+		 * the list get updated once a rebuild adds them. */
+		while (!wl_list_empty(&compositor->transform_dirty_list)) {
+			view = container_of(compositor->transform_dirty_list.next,
+					    struct weston_view,
+					    transform.dirty_link);
+			if (view->view_list_serial ==
+			    compositor->view_list_serial) {
+				weston_view_update_transform(view);
+			} else {
+				wl_list_remove(&view->transform.dirty_link);
+				wl_list_init(&view->transform.dirty_link);
+			}
+		}
+
+		/* Updating a transform can map or unmap its surface,
+		 * whose subsurface views then come or go */
+		if (!compositor->view_list_needs_rebuild)
+			return;
+	}
+
+	compositor->view_list_needs_rebuild = 0;
+	compositor->view_list_rebuilds++;
 
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
@@ -1970,6 +2125,127 @@ weston_compositor_build_view_list(struct weston_compositor *compositor)
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_free_unused_subsurface_views(view->surface);
+
+	/* Picking goes through the view grid, which holds every view
+	 * with a transform; tag the ones actually in the list with
+	 * their stacking order. */
+	compositor->view_list_serial++;
+	wl_list_for_each(view, &compositor->view_list, link) {
+		view->view_list_serial = compositor->view_list_serial;
+		view->view_list_index = index++;
+	}
+
+	compositor->view_list_layer_count = 0;
+	wl_list_for_each(layer, &compositor->layer_list, link) {
+		if (compositor->view_list_layer_count ==
+		    WESTON_VIEW_LIST_LAYERS)
+			break;
+		compositor->view_list_layers[compositor->view_list_layer_count++] =
+			layer;
+	}
+}
+
+static void
+frame_profiler_binding(struct weston_seat *seat, uint32_t time,
+		       uint32_t key, void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct frame_profiler_record *records, *r;
+	struct weston_output *output;
+	uint64_t prev, d, sum[FRAME_STAGE_COUNT], max[FRAME_STAGE_COUNT];
+	uint64_t damage, repaint;
+	int n, i, frames, stage;
+
+	records = malloc(FRAME_PROFILER_SIZE * sizeof *records);
+	if (!records)
+		return;
+
+	n = frame_profiler_read(compositor->frame_profiler,
+				records, FRAME_PROFILER_SIZE);
+
+	wl_list_for_each(output, &compositor->output_list, link) {
+		memset(sum, 0, sizeof sum);
+		memset(max, 0, sizeof max);
+		damage = repaint = 0;
+		frames = 0;
+
+		for (i = 0; i < n; i++) {
+			r = &records[i];
+			if (r->output_id != output->id)
+				continue;
+
+			frames++;
+			damage += r->damage_area;
+			repaint += r->repaint_area;
+			prev = r->start;
+			for (stage = 0; stage < FRAME_STAGE_COUNT; stage++) {
+				d = r->end[stage] - prev;
+				prev = r->end[stage];
+				sum[stage] += d;
+				if (d > max[stage])
+					max[stage] = d;
+			}
+		}
+
+		if (frames == 0)
+			continue;
+
+		weston_log("frame profile of %s, last %d repaints, "
+			   "average/max us:\n",
+			   output->name ? output->name : "output", frames);
+		for (stage = 0; stage < FRAME_STAGE_COUNT; stage++)
+			weston_log_continue(STAMP_SPACE "%-16s %8.1f %8.1f\n",
+					    frame_profiler_stage_name(stage),
+					    sum[stage] / 1000.0 / frames,
+					    max[stage] / 1000.0);
+		weston_log_continue(STAMP_SPACE "average damage %.0f px, "
+				    "repainted %.0f px\n",
+				    (double) damage / frames,
+				    (double) repaint / frames);
+	}
+
+	free(records);
+}
+
+static int
+view_list_stats_report(void *data)
+{
+	struct weston_compositor *compositor = data;
+
+	weston_log("view list: %u rebuilds/s, %.1f views culled/frame\n",
+		   compositor->view_list_rebuilds,
+		   compositor->culled_repaints ?
+		   (double) compositor->culled_views_total /
+		   compositor->culled_repaints : 0.0);
+	compositor->view_list_rebuilds = 0;
+	compositor->culled_views_total = 0;
+	compositor->culled_repaints = 0;
+	wl_event_source_timer_update(compositor->view_list_stats_timer, 1000);
+
+	return 1;
+}
+
+static void
+view_list_stats_binding(struct weston_seat *seat, uint32_t time,
+			uint32_t key, void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct wl_event_loop *loop;
+
+	if (compositor->view_list_stats_timer) {
+		wl_event_source_remove(compositor->view_list_stats_timer);
+		compositor->view_list_stats_timer = NULL;
+		return;
+	}
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	compositor->view_list_rebuilds = 0;
+	compositor->culled_views_total = 0;
+	compositor->culled_repaints = 0;
+	compositor->view_list_stats_timer =
+		wl_event_loop_add_timer(loop, view_list_stats_report,
+					compositor);
+	wl_event_source_timer_update(compositor->view_list_stats_timer, 1000);
 }
 
 static int
@@ -1986,14 +2262,19 @@ weston_output_repaint(struct weston_output *output)
 	if (output->destroying)
 		return 0;
 
+	frame_profiler_begin(ec->frame_profiler, output->id);
+
 	/* Rebuild the surface list and update surface transforms up front. */
 	weston_compositor_build_view_list(ec);
+	compositor_cull_views(ec);
+	frame_profiler_mark(ec->frame_profiler, FRAME_STAGE_VIEW_LIST);
 
 	if (output->assign_planes && !output->disable_planes)
 		output->assign_planes(output);
 	else
 		wl_list_for_each(ev, &ec->view_list, link)
 			weston_view_move_to_plane(ev, &ec->primary_plane);
+	frame_profiler_mark(ec->frame_profiler, FRAME_STAGE_ASSIGN_PLANES);
 
 	wl_list_init(&frame_callback_list);
 	wl_list_for_each(ev, &ec->view_list, link) {
@@ -2022,29 +2303,41 @@ weston_output_repaint(struct weston_output *output)
 	if (output->dirty)
 		weston_output_update_matrix(output);
 
+	frame_profiler_mark(ec->frame_profiler, FRAME_STAGE_DAMAGE);
+	frame_profiler_set_damage(ec->frame_profiler, &output_damage);
+
 	r = output->repaint(output, &output_damage);
 
+	frame_profiler_mark(ec->frame_profiler, FRAME_STAGE_REPAINT);
+
 	pixman_region32_fini(&output_damage);
 
 	output->repaint_needed = 0;
 
-  // We need to redraw every vsync for the rift
-  if(ec->rift->enabled)
+  // The rift distortion pass has to run every vsync with a fresh head
+  // pose, so keep the repaint loop of the headset's output going. The
+  // virtual screens are only recomposited where there is real damage.
+  if(ec->rift->enabled && output == ec->rift->output)
     output->repaint_needed = 1;
 
 	weston_compositor_repick(ec);
+	frame_profiler_mark(ec->frame_profiler, FRAME_STAGE_REPICK);
 	wl_event_loop_dispatch(ec->input_loop, 0);
+	frame_profiler_mark(ec->frame_profiler, FRAME_STAGE_INPUT);
 
 	wl_list_for_each_safe(cb, cnext, &frame_callback_list, link) {
 		wl_callback_send_done(cb->resource, output->frame_time);
 		wl_resource_destroy(cb->resource);
 	}
+	frame_profiler_mark(ec->frame_profiler, FRAME_STAGE_FRAME_CALLBACKS);
 
 	wl_list_for_each_safe(animation, next, &output->animation_list, link) {
 		animation->frame_counter++;
 		animation->frame(animation, output, output->frame_time);
 	}
 
+	frame_profiler_end(ec->frame_profiler);
+
 	return r;
 }
 
@@ -2058,14 +2351,122 @@ weston_compositor_read_input(int fd, uint32_t mask, void *data)
 	return 1;
 }
 
+static uint64_t
+timespec_to_nsec(const struct timespec *ts)
+{
+	return (uint64_t) ts->tv_sec * 1000000000ull + ts->tv_nsec;
+}
+
+/* Repaints the output and remembers how long it took, from building the
+ * view list to the backend having queued the frame. With the GL renderer
+ * that does not include the GPU work, which the margin below has to
+ * absorb. */
+static int
+output_repaint_timed(struct weston_output *output)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct timespec start, end;
+	uint64_t elapsed;
+	int r;
+
+	clock_gettime(compositor->presentation_clock, &start);
+	r = weston_output_repaint(output);
+	clock_gettime(compositor->presentation_clock, &end);
+
+	elapsed = timespec_to_nsec(&end) - timespec_to_nsec(&start);
+	if (elapsed > UINT32_MAX)
+		elapsed = UINT32_MAX;
+	output->repaint_time[output->repaint_count++ %
+			     WESTON_REPAINT_HISTORY] = elapsed;
+
+	return r;
+}
+
+/* Safety margin on top of the slowest recent repaint */
+#define REPAINT_MARGIN_NSEC 2000000
+
+/* Returns how many ms the repaint can wait so it still finishes before
+ * the vblank after stamp, or 0 to repaint right away. The prediction is
+ * the slowest of the last WESTON_REPAINT_HISTORY repaints; a miss makes
+ * the next ones more careful until it has aged out. */
+static int
+output_repaint_delay(struct weston_output *output,
+		     const struct timespec *stamp, uint32_t refresh_nsec)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct timespec now;
+	uint64_t now_nsec, next_vblank, predicted = 0;
+	int i;
+
+	if (!compositor->adaptive_repaint || !output->vblank_stamps)
+		return 0;
+
+	/* Not enough history yet to guess from */
+	if (output->repaint_count < WESTON_REPAINT_HISTORY)
+		return 0;
+
+	for (i = 0; i < WESTON_REPAINT_HISTORY; i++)
+		if (output->repaint_time[i] > predicted)
+			predicted = output->repaint_time[i];
+	predicted += REPAINT_MARGIN_NSEC;
+	if (predicted >= refresh_nsec)
+		return 0;
+
+	/* The stamp is old when the repaint loop was just restarted */
+	clock_gettime(compositor->presentation_clock, &now);
+	now_nsec = timespec_to_nsec(&now);
+	next_vblank = timespec_to_nsec(stamp) + refresh_nsec;
+	while (next_vblank <= now_nsec)
+		next_vblank += refresh_nsec;
+
+	if (next_vblank - predicted <= now_nsec)
+		return 0;
+
+	/* The timer only has ms resolution, round towards early */
+	return (next_vblank - predicted - now_nsec) / 1000000;
+}
+
+static void
+output_repaint_loop_stop(struct weston_output *output)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(compositor->wl_display);
+	int fd;
+
+	output->repaint_scheduled = 0;
+	if (compositor->input_loop_source)
+		return;
+
+	fd = wl_event_loop_get_fd(compositor->input_loop);
+	compositor->input_loop_source =
+		wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
+				     weston_compositor_read_input, compositor);
+}
+
+static int
+output_repaint_timer_handler(void *data)
+{
+	struct weston_output *output = data;
+	struct weston_compositor *compositor = output->compositor;
+
+	if (output->repaint_needed &&
+	    compositor->state != WESTON_COMPOSITOR_SLEEPING &&
+	    compositor->state != WESTON_COMPOSITOR_OFFSCREEN &&
+	    output_repaint_timed(output) == 0)
+		return 0;
+
+	output_repaint_loop_stop(output);
+
+	return 0;
+}
+
 WL_EXPORT void
 weston_output_finish_frame(struct weston_output *output,
 			   const struct timespec *stamp)
 {
 	struct weston_compositor *compositor = output->compositor;
-	struct wl_event_loop *loop =
-		wl_display_get_event_loop(compositor->wl_display);
-	int fd, r;
+	int delay, r;
 	uint32_t refresh_nsec;
 
 	refresh_nsec = 1000000000000UL / output->current_mode->refresh;
@@ -2078,19 +2479,22 @@ weston_output_finish_frame(struct weston_output *output,
 	if (output->repaint_needed &&
 	    compositor->state != WESTON_COMPOSITOR_SLEEPING &&
 	    compositor->state != WESTON_COMPOSITOR_OFFSCREEN) {
-		r = weston_output_repaint(output);
+		/* Give clients until just before the next vblank to get
+		 * their commits into this frame. repaint_scheduled stays
+		 * set meanwhile, so nothing else starts a repaint. */
+		delay = output_repaint_delay(output, stamp, refresh_nsec);
+		if (delay > 0) {
+			wl_event_source_timer_update(output->repaint_timer,
+						     delay);
+			return;
+		}
+
+		r = output_repaint_timed(output);
 		if (!r)
 			return;
 	}
 
-	output->repaint_scheduled = 0;
-	if (compositor->input_loop_source)
-		return;
-
-	fd = wl_event_loop_get_fd(compositor->input_loop);
-	compositor->input_loop_source =
-		wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
-				     weston_compositor_read_input, compositor);
+	output_repaint_loop_stop(output);
 }
 
 static void
@@ -2105,13 +2509,22 @@ WL_EXPORT void
 weston_layer_entry_insert(struct weston_layer_entry *list,
 			  struct weston_layer_entry *entry)
 {
+	struct weston_view *view =
+		container_of(entry, struct weston_view, layer_link);
+
 	wl_list_insert(&list->link, &entry->link);
 	entry->layer = list->layer;
+	view->surface->compositor->view_list_needs_rebuild = 1;
 }
 
 WL_EXPORT void
 weston_layer_entry_remove(struct weston_layer_entry *entry)
 {
+	struct weston_view *view =
+		container_of(entry, struct weston_view, layer_link);
+
+	if (!wl_list_empty(&entry->link))
+		view->surface->compositor->view_list_needs_rebuild = 1;
 	wl_list_remove(&entry->link);
 	wl_list_init(&entry->link);
 	entry->layer = NULL;
@@ -2301,12 +2714,25 @@ static void
 weston_surface_commit_subsurface_order(struct weston_surface *surface)
 {
 	struct weston_subsurface *sub;
+	struct wl_list *link = surface->subsurface_list.next;
+
+	/* Both lists hold the same subsurfaces, most commits do not
+	 * restack them */
+	wl_list_for_each(sub, &surface->subsurface_list_pending,
+			 parent_link_pending) {
+		if (link != &sub->parent_link)
+			break;
+		link = link->next;
+	}
+	if (link == &surface->subsurface_list)
+		return;
 
 	wl_list_for_each_reverse(sub, &surface->subsurface_list_pending,
 				 parent_link_pending) {
 		wl_list_remove(&sub->parent_link);
 		wl_list_insert(&surface->subsurface_list, &sub->parent_link);
 	}
+	surface->compositor->view_list_needs_rebuild = 1;
 }
 
 static void
@@ -2747,6 +3173,7 @@ subsurface_configure(struct weston_surface *surface, int32_t dx, int32_t dy)
 
 		surface->output = output;
 		weston_surface_update_output_mask(surface, 1 << output->id);
+		compositor->view_list_needs_rebuild = 1;
 	}
 }
 
@@ -2923,6 +3350,7 @@ subsurface_set_desync(struct wl_client *client, struct wl_resource *resource)
 static void
 weston_subsurface_unlink_parent(struct weston_subsurface *sub)
 {
+	sub->parent->compositor->view_list_needs_rebuild = 1;
 	wl_list_remove(&sub->parent_link);
 	wl_list_remove(&sub->parent_link_pending);
 	wl_list_remove(&sub->parent_destroy_listener.link);
@@ -2989,6 +3417,7 @@ weston_subsurface_link_parent(struct weston_subsurface *sub,
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
+	parent->compositor->view_list_needs_rebuild = 1;
 }
 
 static void
@@ -3030,6 +3459,7 @@ weston_subsurface_destroy(struct weston_subsurface *sub)
 	} else {
 		/* the dummy weston_subsurface for the parent itself */
 		assert(sub->parent_destroy_listener.notify == NULL);
+		sub->surface->compositor->view_list_needs_rebuild = 1;
 		wl_list_remove(&sub->parent_link);
 		wl_list_remove(&sub->parent_link_pending);
 	}
@@ -3096,6 +3526,7 @@ weston_subsurface_create_for_parent(struct weston_surface *parent)
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
+	parent->compositor->view_list_needs_rebuild = 1;
 
 	return sub;
 }
@@ -3273,6 +3704,7 @@ weston_plane_init(struct weston_plane *plane,
 	plane->x = x;
 	plane->y = y;
 	plane->compositor = ec;
+	wl_list_init(&plane->view_list);
 
 	/* Init the link so that the call to wl_list_remove() when releasing
 	 * the plane without ever stacking doesn't lead to a crash */
@@ -3383,6 +3815,7 @@ weston_output_destroy(struct weston_output *output)
 	output->destroying = 1;
 
 	weston_presentation_feedback_discard_list(&output->feedback_list);
+	wl_event_source_remove(output->repaint_timer);
 
 	weston_compositor_remove_output(output->compositor, output);
 	wl_list_remove(&output->link);
@@ -3594,6 +4027,10 @@ weston_output_init(struct weston_output *output, struct weston_compositor *c,
 	wl_list_init(&output->resource_list);
 	wl_list_init(&output->feedback_list);
 
+	output->repaint_timer =
+		wl_event_loop_add_timer(wl_display_get_event_loop(c->wl_display),
+					output_repaint_timer_handler, output);
+
 	output->id = ffs(~output->compositor->output_id_pool) - 1;
 	output->compositor->output_id_pool |= 1 << output->id;
 
@@ -4027,6 +4464,8 @@ weston_compositor_init(struct weston_compositor *ec,
 
 	ec->output_id_pool = 0;
 
+	config_rift(ec);
+
 	if (!wl_global_create(display, &wl_compositor_interface, 3,
 			      ec, compositor_bind))
 		return -1;
@@ -4044,6 +4483,17 @@ weston_compositor_init(struct weston_compositor *ec,
 		return -1;
 
 	wl_list_init(&ec->view_list);
+	wl_list_init(&ec->transform_dirty_list);
+	ec->view_list_needs_rebuild = 1;
+	ec->view_grid = zalloc(sizeof *ec->view_grid);
+	ec->frame_profiler = zalloc(sizeof *ec->frame_profiler);
+	if (!ec->view_grid || !ec->frame_profiler) {
+		free(ec->view_grid);
+		free(ec->frame_profiler);
+		return -1;
+	}
+	view_grid_init(ec->view_grid);
+	frame_profiler_init(ec->frame_profiler);
 	wl_list_init(&ec->plane_list);
 	wl_list_init(&ec->layer_list);
 	wl_list_init(&ec->seat_list);
@@ -4058,6 +4508,11 @@ weston_compositor_init(struct weston_compositor *ec,
 	weston_plane_init(&ec->primary_plane, ec, 0, 0);
 	weston_compositor_stack_plane(ec, &ec->primary_plane, NULL);
 
+	weston_compositor_add_debug_binding(ec, KEY_L,
+					    view_list_stats_binding, ec);
+	weston_compositor_add_debug_binding(ec, KEY_P,
+					    frame_profiler_binding, ec);
+
 	s = weston_config_get_section(ec->config, "keyboard", NULL, NULL);
 	weston_config_section_get_string(s, "keymap_rules",
 					 (char **) &xkb_names.rules, NULL);
@@ -4078,6 +4533,10 @@ weston_compositor_init(struct weston_compositor *ec,
 	weston_config_section_get_int(s, "repeat-delay",
 				      &ec->kb_repeat_delay, 400);
 
+	s = weston_config_get_section(ec->config, "core", NULL, NULL);
+	weston_config_section_get_bool(s, "adaptive-repaint",
+				       &ec->adaptive_repaint, 1);
+
 	text_backend_init(ec);
 
 	wl_data_device_manager_init(ec->wl_display);
@@ -4106,6 +4565,8 @@ weston_compositor_shutdown(struct weston_compositor *ec)
 	wl_event_source_remove(ec->idle_source);
 	if (ec->input_loop_source)
 		wl_event_source_remove(ec->input_loop_source);
+	if (ec->view_list_stats_timer)
+		wl_event_source_remove(ec->view_list_stats_timer);
 
 	/* Destroy all outputs associated with this compositor */
 	wl_list_for_each_safe(output, next, &ec->output_list, link)
@@ -4124,6 +4585,9 @@ weston_compositor_shutdown(struct weston_compositor *ec)
 
 	wl_event_loop_destroy(ec->input_loop);
 
+	free(ec->view_grid);
+	free(ec->frame_profiler);
+
 	weston_config_destroy(ec->config);
 }
 
@@ -4475,6 +4939,7 @@ usage(int error_code)
 		"  --modules\t\tLoad the comma-separated list of modules\n"
 		"  --log==FILE\t\tLog to the given file\n"
 		"  --no-config\t\tDo not read weston.ini\n"
+		"  -c, --config=FILE\tRead FILE instead of weston.ini\n"
 		"  -R, --rift\t\tOculus Rift post-compositor\n"
 		"  -h, --help\t\tThis help message\n\n");
 
@@ -4493,6 +4958,15 @@ usage(int error_code)
 		"  --tty=TTY\t\tThe tty to use\n"
 		"  --device=DEVICE\tThe framebuffer device to use\n\n");
 
+	fprintf(stderr,
+		"Options for headless-backend.so:\n\n"
+		"  --width=WIDTH\t\tWidth of memory surface\n"
+		"  --height=HEIGHT\tHeight of memory surface\n"
+		"  --use-pixman\t\tUse the pixman (CPU) renderer\n"
+		"  --dump=FILE\t\tAppend every frame to FILE, needs --use-pixman\n"
+		"  --dump-fd=FD\t\tAppend every frame to the open FD instead\n"
+		"  --dump-damage\t\tOnly dump the damaged rectangles\n\n");
+
 	fprintf(stderr,
 		"Options for x11-backend.so:\n\n"
 		"  --width=WIDTH\t\tWidth of X window\n"
@@ -4618,6 +5092,7 @@ int main(int argc, char *argv[])
 	char *modules = NULL;
 	char *option_modules = NULL;
 	char *log = NULL;
+	char *config_file = NULL;
 	char *server_socket = NULL, *end;
 	int32_t idle_time = 300;
 	int32_t help = 0;
@@ -4644,6 +5119,7 @@ int main(int argc, char *argv[])
 		{ WESTON_OPTION_BOOLEAN, "help", 'h', &help },
 		{ WESTON_OPTION_BOOLEAN, "version", 0, &version },
 		{ WESTON_OPTION_BOOLEAN, "no-config", 0, &noconfig },
+		{ WESTON_OPTION_STRING, "config", 'c', &config_file },
 		{ WESTON_OPTION_BOOLEAN, "rift", 'R', &rift },
 		{ WESTON_OPTION_BOOLEAN, "rift-sbs", 0, &riftsbs }, // temporary
 		{ WESTON_OPTION_BOOLEAN, "rift-rotate", 0, &riftrotate }, // temporary
@@ -4691,7 +5167,8 @@ int main(int argc, char *argv[])
 	}
 
 	if (noconfig == 0)
-		config = weston_config_parse("weston.ini");
+		config = weston_config_parse(config_file ? config_file :
+					     "weston.ini");
 	if (config != NULL) {
 		weston_log("Using config file '%s'\n",
 			   weston_config_get_full_path(config));
@@ -4824,6 +5301,7 @@ out_signals:
 	free(socket_name);
 	free(option_modules);
 	free(log);
+	free(config_file);
 	free(modules);
 
 	return ret;
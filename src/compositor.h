@@ -64,6 +64,9 @@ struct shell_surface;
 struct weston_seat;
 struct weston_output;
 struct input_method;
+struct view_grid;
+struct view_grid_entry;
+struct frame_profiler;
 
 enum weston_keyboard_modifier {
 	MODIFIER_CTRL = (1 << 0),
@@ -182,6 +185,9 @@ enum weston_mode_switch_op {
 	WESTON_MODE_SWITCH_RESTORE_NATIVE
 };
 
+/* Number of recent repaint times the repaint delay is predicted from */
+#define WESTON_REPAINT_HISTORY 16
+
 struct weston_output {
 	uint32_t id;
 	char *name;
@@ -200,6 +206,13 @@ struct weston_output {
 	pixman_region32_t previous_damage;
 	int repaint_needed;
 	int repaint_scheduled;
+	/* Repaints are started from repaint_timer as late before the next
+	 * vblank as the recent repaint times allow. Only for backends that
+	 * set vblank_stamps, whose finish_frame stamps are real vblanks. */
+	int vblank_stamps;
+	struct wl_event_source *repaint_timer;
+	uint32_t repaint_time[WESTON_REPAINT_HISTORY];	/* ns */
+	uint32_t repaint_count;
 	struct weston_output_zoom zoom;
 	int dirty;
 	struct wl_signal frame_signal;
@@ -560,6 +573,11 @@ struct weston_plane {
 	pixman_region32_t clip;
 	int32_t x, y;
 	struct wl_list link;
+
+	/* Views on this plane in view list order, weston_view::plane_link.
+	 * Only valid while the compositor accumulates damage.
+	 */
+	struct wl_list view_list;
 };
 
 struct weston_renderer {
@@ -591,6 +609,11 @@ enum weston_capability {
 	WESTON_CAP_ARBITRARY_MODES		= 0x0008,
 };
 
+/* How many layers the view list remembers the order of, to notice
+ * restacking without a rebuild on every repaint. The shells use about
+ * ten; with more layers than this the list is rebuilt every time. */
+#define WESTON_VIEW_LIST_LAYERS 16
+
 struct weston_compositor {
 	struct wl_signal destroy_signal;
 
@@ -629,6 +652,25 @@ struct weston_compositor {
 	struct wl_list seat_list;
 	struct wl_list layer_list;
 	struct wl_list view_list;
+	uint32_t view_list_serial;	/* bumped on every view list build */
+	struct view_grid *view_grid;	/* mapped views, for picking */
+
+	/* The view list is only rebuilt when layer entries, subsurfaces
+	 * or the layer order changed; otherwise only views on
+	 * transform_dirty_list are updated. */
+	int view_list_needs_rebuild;
+	struct wl_list transform_dirty_list;
+	struct weston_layer *view_list_layers[WESTON_VIEW_LIST_LAYERS];
+	int view_list_layer_count;
+	uint32_t view_list_rebuilds;	/* since the last stats report */
+	uint32_t culled_views;		/* in the last repaint */
+	uint32_t culled_views_total;	/* since the last stats report */
+	uint32_t culled_repaints;	/* since the last stats report */
+
+	struct frame_profiler *frame_profiler;
+	struct wl_event_source *view_list_stats_timer;
+	int adaptive_repaint;		/* delay repaints towards vblank */
+
 	struct wl_list plane_list;
 	struct wl_list key_binding_list;
 	struct wl_list modifier_binding_list;
@@ -763,6 +805,7 @@ struct weston_view {
 	struct wl_list link;
 	struct weston_layer_entry layer_link;
 	struct weston_plane *plane;
+	struct wl_list plane_link;
 	struct weston_view *parent_view;
 
 	pixman_region32_t clip;
@@ -806,6 +849,9 @@ struct weston_view {
 		struct weston_matrix inverse;
 
 		struct weston_transform position; /* matrix from x, y */
+
+		/* in compositor->transform_dirty_list while dirty */
+		struct wl_list dirty_link;
 	} transform;
 
 	/*
@@ -820,6 +866,22 @@ struct weston_view {
 	 * displayed on.
 	 */
 	uint32_t output_mask;
+
+	/* Cells of compositor->view_grid covering
+	 * transform.masked_boundingbox.
+	 */
+	struct view_grid_entry *grid_entry;
+
+	/* The view is in the current view list, at view_list_index,
+	 * only if view_list_serial matches the compositor's.
+	 */
+	uint32_t view_list_serial;
+	int view_list_index;
+
+	/* Entirely covered by opaque views above it in the current
+	 * repaint; renderers and plane assignment skip it.
+	 */
+	int occluded;
 };
 
 struct weston_surface_state {
@@ -892,6 +954,10 @@ struct weston_surface {
 	int32_t height_from_buffer;
 	int keep_buffer; /* bool for backends to prevent early release */
 
+	/* One bit per repaint, newest in bit 0, set if the surface had
+	 * new damage for it. Lets backends tell how often it updates. */
+	uint32_t damage_history;
+
 	/* wl_viewport resource for this surface */
 	struct wl_resource *viewport_resource;
 
@@ -0,0 +1,174 @@
+/*
+ * Copyright © 2014 Chameleon
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <time.h>
+#include <wayland-util.h>
+
+#include "frame-profiler.h"
+
+static const char * const stage_names[FRAME_STAGE_COUNT] = {
+	"view list",
+	"assign planes",
+	"damage",
+	"repaint",
+	"repick",
+	"input",
+	"frame callbacks",
+	"animations",
+};
+
+static uint64_t
+profiler_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void
+frame_profiler_init(struct frame_profiler *profiler)
+{
+	memset(profiler, 0, sizeof *profiler);
+	profiler->stage = -1;
+}
+
+void
+frame_profiler_begin(struct frame_profiler *profiler, uint32_t output_id)
+{
+	profiler->current.sequence = profiler->head;
+	profiler->current.output_id = output_id;
+	profiler->current.start = profiler_now();
+	profiler->current.damage_area = 0;
+	profiler->current.repaint_area = 0;
+	profiler->stage = 0;
+}
+
+void
+frame_profiler_mark(struct frame_profiler *profiler,
+		    enum frame_profiler_stage stage)
+{
+	uint64_t now;
+
+	if (profiler->stage < 0 || profiler->stage > (int) stage)
+		return;
+
+	/* Stages that were skipped took no time */
+	now = profiler_now();
+	while (profiler->stage <= (int) stage)
+		profiler->current.end[profiler->stage++] = now;
+}
+
+void
+frame_profiler_end(struct frame_profiler *profiler)
+{
+	uint32_t head = profiler->head;
+
+	if (profiler->stage < 0)
+		return;
+
+	frame_profiler_mark(profiler, FRAME_STAGE_COUNT - 1);
+	profiler->stage = -1;
+
+	profiler->records[head % FRAME_PROFILER_SIZE] = profiler->current;
+	__atomic_store_n(&profiler->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static uint32_t
+region_area(pixman_region32_t *region)
+{
+	pixman_box32_t *rects;
+	uint32_t area = 0;
+	int i, n;
+
+	rects = pixman_region32_rectangles(region, &n);
+	for (i = 0; i < n; i++)
+		area += (rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+
+	return area;
+}
+
+void
+frame_profiler_set_damage(struct frame_profiler *profiler,
+			  pixman_region32_t *damage)
+{
+	if (profiler->stage < 0)
+		return;
+
+	profiler->current.damage_area = region_area(damage);
+}
+
+WL_EXPORT void
+frame_profiler_add_repaint(struct frame_profiler *profiler,
+			   pixman_region32_t *region)
+{
+	if (profiler->stage < 0)
+		return;
+
+	profiler->current.repaint_area += region_area(region);
+}
+
+WL_EXPORT int
+frame_profiler_read(struct frame_profiler *profiler,
+		    struct frame_profiler_record *records, int max)
+{
+	uint32_t head, first, last, i;
+	int n;
+
+	head = __atomic_load_n(&profiler->head, __ATOMIC_ACQUIRE);
+	n = head < FRAME_PROFILER_SIZE ? (int) head : FRAME_PROFILER_SIZE;
+	if (n > max)
+		n = max;
+
+	first = head - n;
+	for (i = 0; i < (uint32_t) n; i++)
+		records[i] = profiler->records[(first + i) % FRAME_PROFILER_SIZE];
+
+	/* Anything the writer got to while we copied may be torn; it
+	 * writes slot head % SIZE before publishing head + 1, so one
+	 * more than it published is suspect too. */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	last = __atomic_load_n(&profiler->head, __ATOMIC_RELAXED);
+	if (last + 1 - first > FRAME_PROFILER_SIZE) {
+		i = last + 1 - first - FRAME_PROFILER_SIZE;
+		if (i >= (uint32_t) n)
+			return 0;
+		memmove(records, records + i, (n - i) * sizeof *records);
+		n -= i;
+	}
+
+	return n;
+}
+
+WL_EXPORT const char *
+frame_profiler_stage_name(enum frame_profiler_stage stage)
+{
+	if (stage >= FRAME_STAGE_COUNT)
+		return "unknown";
+
+	return stage_names[stage];
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright © 2014 Chameleon
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _WESTON_FRAME_PROFILER_H_
+#define _WESTON_FRAME_PROFILER_H_
+
+#include <stdint.h>
+#include <pixman.h>
+
+/* Timestamps of the stages of weston_output_repaint(), kept for the
+ * last FRAME_PROFILER_SIZE repaints of all outputs. There is a single
+ * writer, the compositor thread; readers never block it and simply
+ * drop records that were overwritten while they copied them.
+ */
+
+enum frame_profiler_stage {
+	FRAME_STAGE_VIEW_LIST,		/* view list build and culling */
+	FRAME_STAGE_ASSIGN_PLANES,
+	FRAME_STAGE_DAMAGE,		/* damage accumulation */
+	FRAME_STAGE_REPAINT,		/* the backend's repaint */
+	FRAME_STAGE_REPICK,
+	FRAME_STAGE_INPUT,		/* input dispatch */
+	FRAME_STAGE_FRAME_CALLBACKS,
+	FRAME_STAGE_ANIMATIONS,
+	FRAME_STAGE_COUNT
+};
+
+#define FRAME_PROFILER_SIZE 256
+
+struct frame_profiler_record {
+	uint32_t sequence;
+	uint32_t output_id;
+	uint64_t start;				/* CLOCK_MONOTONIC, ns */
+	uint64_t end[FRAME_STAGE_COUNT];	/* end of each stage */
+	uint32_t damage_area;		/* output damage, in pixels */
+	uint32_t repaint_area;		/* pixels the renderer drew, 0 if
+					 * it does not tell */
+};
+
+struct frame_profiler {
+	struct frame_profiler_record records[FRAME_PROFILER_SIZE];
+	uint32_t head;		/* records ever written */
+	struct frame_profiler_record current;
+	int stage;		/* next stage of current, -1 if idle */
+};
+
+void
+frame_profiler_init(struct frame_profiler *profiler);
+
+void
+frame_profiler_begin(struct frame_profiler *profiler, uint32_t output_id);
+
+/* Ends the given stage and every earlier one not marked yet */
+void
+frame_profiler_mark(struct frame_profiler *profiler,
+		    enum frame_profiler_stage stage);
+
+void
+frame_profiler_end(struct frame_profiler *profiler);
+
+void
+frame_profiler_set_damage(struct frame_profiler *profiler,
+			  pixman_region32_t *damage);
+
+/* For renderers, with the region they actually drew, which with buffer
+ * age can be more than the damage. */
+void
+frame_profiler_add_repaint(struct frame_profiler *profiler,
+			   pixman_region32_t *region);
+
+/* Copies up to max of the most recent records, oldest first, and
+ * returns how many. */
+int
+frame_profiler_read(struct frame_profiler *profiler,
+		    struct frame_profiler_record *records, int max);
+
+const char *
+frame_profiler_stage_name(enum frame_profiler_stage stage);
+
+#endif
@@ -34,6 +34,7 @@
 
 #include "gl-renderer.h"
 #include "vertex-clipping.h"
+#include "frame-profiler.h"
 
 #include <EGL/eglext.h>
 #include "weston-egl-ext.h"
@@ -52,6 +53,32 @@ struct gl_shader {
 
 #define BUFFER_DAMAGE_COUNT 2
 
+/* wl_shm uploads are staged in a ring of pixel unpack buffers, so the
+ * driver can copy them into the textures asynchronously instead of
+ * from client memory while the compositor waits. */
+#define UPLOAD_PBO_COUNT 3
+
+/* More damage rectangles than this are uploaded as their extents */
+#define UPLOAD_MAX_RECTS 16
+
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
+#ifndef GL_MAP_WRITE_BIT
+#define GL_MAP_WRITE_BIT 0x0002
+#endif
+#ifndef GL_MAP_INVALIDATE_BUFFER_BIT
+#define GL_MAP_INVALIDATE_BUFFER_BIT 0x0008
+#endif
+
+/* glMapBufferRange and glUnmapBuffer of GLES 3, or their
+ * GL_EXT_map_buffer_range and GL_OES_mapbuffer versions */
+typedef void *(GL_APIENTRYP gl_map_buffer_range_func)(GLenum target,
+						      GLintptr offset,
+						      GLsizeiptr length,
+						      GLbitfield access);
+typedef GLboolean (GL_APIENTRYP gl_unmap_buffer_func)(GLenum target);
+
 enum gl_border_status {
 	BORDER_STATUS_CLEAN = 0,
 	BORDER_TOP_DIRTY = 1 << GL_RENDERER_BORDER_TOP,
@@ -92,6 +119,13 @@ struct gl_surface_state {
 	int num_textures;
 	int needs_full_upload;
 	pixman_region32_t texture_damage;
+	struct wl_list upload_link; /* gl_renderer::upload_list */
+
+	/* What the pending upload covers, in buffer coordinates */
+	int upload_full;
+	pixman_box32_t upload_rects[UPLOAD_MAX_RECTS];
+	int upload_rect_count;
+	GLintptr upload_offset; /* into the pixel unpack buffer */
 
 	/* These are only used by SHM surfaces to detect when we need
 	 * to do a full upload to specify a new internal texture
@@ -136,9 +170,19 @@ struct gl_renderer {
 #ifdef EGL_EXT_swap_buffers_with_damage
 	PFNEGLSWAPBUFFERSWITHDAMAGEEXTPROC swap_buffers_with_damage;
 #endif
+	PFNEGLSETDAMAGEREGIONKHRPROC set_damage_region;
 
 	int has_unpack_subimage;
 
+	/* Surfaces whose shm buffer is uploaded before the next repaint */
+	struct wl_list upload_list;
+	int has_pbo;
+	gl_map_buffer_range_func map_buffer_range;
+	gl_unmap_buffer_func unmap_buffer;
+	GLuint upload_pbo[UPLOAD_PBO_COUNT];
+	GLsizeiptr upload_pbo_size[UPLOAD_PBO_COUNT];
+	int upload_pbo_index;
+
 	PFNEGLBINDWAYLANDDISPLAYWL bind_display;
 	PFNEGLUNBINDWAYLANDDISPLAYWL unbind_display;
 	PFNEGLQUERYWAYLANDBUFFERWL query_buffer;
@@ -172,6 +216,9 @@ get_output_state(struct weston_output *output)
 static int
 gl_renderer_create_surface(struct weston_surface *surface);
 
+static void
+gl_renderer_upload_pending(struct gl_renderer *gr);
+
 static inline struct gl_surface_state *
 get_surface_state(struct weston_surface *surface)
 {
@@ -618,7 +665,8 @@ repaint_views(struct weston_output *output, pixman_region32_t *damage)
 	struct weston_view *view;
 
 	wl_list_for_each_reverse(view, &compositor->view_list, link)
-		if (view->plane == &compositor->primary_plane)
+		if (view->plane == &compositor->primary_plane &&
+		    !view->occluded)
 			draw_view(view, output, damage);
 }
 
@@ -852,6 +900,178 @@ output_rotate_damage(struct weston_output *output,
 	go->border_damage[go->buffer_damage_index] = border_status;
 }
 
+/* Converts output damage in global coordinates, plus the borders in
+ * border_status, to the x, y, width, height rectangles with a bottom
+ * left origin that the EGL damage extensions take. Returns the number
+ * of rectangles, or -1 if out of memory.
+ */
+static int
+output_damage_to_egl_rects(struct weston_output *output,
+			   pixman_region32_t *damage,
+			   enum gl_border_status border_status,
+			   EGLint **egl_rects)
+{
+	struct gl_output_state *go = get_output_state(output);
+	pixman_region32_t buffer_damage;
+	pixman_box32_t *rects;
+	EGLint *d;
+	int i, nrects, buffer_height;
+
+	pixman_region32_init(&buffer_damage);
+	weston_transformed_region(output->width, output->height,
+				  output->transform,
+				  output->current_scale,
+				  damage, &buffer_damage);
+
+	if (output_has_borders(output)) {
+		pixman_region32_translate(&buffer_damage,
+					  go->borders[GL_RENDERER_BORDER_LEFT].width,
+					  go->borders[GL_RENDERER_BORDER_TOP].height);
+		output_get_border_damage(output, border_status,
+					 &buffer_damage);
+	}
+
+	*egl_rects = NULL;
+	rects = pixman_region32_rectangles(&buffer_damage, &nrects);
+	if (nrects > 0) {
+		*egl_rects = malloc(nrects * 4 * sizeof(EGLint));
+		if (!*egl_rects)
+			nrects = -1;
+	}
+
+	buffer_height = go->borders[GL_RENDERER_BORDER_TOP].height +
+			output->current_mode->height +
+			go->borders[GL_RENDERER_BORDER_BOTTOM].height;
+
+	d = *egl_rects;
+	for (i = 0; i < nrects; i++) {
+		*d++ = rects[i].x1;
+		*d++ = buffer_height - rects[i].y2;
+		*d++ = rects[i].x2 - rects[i].x1;
+		*d++ = rects[i].y2 - rects[i].y1;
+	}
+
+	pixman_region32_fini(&buffer_damage);
+
+	return nrects;
+}
+
+/* With EGL_KHR_partial_update the driver only has to keep the contents
+ * of the back buffer outside of the region about to be redrawn, which
+ * on tiled GPUs saves loading every tile of it before drawing. It has
+ * to be set before anything is drawn into the buffer. */
+static void
+output_set_damage_region(struct weston_output *output,
+			 pixman_region32_t *damage,
+			 enum gl_border_status border_status)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	EGLint *egl_rects;
+	int nrects;
+
+	nrects = output_damage_to_egl_rects(output, damage, border_status,
+					    &egl_rects);
+	if (nrects < 0)
+		return;
+
+	if (!gr->set_damage_region(gr->egl_display, go->egl_surface,
+				   egl_rects, nrects)) {
+		weston_log("setting the damage region failed.\n");
+		gl_renderer_print_egl_error_state();
+	}
+
+	free(egl_rects);
+}
+
+/* A screen of the rift scene can sample the texture of the top view
+ * directly instead of a composite of the output, when that view alone
+ * covers the whole output, opaque and untransformed. These are the same
+ * conditions drm_output_prepare_scanout_view() puts on a buffer. */
+static int
+rift_screen_prepare_direct(struct weston_output *output,
+			   struct rift_screen *screen)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct gl_renderer *gr = get_renderer(compositor);
+	struct weston_view *ev, *top = NULL;
+	struct gl_surface_state *gs;
+	pixman_box32_t box = {
+		output->x, output->y,
+		output->x + output->width, output->y + output->height
+	};
+	float t[2][2];
+	int i;
+
+	if (gr->fan_debug || output->zoom.active)
+		goto composite;
+
+	wl_list_for_each(ev, &compositor->view_list, link) {
+		if (ev->plane != &compositor->primary_plane)
+			continue;
+		if (pixman_region32_contains_rectangle(&ev->transform.boundingbox,
+						       &box) != PIXMAN_REGION_OUT) {
+			top = ev;
+			break;
+		}
+	}
+
+	if (top == NULL || top->transform.enabled || top->alpha < 1.0 ||
+	    top->surface->buffer_ref.buffer == NULL ||
+	    top->surface->buffer_viewport.buffer.transform !=
+	    WL_OUTPUT_TRANSFORM_NORMAL ||
+	    pixman_region32_contains_rectangle(&top->transform.boundingbox,
+					       &box) != PIXMAN_REGION_IN)
+		goto composite;
+
+	gs = get_surface_state(top->surface);
+	if (gs->num_textures != 1 || gs->target != GL_TEXTURE_2D)
+		goto composite;
+	if (gs->shader != &gr->texture_shader_rgbx &&
+	    pixman_region32_contains_rectangle(&top->transform.opaque,
+					       &box) != PIXMAN_REGION_IN)
+		goto composite;
+
+	/* Map the bottom left and top right corners of the screen quad,
+	 * uv (0, 0) and (1, 1), to texture coordinates of the view */
+	for (i = 0; i < 2; i++) {
+		float sx, sy, bx, by;
+
+		weston_view_from_global_float(top,
+					      i ? box.x2 : box.x1,
+					      i ? box.y1 : box.y2,
+					      &sx, &sy);
+		weston_surface_to_buffer_float(top->surface, sx, sy,
+					       &bx, &by);
+		t[i][0] = bx / gs->pitch;
+		if (gs->y_inverted)
+			t[i][1] = by / gs->height;
+		else
+			t[i][1] = (gs->height - by) / gs->height;
+	}
+
+	screen->direct_texture = gs->textures[0];
+	screen->direct_uv[0] = t[1][0] - t[0][0];
+	screen->direct_uv[1] = t[1][1] - t[0][1];
+	screen->direct_uv[2] = t[0][0];
+	screen->direct_uv[3] = t[0][1];
+
+	glBindTexture(GL_TEXTURE_2D, screen->direct_texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+	return 1;
+
+composite:
+	/* The screen texture missed every update while it was bypassed */
+	if (screen->direct_texture) {
+		screen->direct_texture = 0;
+		screen->dirty = 1;
+	}
+
+	return 0;
+}
+
 static void
 gl_renderer_repaint_output(struct weston_output *output,
 			      pixman_region32_t *output_damage)
@@ -862,25 +1082,26 @@ gl_renderer_repaint_output(struct weston_output *output,
 	EGLBoolean ret;
 	static int errored;
 #ifdef EGL_EXT_swap_buffers_with_damage
-	int i, nrects, buffer_height;
-	EGLint *egl_damage, *d;
-	pixman_box32_t *rects;
+	EGLint *egl_damage;
+	int nrects;
 #endif
 	pixman_region32_t buffer_damage, total_damage;
 	enum gl_border_status border_damage = BORDER_STATUS_CLEAN;
+	struct rift_screen *screen = NULL;
+	int direct = 0;
+
+  if (use_output(output) < 0)
+    return;
 
-  if(compositor->rift->enabled == 1) {
-    glBindFramebuffer(GL_FRAMEBUFFER, compositor->rift->redirectedFramebuffer);
-    //glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    //compositor->rift->orig_surface = go->egl_surface;
-    //go->egl_surface = compositor->rift->pbuffer;
-    //use_output(output);
-    //eglMakeCurrent(gr->egl_display, go->egl_surface, go->egl_surface, gr->egl_context);
-
-    glViewport(0,
-         0,
-         compositor->rift->width,
-         compositor->rift->height);
+	gl_renderer_upload_pending(gr);
+
+  if(compositor->rift->enabled == 1)
+    screen = rift_screen_bind(compositor, output);
+
+  if(screen) {
+    if(output == compositor->rift->output)
+      rift_timing_begin(compositor);
+    direct = rift_screen_prepare_direct(output, screen);
   } else {
     /* Calculate the viewport */
     glViewport(go->borders[GL_RENDERER_BORDER_LEFT].width,
@@ -889,9 +1110,6 @@ gl_renderer_repaint_output(struct weston_output *output,
          output->current_mode->height);
   }
 
-  if (use_output(output) < 0)
-    return;
-
 	/* if debugging, redraw everything outside the damage to clean up
 	 * debug lines from the previous draw on this buffer:
 	 */
@@ -909,13 +1127,34 @@ gl_renderer_repaint_output(struct weston_output *output,
 	pixman_region32_init(&total_damage);
 	pixman_region32_init(&buffer_damage);
 
+  if(screen) {
+    /* The virtual screen is one persistent texture, so the EGL
+     * buffer age history does not apply to it: only what was damaged
+     * since the last repaint needs to be composited again. */
+    if(screen->dirty) {
+      pixman_region32_copy(&total_damage, &output->region);
+      screen->dirty = 0;
+    } else {
+      pixman_region32_copy(&total_damage, output_damage);
+    }
+  } else {
 	output_get_damage(output, &buffer_damage, &border_damage);
 	output_rotate_damage(output, output_damage, go->border_status);
 
 	pixman_region32_union(&total_damage, &buffer_damage, output_damage);
+  }
 	border_damage |= go->border_status;
 
-	repaint_views(output, &total_damage);
+	/* The fan debug repaint above already drew all over the buffer */
+	if (!screen && gr->set_damage_region && !gr->fan_debug)
+		output_set_damage_region(output, &total_damage,
+					 border_damage);
+
+	if (!direct && pixman_region32_not_empty(&total_damage)) {
+		repaint_views(output, &total_damage);
+		frame_profiler_add_repaint(compositor->frame_profiler,
+					   &total_damage);
+	}
 
 	pixman_region32_fini(&total_damage);
 	pixman_region32_fini(&buffer_damage);
@@ -925,52 +1164,32 @@ gl_renderer_repaint_output(struct weston_output *output,
 	pixman_region32_copy(&output->previous_damage, output_damage);
 	wl_signal_emit(&output->frame_signal, output);
 
-  if(compositor->rift->enabled == 1) {
-    //go->egl_surface = compositor->rift->orig_surface;
-    //use_output(output);
-    //eglMakeCurrent(gr->egl_display, go->egl_surface, go->egl_surface, gr->egl_context);
-
+  if(screen && output == compositor->rift->output) {
+    rift_timing_mark(compositor, RIFT_STAGE_COMPOSITE);
     render_rift(compositor, gr->current_shader->program);
 
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
     ret = eglSwapBuffers(gr->egl_display, go->egl_surface);
+    rift_timing_mark(compositor, RIFT_STAGE_SWAP);
+    rift_timing_end(compositor);
+  } else if(screen) {
+    /* Not the headset: the screen only shows up in the scene, but the
+     * output itself keeps showing its part of the desktop */
+    rift_screen_present(compositor, screen, gr->current_shader->program);
+    ret = eglSwapBuffers(gr->egl_display, go->egl_surface);
   } else {
 #ifdef EGL_EXT_swap_buffers_with_damage
     if (gr->swap_buffers_with_damage) {
-      pixman_region32_init(&buffer_damage);
-      weston_transformed_region(output->width, output->height,
-              output->transform,
-              output->current_scale,
-              output_damage, &buffer_damage);
-
-      if (output_has_borders(output)) {
-        pixman_region32_translate(&buffer_damage,
-                go->borders[GL_RENDERER_BORDER_LEFT].width,
-                go->borders[GL_RENDERER_BORDER_TOP].height);
-        output_get_border_damage(output, go->border_status,
-               &buffer_damage);
-      }
-
-      rects = pixman_region32_rectangles(&buffer_damage, &nrects);
-      egl_damage = malloc(nrects * 4 * sizeof(EGLint));
-
-      buffer_height = go->borders[GL_RENDERER_BORDER_TOP].height +
-          output->current_mode->height +
-          go->borders[GL_RENDERER_BORDER_BOTTOM].height;
-
-      d = egl_damage;
-      for (i = 0; i < nrects; ++i) {
-        *d++ = rects[i].x1;
-        *d++ = buffer_height - rects[i].y2;
-        *d++ = rects[i].x2 - rects[i].x1;
-        *d++ = rects[i].y2 - rects[i].y1;
-      }
-      ret = gr->swap_buffers_with_damage(gr->egl_display,
-                 go->egl_surface,
-                 egl_damage, nrects);
+      nrects = output_damage_to_egl_rects(output, output_damage,
+                go->border_status, &egl_damage);
+      if (nrects < 0)
+        ret = eglSwapBuffers(gr->egl_display, go->egl_surface);
+      else
+        ret = gr->swap_buffers_with_damage(gr->egl_display,
+                   go->egl_surface,
+                   egl_damage, nrects);
       free(egl_damage);
-      pixman_region32_fini(&buffer_damage);
     } else {
       ret = eglSwapBuffers(gr->egl_display, go->egl_surface);
     }
@@ -986,9 +1205,6 @@ gl_renderer_repaint_output(struct weston_output *output,
   }
 
 	go->border_status = BORDER_STATUS_CLEAN;
-  if(compositor->rift->enabled == 1) {
-    weston_output_damage(output);
-  }
 }
 
 static int
@@ -1024,6 +1240,288 @@ gl_renderer_read_pixels(struct weston_output *output,
 	return 0;
 }
 
+static void
+surface_upload_done(struct gl_surface_state *gs)
+{
+	pixman_region32_fini(&gs->texture_damage);
+	pixman_region32_init(&gs->texture_damage);
+	gs->needs_full_upload = 0;
+
+	weston_buffer_reference(&gs->buffer_ref, NULL);
+
+	wl_list_remove(&gs->upload_link);
+	wl_list_init(&gs->upload_link);
+}
+
+/* Works out which parts of the buffer to upload. Many small damage
+ * rectangles, or ones covering most of their extents anyway, are merged
+ * into the extents: one larger upload is cheaper than many small ones.
+ */
+static void
+surface_upload_rects(struct gl_renderer *gr, struct gl_surface_state *gs)
+{
+	struct weston_buffer *buffer = gs->buffer_ref.buffer;
+	pixman_box32_t *rects, r;
+	uint64_t area = 0, extents_area;
+	int i, n;
+
+	gs->upload_rect_count = 0;
+	gs->upload_full = gs->needs_full_upload ||
+		(!gr->has_pbo && !gr->has_unpack_subimage);
+	if (gs->upload_full)
+		return;
+
+	rects = pixman_region32_rectangles(&gs->texture_damage, &n);
+	for (i = 0; i < n; i++)
+		area += (uint64_t) (rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+
+	r = *pixman_region32_extents(&gs->texture_damage);
+	extents_area = (uint64_t) (r.x2 - r.x1) * (r.y2 - r.y1);
+	if (n > UPLOAD_MAX_RECTS || extents_area <= 2 * area) {
+		rects = pixman_region32_extents(&gs->texture_damage);
+		n = 1;
+	}
+
+	for (i = 0; i < n; i++) {
+		r = weston_surface_to_buffer_rect(gs->surface, rects[i]);
+		if (r.x1 < 0)
+			r.x1 = 0;
+		if (r.y1 < 0)
+			r.y1 = 0;
+		r.x2 = MIN(r.x2, buffer->width);
+		r.y2 = MIN(r.y2, buffer->height);
+		if (r.x1 < r.x2 && r.y1 < r.y2)
+			gs->upload_rects[gs->upload_rect_count++] = r;
+	}
+}
+
+/* Rows are packed to the default GL_UNPACK_ALIGNMENT of 4 */
+static GLsizeiptr
+upload_row_size(int width, int bpp)
+{
+	return (width * bpp + 3) & ~3;
+}
+
+static GLsizeiptr
+surface_upload_size(struct gl_surface_state *gs)
+{
+	struct wl_shm_buffer *shm_buffer = gs->buffer_ref.buffer->shm_buffer;
+	int stride = wl_shm_buffer_get_stride(shm_buffer);
+	int bpp = stride / gs->pitch;
+	GLsizeiptr size = 0;
+	pixman_box32_t *r;
+	int i;
+
+	if (gs->upload_full)
+		return (GLsizeiptr) stride * gs->height;
+
+	for (i = 0; i < gs->upload_rect_count; i++) {
+		r = &gs->upload_rects[i];
+		size += upload_row_size(r->x2 - r->x1, bpp) * (r->y2 - r->y1);
+	}
+
+	return size;
+}
+
+/* Copies the pending parts of the buffer to dst, each rectangle
+ * packed tightly. */
+static void
+surface_upload_copy(struct gl_surface_state *gs, uint8_t *dst)
+{
+	struct wl_shm_buffer *shm_buffer = gs->buffer_ref.buffer->shm_buffer;
+	int stride = wl_shm_buffer_get_stride(shm_buffer);
+	int bpp = stride / gs->pitch;
+	uint8_t *data = wl_shm_buffer_get_data(shm_buffer);
+	GLsizeiptr row_size;
+	pixman_box32_t *r;
+	int i, y;
+
+	wl_shm_buffer_begin_access(shm_buffer);
+
+	if (gs->upload_full) {
+		memcpy(dst, data, (size_t) stride * gs->height);
+		wl_shm_buffer_end_access(shm_buffer);
+		return;
+	}
+
+	for (i = 0; i < gs->upload_rect_count; i++) {
+		r = &gs->upload_rects[i];
+		row_size = upload_row_size(r->x2 - r->x1, bpp);
+		for (y = r->y1; y < r->y2; y++) {
+			memcpy(dst, data + y * stride + r->x1 * bpp,
+			       (r->x2 - r->x1) * bpp);
+			dst += row_size;
+		}
+	}
+
+	wl_shm_buffer_end_access(shm_buffer);
+}
+
+/* Stages all pending uploads in one pixel unpack buffer, then has GL
+ * copy them into the textures from there. Returns -1 if the buffer
+ * could not be filled, nothing has been uploaded then. */
+static int
+upload_pending_pbo(struct gl_renderer *gr)
+{
+	struct gl_surface_state *gs;
+	GLsizeiptr size = 0;
+	GLintptr offset;
+	pixman_box32_t *r;
+	uint8_t *map;
+	int index, bpp, i;
+
+	wl_list_for_each(gs, &gr->upload_list, upload_link) {
+		gs->upload_offset = size;
+		size += surface_upload_size(gs);
+	}
+
+	if (size == 0)
+		return 0;
+
+	/* A buffer is only reused two batches later, by then the GPU
+	 * should be done reading it. */
+	index = gr->upload_pbo_index;
+	gr->upload_pbo_index = (index + 1) % UPLOAD_PBO_COUNT;
+
+	if (!gr->upload_pbo[index])
+		glGenBuffers(1, &gr->upload_pbo[index]);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, gr->upload_pbo[index]);
+
+	if (gr->upload_pbo_size[index] < size) {
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL,
+			     GL_STREAM_DRAW);
+		gr->upload_pbo_size[index] = size;
+	}
+
+	map = gr->map_buffer_range(GL_PIXEL_UNPACK_BUFFER, 0, size,
+				   GL_MAP_WRITE_BIT |
+				   GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (!map) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return -1;
+	}
+
+	wl_list_for_each(gs, &gr->upload_list, upload_link)
+		surface_upload_copy(gs, map + gs->upload_offset);
+
+	if (!gr->unmap_buffer(GL_PIXEL_UNPACK_BUFFER)) {
+		/* The contents got lost, e.g. on a mode switch */
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return -1;
+	}
+
+#ifdef GL_EXT_unpack_subimage
+	if (gr->has_unpack_subimage) {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+	}
+#endif
+
+	wl_list_for_each(gs, &gr->upload_list, upload_link) {
+		glBindTexture(GL_TEXTURE_2D, gs->textures[0]);
+		offset = gs->upload_offset;
+
+		if (gs->upload_full) {
+			glTexImage2D(GL_TEXTURE_2D, 0, gs->gl_format,
+				     gs->pitch, gs->height, 0,
+				     gs->gl_format, gs->gl_pixel_type,
+				     (void *) offset);
+			continue;
+		}
+
+		bpp = wl_shm_buffer_get_stride(gs->buffer_ref.buffer->shm_buffer) /
+			gs->pitch;
+		for (i = 0; i < gs->upload_rect_count; i++) {
+			r = &gs->upload_rects[i];
+			glTexSubImage2D(GL_TEXTURE_2D, 0, r->x1, r->y1,
+					r->x2 - r->x1, r->y2 - r->y1,
+					gs->gl_format, gs->gl_pixel_type,
+					(void *) offset);
+			offset += upload_row_size(r->x2 - r->x1, bpp) *
+				(r->y2 - r->y1);
+		}
+	}
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	return 0;
+}
+
+/* Uploads straight from client memory */
+static void
+surface_upload_direct(struct gl_renderer *gr, struct gl_surface_state *gs)
+{
+	struct wl_shm_buffer *shm_buffer = gs->buffer_ref.buffer->shm_buffer;
+	void *data = wl_shm_buffer_get_data(shm_buffer);
+#ifdef GL_EXT_unpack_subimage
+	pixman_box32_t *r;
+	int i;
+#endif
+
+	glBindTexture(GL_TEXTURE_2D, gs->textures[0]);
+	wl_shm_buffer_begin_access(shm_buffer);
+
+	if (gs->upload_full || !gr->has_unpack_subimage) {
+#ifdef GL_EXT_unpack_subimage
+		if (gr->has_unpack_subimage) {
+			glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, gs->pitch);
+			glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+			glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+		}
+#endif
+		glTexImage2D(GL_TEXTURE_2D, 0, gs->gl_format,
+			     gs->pitch, gs->height, 0,
+			     gs->gl_format, gs->gl_pixel_type, data);
+		wl_shm_buffer_end_access(shm_buffer);
+		return;
+	}
+
+#ifdef GL_EXT_unpack_subimage
+	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, gs->pitch);
+	for (i = 0; i < gs->upload_rect_count; i++) {
+		r = &gs->upload_rects[i];
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, r->x1);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, r->y1);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, r->x1, r->y1,
+				r->x2 - r->x1, r->y2 - r->y1,
+				gs->gl_format, gs->gl_pixel_type, data);
+	}
+#endif
+
+	wl_shm_buffer_end_access(shm_buffer);
+}
+
+/* Uploads the damage of every surface flushed since the last repaint,
+ * all before anything is drawn. */
+static void
+gl_renderer_upload_pending(struct gl_renderer *gr)
+{
+	struct gl_surface_state *gs, *next;
+
+	if (wl_list_empty(&gr->upload_list))
+		return;
+
+	wl_list_for_each_safe(gs, next, &gr->upload_list, upload_link) {
+		/* The client destroyed the buffer in the meantime */
+		if (!gs->buffer_ref.buffer ||
+		    !gs->buffer_ref.buffer->shm_buffer) {
+			surface_upload_done(gs);
+			continue;
+		}
+
+		surface_upload_rects(gr, gs);
+	}
+
+	if (!gr->has_pbo || upload_pending_pbo(gr) < 0)
+		wl_list_for_each(gs, &gr->upload_list, upload_link)
+			surface_upload_direct(gr, gs);
+
+	wl_list_for_each_safe(gs, next, &gr->upload_list, upload_link)
+		surface_upload_done(gs);
+}
+
 static void
 gl_renderer_flush_damage(struct weston_surface *surface)
 {
@@ -1033,12 +1531,6 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	struct weston_view *view;
 	int texture_used;
 
-#ifdef GL_EXT_unpack_subimage
-	pixman_box32_t *rectangles;
-	void *data;
-	int i, n;
-#endif
-
 	pixman_region32_union(&gs->texture_damage,
 			      &gs->texture_damage, &surface->damage);
 
@@ -1061,59 +1553,14 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 		return;
 
 	if (!pixman_region32_not_empty(&gs->texture_damage) &&
-	    !gs->needs_full_upload)
-		goto done;
-
-	glBindTexture(GL_TEXTURE_2D, gs->textures[0]);
-
-	if (!gr->has_unpack_subimage) {
-		wl_shm_buffer_begin_access(buffer->shm_buffer);
-		glTexImage2D(GL_TEXTURE_2D, 0, gs->gl_format,
-			     gs->pitch, buffer->height, 0,
-			     gs->gl_format, gs->gl_pixel_type,
-			     wl_shm_buffer_get_data(buffer->shm_buffer));
-		wl_shm_buffer_end_access(buffer->shm_buffer);
-
-		goto done;
-	}
-
-#ifdef GL_EXT_unpack_subimage
-	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, gs->pitch);
-	data = wl_shm_buffer_get_data(buffer->shm_buffer);
-
-	if (gs->needs_full_upload) {
-		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
-		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
-		wl_shm_buffer_begin_access(buffer->shm_buffer);
-		glTexImage2D(GL_TEXTURE_2D, 0, gs->gl_format,
-			     gs->pitch, buffer->height, 0,
-			     gs->gl_format, gs->gl_pixel_type, data);
-		wl_shm_buffer_end_access(buffer->shm_buffer);
-		goto done;
-	}
-
-	rectangles = pixman_region32_rectangles(&gs->texture_damage, &n);
-	wl_shm_buffer_begin_access(buffer->shm_buffer);
-	for (i = 0; i < n; i++) {
-		pixman_box32_t r;
-
-		r = weston_surface_to_buffer_rect(surface, rectangles[i]);
-
-		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, r.x1);
-		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, r.y1);
-		glTexSubImage2D(GL_TEXTURE_2D, 0, r.x1, r.y1,
-				r.x2 - r.x1, r.y2 - r.y1,
-				gs->gl_format, gs->gl_pixel_type, data);
+	    !gs->needs_full_upload) {
+		surface_upload_done(gs);
+		return;
 	}
-	wl_shm_buffer_end_access(buffer->shm_buffer);
-#endif
 
-done:
-	pixman_region32_fini(&gs->texture_damage);
-	pixman_region32_init(&gs->texture_damage);
-	gs->needs_full_upload = 0;
-
-	weston_buffer_reference(&gs->buffer_ref, NULL);
+	/* Uploaded along with all other surfaces before the repaint */
+	if (wl_list_empty(&gs->upload_link))
+		wl_list_insert(gr->upload_list.prev, &gs->upload_link);
 }
 
 static void
@@ -1274,6 +1721,29 @@ gl_renderer_attach_egl(struct weston_surface *es, struct weston_buffer *buffer,
 	gs->y_inverted = buffer->y_inverted;
 }
 
+/* Rift screens showing one of the surface's textures directly must not
+ * sample it once it is deleted, the name may be reused by then. */
+static void
+rift_screens_drop_textures(struct gl_surface_state *gs)
+{
+	struct oculus_rift *rift = gs->surface->compositor->rift;
+	struct rift_screen *screen;
+	int i;
+
+	if (!rift->enabled)
+		return;
+
+	wl_list_for_each(screen, &rift->screen_list, link) {
+		for (i = 0; i < gs->num_textures; i++) {
+			if (screen->direct_texture != gs->textures[i])
+				continue;
+			screen->direct_texture = 0;
+			screen->dirty = 1;
+			weston_output_schedule_repaint(screen->output);
+		}
+	}
+}
+
 static void
 gl_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 {
@@ -1284,6 +1754,10 @@ gl_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 	EGLint format;
 	int i;
 
+	/* The upload still needs the old buffer */
+	if (!wl_list_empty(&gs->upload_link))
+		gl_renderer_upload_pending(gr);
+
 	weston_buffer_reference(&gs->buffer_ref, buffer);
 
 	if (!buffer) {
@@ -1292,6 +1766,7 @@ gl_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 			gs->images[i] = NULL;
 		}
 		gs->num_images = 0;
+		rift_screens_drop_textures(gs);
 		glDeleteTextures(gs->num_textures, gs->textures);
 		gs->num_textures = 0;
 		gs->buffer_type = BUFFER_TYPE_NULL;
@@ -1336,9 +1811,11 @@ surface_state_destroy(struct gl_surface_state *gs, struct gl_renderer *gr)
 
 	wl_list_remove(&gs->surface_destroy_listener.link);
 	wl_list_remove(&gs->renderer_destroy_listener.link);
+	wl_list_remove(&gs->upload_link);
 
 	gs->surface->renderer_state = NULL;
 
+	rift_screens_drop_textures(gs);
 	glDeleteTextures(gs->num_textures, gs->textures);
 
 	for (i = 0; i < gs->num_images; i++)
@@ -1397,6 +1874,7 @@ gl_renderer_create_surface(struct weston_surface *surface)
 	gs->surface = surface;
 
 	pixman_region32_init(&gs->texture_damage);
+	wl_list_init(&gs->upload_link);
 	surface->renderer_state = gs;
 
 	gs->surface_destroy_listener.notify =
@@ -1817,7 +2295,7 @@ gl_renderer_output_create(struct weston_output *output,
 
 	log_egl_config_info(gr->egl_display, egl_config);
 
-  config_rift(ec);
+  ec->rift->renderer = RIFT_RENDERER_GL;
   //config_rift(ec, gr->egl_config, gr->egl_display, go->egl_surface, gr->egl_context);
 
 	return 0;
@@ -1851,6 +2329,8 @@ gl_renderer_destroy(struct weston_compositor *ec)
 
 	wl_signal_emit(&gr->destroy_signal, gr);
 
+	glDeleteBuffers(UPLOAD_PBO_COUNT, gr->upload_pbo);
+
 	if (gr->has_bind_display)
 		gr->unbind_display(gr->egl_display, ec->wl_display);
 
@@ -1904,9 +2384,17 @@ gl_renderer_setup_egl_extensions(struct weston_compositor *ec)
 			gr->has_bind_display = 0;
 	}
 
+	/* EGL_KHR_partial_update includes the buffer age query */
+	if (strstr(extensions, "EGL_KHR_partial_update")) {
+		gr->set_damage_region =
+			(void *) eglGetProcAddress("eglSetDamageRegionKHR");
+		if (gr->set_damage_region)
+			gr->has_egl_buffer_age = 1;
+	}
+
 	if (strstr(extensions, "EGL_EXT_buffer_age"))
 		gr->has_egl_buffer_age = 1;
-	else
+	else if (!gr->has_egl_buffer_age)
 		weston_log("warning: EGL_EXT_buffer_age not supported. "
 			   "Performance could be affected.\n");
 
@@ -1992,6 +2480,7 @@ gl_renderer_create(struct weston_compositor *ec, EGLNativeDisplayType display,
 	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_RGB565);
 
 	wl_signal_init(&gr->destroy_signal);
+	wl_list_init(&gr->upload_list);
 
 	return 0;
 
@@ -2080,7 +2569,7 @@ static int
 gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 {
 	struct gl_renderer *gr = get_renderer(ec);
-	const char *extensions;
+	const char *extensions, *version;
 	EGLConfig context_config;
 	EGLBoolean ret;
 
@@ -2147,6 +2636,21 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 	if (strstr(extensions, "GL_OES_EGL_image_external"))
 		gr->has_egl_image_external = 1;
 
+	version = (const char *) glGetString(GL_VERSION);
+	if (version && strncmp(version, "OpenGL ES 3", 11) == 0) {
+		gr->map_buffer_range =
+			(void *) eglGetProcAddress("glMapBufferRange");
+		gr->unmap_buffer = (void *) eglGetProcAddress("glUnmapBuffer");
+	} else if (strstr(extensions, "GL_NV_pixel_buffer_object") &&
+		   strstr(extensions, "GL_EXT_map_buffer_range") &&
+		   strstr(extensions, "GL_OES_mapbuffer")) {
+		gr->map_buffer_range =
+			(void *) eglGetProcAddress("glMapBufferRangeEXT");
+		gr->unmap_buffer =
+			(void *) eglGetProcAddress("glUnmapBufferOES");
+	}
+	gr->has_pbo = gr->map_buffer_range && gr->unmap_buffer;
+
 	glActiveTexture(GL_TEXTURE0);
 
 	if (compile_shaders(ec))
@@ -2166,6 +2670,8 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 		ec->read_format == PIXMAN_a8r8g8b8 ? "BGRA" : "RGBA");
 	weston_log_continue(STAMP_SPACE "wl_shm sub-image to texture: %s\n",
 			    gr->has_unpack_subimage ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "wl_shm uploads through "
+			    "pixel buffers: %s\n", gr->has_pbo ? "yes" : "no");
 	weston_log_continue(STAMP_SPACE "EGL Wayland extension: %s\n",
 			    gr->has_bind_display ? "yes" : "no");
 
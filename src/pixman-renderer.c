@@ -27,6 +27,9 @@
 #include <stdlib.h>
 
 #include "pixman-renderer.h"
+#include "postcompositor-rift.h"
+#include "worker-pool.h"
+#include "frame-profiler.h"
 
 #include <linux/input.h>
 
@@ -34,12 +37,23 @@ struct pixman_output_state {
 	void *shadow_buffer;
 	pixman_image_t *shadow_image;
 	pixman_image_t *hw_buffer;
+	/* Set by the backend when hw_buffer is missing more than the
+	 * damage of the frame being repainted, in global coordinates */
+	pixman_region32_t *hw_extra_damage;
+
+	/* With a worker pool, the shadow buffer is composited as this
+	 * many horizontal bands in parallel, each through its own image
+	 * over the whole buffer so the clip regions do not collide.
+	 */
+	pixman_image_t **band_images;
+	int band_count;
 };
 
 struct pixman_surface_state {
 	struct weston_surface *surface;
 
 	pixman_image_t *image;
+	pixman_color_t color; /* of image, if it is a solid fill */
 	struct weston_buffer_reference buffer_ref;
 
 	struct wl_listener buffer_destroy_listener;
@@ -55,6 +69,43 @@ struct pixman_renderer {
 	struct weston_binding *debug_binding;
 
 	struct wl_signal destroy_signal;
+
+	/* NULL unless compositing is spread over several threads. The
+	 * composite operations of a repaint are then recorded into ops
+	 * and replayed band by band on the pool.
+	 */
+	struct worker_pool *pool;
+	struct pixman_draw_op *ops;
+	int op_count;
+	int op_size;
+};
+
+/* A composite of one view onto the shadow image, with everything it
+ * needs to create its own source image on a worker thread.
+ */
+struct pixman_draw_op {
+	pixman_region32_t region; /* output coordinates */
+	pixman_op_t op;
+	pixman_transform_t transform;
+	pixman_filter_t filter;
+	float alpha;
+
+	/* Source bits, or color if data is NULL */
+	pixman_format_code_t format;
+	uint32_t *data;
+	int width, height, stride;
+	pixman_color_t color;
+	struct wl_shm_buffer *shm_buffer;
+};
+
+struct band_batch {
+	struct pixman_renderer *renderer;
+	struct pixman_output_state *po;
+	int height;
+};
+
+static const pixman_color_t debug_red = {
+	0x3fff, 0x0000, 0x0000, 0x3fff
 };
 
 static inline struct pixman_output_state *
@@ -167,6 +218,44 @@ transform_apply_viewport(pixman_transform_t *transform,
 	pixman_transform_translate(transform, NULL, D2F(src_x), D2F(src_y));
 }
 
+static void
+record_draw_op(struct pixman_renderer *pr, struct pixman_surface_state *ps,
+	       pixman_region32_t *region, pixman_op_t pixman_op,
+	       pixman_transform_t *transform, pixman_filter_t filter,
+	       float alpha)
+{
+	struct pixman_draw_op *op, *ops;
+	int size;
+
+	if (pr->op_count == pr->op_size) {
+		size = pr->op_size ? pr->op_size * 2 : 32;
+		ops = realloc(pr->ops, size * sizeof *ops);
+		if (!ops)
+			return;
+		pr->ops = ops;
+		pr->op_size = size;
+	}
+
+	op = &pr->ops[pr->op_count++];
+	pixman_region32_init(&op->region);
+	pixman_region32_copy(&op->region, region);
+	op->op = pixman_op;
+	op->transform = *transform;
+	op->filter = filter;
+	op->alpha = alpha;
+
+	op->data = pixman_image_get_data(ps->image);
+	if (op->data) {
+		op->format = pixman_image_get_format(ps->image);
+		op->width = pixman_image_get_width(ps->image);
+		op->height = pixman_image_get_height(ps->image);
+		op->stride = pixman_image_get_stride(ps->image);
+	}
+	op->color = ps->color;
+	op->shm_buffer = ps->buffer_ref.buffer ?
+		ps->buffer_ref.buffer->shm_buffer : NULL;
+}
+
 static void
 repaint_region(struct weston_view *ev, struct weston_output *output,
 	       pixman_region32_t *region, pixman_region32_t *surf_region,
@@ -180,6 +269,7 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	pixman_region32_t final_region;
 	float view_x, view_y;
 	pixman_transform_t transform;
+	pixman_filter_t filter;
 	pixman_fixed_t fw, fh;
 	pixman_image_t *mask_image;
 	pixman_color_t mask = { 0, };
@@ -211,9 +301,6 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	/* Convert from global to output coord */
 	region_global_to_output(output, &final_region);
 
-	/* And clip to it */
-	pixman_image_set_clip_region32 (po->shadow_image, &final_region);
-
 	/* Set up the source transformation based on the surface
 	   position, the output position/transform/scale and the client
 	   specified buffer transform/scale */
@@ -332,12 +419,24 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 			       pixman_double_to_fixed(vp->buffer.scale),
 			       pixman_double_to_fixed(vp->buffer.scale));
 
-	pixman_image_set_transform(ps->image, &transform);
-
 	if (ev->transform.enabled || output->current_scale != vp->buffer.scale)
-		pixman_image_set_filter(ps->image, PIXMAN_FILTER_BILINEAR, NULL, 0);
+		filter = PIXMAN_FILTER_BILINEAR;
 	else
-		pixman_image_set_filter(ps->image, PIXMAN_FILTER_NEAREST, NULL, 0);
+		filter = PIXMAN_FILTER_NEAREST;
+
+	/* Outputs without bands composite serially even with a pool */
+	if (pr->pool && po->band_images) {
+		record_draw_op(pr, ps, &final_region, pixman_op,
+			       &transform, filter, ev->alpha);
+		pixman_region32_fini(&final_region);
+		return;
+	}
+
+	/* And clip to it; the bands clip their own images instead */
+	pixman_image_set_clip_region32 (po->shadow_image, &final_region);
+
+	pixman_image_set_transform(ps->image, &transform);
+	pixman_image_set_filter(ps->image, filter, NULL, 0);
 
 	if (ps->buffer_ref.buffer)
 		wl_shm_buffer_begin_access(ps->buffer_ref.buffer->shm_buffer);
@@ -441,10 +540,117 @@ repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
 	struct weston_view *view;
 
 	wl_list_for_each_reverse(view, &compositor->view_list, link)
-		if (view->plane == &compositor->primary_plane)
+		if (view->plane == &compositor->primary_plane &&
+		    !view->occluded)
 			draw_view(view, output, damage);
 }
 
+/* Replays all recorded operations clipped to one band of the shadow
+ * image. Runs on the worker pool, so every pixman image it touches is
+ * its own.
+ */
+static void
+repaint_band(void *data, int index)
+{
+	struct band_batch *batch = data;
+	struct pixman_renderer *pr = batch->renderer;
+	pixman_image_t *dest = batch->po->band_images[index];
+	struct pixman_draw_op *op;
+	pixman_region32_t clip;
+	pixman_image_t *src, *mask_image, *debug_image;
+	pixman_color_t mask = { 0, };
+	int y1, y2, i;
+
+	y1 = batch->height * index / batch->po->band_count;
+	y2 = batch->height * (index + 1) / batch->po->band_count;
+
+	pixman_region32_init(&clip);
+
+	for (i = 0; i < pr->op_count; i++) {
+		op = &pr->ops[i];
+
+		pixman_region32_intersect_rect(&clip, &op->region,
+					       0, y1,
+					       pixman_image_get_width(dest),
+					       y2 - y1);
+		if (!pixman_region32_not_empty(&clip))
+			continue;
+
+		if (op->data)
+			src = pixman_image_create_bits(op->format,
+						       op->width, op->height,
+						       op->data, op->stride);
+		else
+			src = pixman_image_create_solid_fill(&op->color);
+		if (!src)
+			continue;
+
+		pixman_image_set_transform(src, &op->transform);
+		pixman_image_set_filter(src, op->filter, NULL, 0);
+
+		if (op->alpha < 1.0) {
+			mask.alpha = 0xffff * op->alpha;
+			mask_image = pixman_image_create_solid_fill(&mask);
+		} else {
+			mask_image = NULL;
+		}
+
+		pixman_image_set_clip_region32(dest, &clip);
+
+		/* The SIGBUS guard of a shm buffer is per thread */
+		if (op->shm_buffer)
+			wl_shm_buffer_begin_access(op->shm_buffer);
+
+		pixman_image_composite32(op->op, src, mask_image, dest,
+					 0, 0, 0, 0, 0, 0,
+					 pixman_image_get_width(dest),
+					 pixman_image_get_height(dest));
+
+		if (op->shm_buffer)
+			wl_shm_buffer_end_access(op->shm_buffer);
+
+		if (pr->repaint_debug) {
+			debug_image = pixman_image_create_solid_fill(&debug_red);
+			pixman_image_composite32(PIXMAN_OP_OVER, debug_image,
+						 NULL, dest, 0, 0, 0, 0, 0, 0,
+						 pixman_image_get_width(dest),
+						 pixman_image_get_height(dest));
+			pixman_image_unref(debug_image);
+		}
+
+		if (mask_image)
+			pixman_image_unref(mask_image);
+		pixman_image_unref(src);
+	}
+
+	pixman_image_set_clip_region32(dest, NULL);
+	pixman_region32_fini(&clip);
+}
+
+static void
+repaint_surfaces_banded(struct weston_output *output,
+			pixman_region32_t *damage)
+{
+	struct pixman_renderer *pr = get_renderer(output->compositor);
+	struct band_batch batch;
+	int i;
+
+	pr->op_count = 0;
+	repaint_surfaces(output, damage);
+
+	if (pr->op_count > 0) {
+		batch.renderer = pr;
+		batch.po = get_output_state(output);
+		batch.height = pixman_image_get_height(batch.po->shadow_image);
+		worker_pool_run(pr->pool, repaint_band, &batch,
+				batch.po->band_count);
+	}
+
+	for (i = 0; i < pr->op_count; i++)
+		pixman_region32_fini(&pr->ops[i].region);
+	pr->op_count = 0;
+}
+
 static void
 copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
 {
@@ -477,12 +683,41 @@ pixman_renderer_repaint_output(struct weston_output *output,
 			     pixman_region32_t *output_damage)
 {
 	struct pixman_output_state *po = get_output_state(output);
+	struct weston_compositor *compositor = output->compositor;
+	struct pixman_renderer *pr = get_renderer(compositor);
 
 	if (!po->hw_buffer)
 		return;
 
-	repaint_surfaces(output, output_damage);
-	copy_to_hw_buffer(output, output_damage);
+	if (compositor->rift->enabled && output == compositor->rift->output)
+		rift_timing_begin(compositor);
+
+	if (pr->pool && po->band_images)
+		repaint_surfaces_banded(output, output_damage);
+	else
+		repaint_surfaces(output, output_damage);
+	frame_profiler_add_repaint(compositor->frame_profiler, output_damage);
+
+	/* The rift distorts the whole shadow image on every frame, which
+	 * also takes care of getting it into the hardware buffer. Other
+	 * outputs are not part of the software scene and show as usual. */
+	if (compositor->rift->enabled && output == compositor->rift->output) {
+		rift_timing_mark(compositor, RIFT_STAGE_COMPOSITE);
+		render_rift_pixman(compositor, po->shadow_image, po->hw_buffer);
+		rift_timing_end(compositor);
+	} else if (po->hw_extra_damage) {
+		/* The shadow is up to date outside of output_damage, so
+		 * whatever else the hardware buffer lacks is only copied */
+		pixman_region32_t hw_damage;
+
+		pixman_region32_init(&hw_damage);
+		pixman_region32_union(&hw_damage, output_damage,
+				      po->hw_extra_damage);
+		copy_to_hw_buffer(output, &hw_damage);
+		pixman_region32_fini(&hw_damage);
+	} else {
+		copy_to_hw_buffer(output, output_damage);
+	}
 
 	pixman_region32_copy(&output->previous_damage, output_damage);
 	wl_signal_emit(&output->frame_signal, output);
@@ -654,6 +889,7 @@ pixman_renderer_surface_set_color(struct weston_surface *es,
 	color.green = green * 0xffff;
 	color.blue = blue * 0xffff;
 	color.alpha = alpha * 0xffff;
+	ps->color = color;
 	
 	if (ps->image) {
 		pixman_image_unref(ps->image);
@@ -670,6 +906,9 @@ pixman_renderer_destroy(struct weston_compositor *ec)
 
 	wl_signal_emit(&pr->destroy_signal, pr);
 	weston_binding_destroy(pr->debug_binding);
+	if (pr->pool)
+		worker_pool_destroy(pr->pool);
+	free(pr->ops);
 	free(pr);
 
 	ec->renderer = NULL;
@@ -685,11 +924,7 @@ debug_binding(struct weston_seat *seat, uint32_t time, uint32_t key,
 	pr->repaint_debug ^= 1;
 
 	if (pr->repaint_debug) {
-		pixman_color_t red = {
-			0x3fff, 0x0000, 0x0000, 0x3fff
-		};
-
-		pr->debug_color = pixman_image_create_solid_fill(&red);
+		pr->debug_color = pixman_image_create_solid_fill(&debug_red);
 	} else {
 		pixman_image_unref(pr->debug_color);
 		weston_compositor_damage_all(ec);
@@ -700,11 +935,27 @@ WL_EXPORT int
 pixman_renderer_init(struct weston_compositor *ec)
 {
 	struct pixman_renderer *renderer;
+	struct weston_config_section *section;
+	int threads;
 
 	renderer = calloc(1, sizeof *renderer);
 	if (renderer == NULL)
 		return -1;
 
+	section = weston_config_get_section(ec->config, "core", NULL, NULL);
+	weston_config_section_get_int(section, "pixman-threads", &threads, 1);
+	if (threads != 1) {
+		renderer->pool = worker_pool_create(threads);
+		if (renderer->pool &&
+		    worker_pool_get_threads(renderer->pool) == 1) {
+			worker_pool_destroy(renderer->pool);
+			renderer->pool = NULL;
+		}
+		if (renderer->pool)
+			weston_log("pixman renderer: compositing on %d threads\n",
+				   worker_pool_get_threads(renderer->pool));
+	}
+
 	renderer->repaint_debug = 0;
 	renderer->debug_color = NULL;
 	renderer->base.read_pixels = pixman_renderer_read_pixels;
@@ -714,6 +965,7 @@ pixman_renderer_init(struct weston_compositor *ec)
 	renderer->base.surface_set_color = pixman_renderer_surface_set_color;
 	renderer->base.destroy = pixman_renderer_destroy;
 	ec->renderer = &renderer->base;
+	ec->rift->renderer = RIFT_RENDERER_PIXMAN;
 	ec->capabilities |= WESTON_CAP_ROTATION_ANY;
 	ec->capabilities |= WESTON_CAP_CAPTURE_YFLIP;
 
@@ -743,10 +995,67 @@ pixman_renderer_output_set_buffer(struct weston_output *output, pixman_image_t *
 	}
 }
 
+WL_EXPORT void
+pixman_renderer_output_set_hw_extra_damage(struct weston_output *output,
+					   pixman_region32_t *extra_damage)
+{
+	struct pixman_output_state *po = get_output_state(output);
+
+	po->hw_extra_damage = extra_damage;
+}
+
+static void
+output_destroy_bands(struct pixman_output_state *po)
+{
+	int i;
+
+	for (i = 0; i < po->band_count; i++)
+		pixman_image_unref(po->band_images[i]);
+
+	free(po->band_images);
+	po->band_images = NULL;
+	po->band_count = 0;
+}
+
+/* A few bands per thread so an uneven spread of damage still keeps
+ * every thread busy, but not so thin that per band setup dominates.
+ * Without them the output falls back to compositing serially.
+ */
+static void
+output_create_bands(struct pixman_output_state *po, int threads,
+		    int width, int height)
+{
+	int count, i;
+
+	count = threads * 4;
+	if (count > height / 16)
+		count = height / 16;
+	if (count < 2)
+		return;
+
+	po->band_images = calloc(count, sizeof *po->band_images);
+	if (!po->band_images)
+		return;
+
+	for (i = 0; i < count; i++) {
+		po->band_images[i] =
+			pixman_image_create_bits(PIXMAN_x8r8g8b8,
+						 width, height,
+						 po->shadow_buffer, width * 4);
+		if (!po->band_images[i])
+			break;
+	}
+	po->band_count = i;
+
+	if (po->band_count < 2)
+		output_destroy_bands(po);
+}
+
 WL_EXPORT int
 pixman_renderer_output_create(struct weston_output *output)
 {
 	struct pixman_output_state *po = calloc(1, sizeof *po);
+	struct pixman_renderer *pr = get_renderer(output->compositor);
 	int w, h;
 
 	if (!po)
@@ -773,6 +1082,10 @@ pixman_renderer_output_create(struct weston_output *output)
 		return -1;
 	}
 
+	if (pr->pool)
+		output_create_bands(po, worker_pool_get_threads(pr->pool),
+				    w, h);
+
 	output->renderer_state = po;
 
 	return 0;
@@ -783,6 +1096,7 @@ pixman_renderer_output_destroy(struct weston_output *output)
 {
 	struct pixman_output_state *po = get_output_state(output);
 
+	output_destroy_bands(po);
 	pixman_image_unref(po->shadow_image);
 
 	if (po->hw_buffer)
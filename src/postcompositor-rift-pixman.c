@@ -0,0 +1,426 @@
+/*
+ * Copyright © 2014 Chameleon
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// CPU version of the rift post-compositor, for the pixman renderer.
+//
+// The eye pass is a projective pixman composite of the desktop into one
+// image per eye. The distortion pass does not touch the mesh at run time:
+// setup rasterizes both distortion meshes once into a lookup table that
+// holds, for every output pixel and color channel, the eye pixel it
+// samples. A frame is then a gather per pixel, split into bands of rows
+// that run on a worker pool.
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "postcompositor-rift.h"
+#include "compositor.h"
+#include "worker-pool.h"
+
+// Rows per task, for both passes
+#define RIFT_BAND_HEIGHT 32
+
+// Same clear colors as the GL path
+#define RIFT_EYE_CLEAR 0xff000033
+#define RIFT_DISTORTION_CLEAR 0xff001a00
+
+struct rift_pixman {
+  struct worker_pool *pool;
+
+  // Both eye images side by side, followed by a single background pixel
+  // that output pixels outside the distortion meshes point at
+  uint32_t *eyes;
+  int eyes_stride; // in pixels
+  int eye_x[2];
+  uint32_t background;
+
+  // Per output pixel, the index into eyes of the red, green and blue
+  // sample. Kept as three planes so a row is three linear streams.
+  uint32_t *lut_r;
+  uint32_t *lut_g;
+  uint32_t *lut_b;
+  int width;
+  int height;
+
+  // Distortion output for targets that are not 32 bit xrgb
+  uint32_t *scratch;
+
+  // Per frame state handed to the tasks
+  pixman_image_t *desktop;
+  uint32_t *target;
+  int target_stride; // in pixels
+  int target_height;
+  int eye_visible[2];
+  struct pixman_transform eye_transform[2];
+  int eye_bands[2];
+};
+
+// Nearest eye pixel for a tangent of the eye angle, clamped to the edge
+// like the GL sampler
+static uint32_t
+eye_index(struct rift_pixman *rp, const struct EyeArg *eyeArg, int eye,
+    ovrVector2f tan)
+{
+  float u = tan.x * eyeArg->scale.x + eyeArg->offset.x;
+  float v = tan.y * eyeArg->scale.y + eyeArg->offset.y;
+  int x = floorf(u * eyeArg->textureWidth);
+  int y = floorf(v * eyeArg->textureHeight);
+
+  x = x < 0 ? 0 : MIN(x, eyeArg->textureWidth - 1);
+  y = y < 0 ? 0 : MIN(y, eyeArg->textureHeight - 1);
+
+  return y * rp->eyes_stride + rp->eye_x[eye] + x;
+}
+
+static float
+edge(float ax, float ay, float bx, float by, float px, float py)
+{
+  return (bx - ax) * (py - ay) - (by - ay) * (px - ax);
+}
+
+// Fill the lookup table for every pixel centre inside one mesh triangle,
+// interpolating the tangents of the three channels
+static void
+rasterize_triangle(struct rift_pixman *rp, const struct EyeArg *eyeArg,
+    int eye, const ovrDistortionVertex *v[3])
+{
+  float x[3], y[3];
+  int i;
+
+  // NDC, y up, to output pixels, y down
+  for(i=0; i<3; i++)
+  {
+    x[i] = (v[i]->ScreenPosNDC.x + 1.0) * 0.5 * rp->width;
+    y[i] = (1.0 - v[i]->ScreenPosNDC.y) * 0.5 * rp->height;
+  }
+
+  float area = edge(x[0], y[0], x[1], y[1], x[2], y[2]);
+  if(area == 0.0)
+    return;
+
+  int x0 = fmaxf(floorf(fminf(x[0], fminf(x[1], x[2]))), 0.0);
+  int x1 = fminf(ceilf(fmaxf(x[0], fmaxf(x[1], x[2]))), rp->width);
+  int y0 = fmaxf(floorf(fminf(y[0], fminf(y[1], y[2]))), 0.0);
+  int y1 = fminf(ceilf(fmaxf(y[0], fmaxf(y[1], y[2]))), rp->height);
+
+  int px, py;
+  for(py = y0; py < y1; py++)
+  {
+    for(px = x0; px < x1; px++)
+    {
+      float cx = px + 0.5, cy = py + 0.5;
+      float w0 = edge(x[1], y[1], x[2], y[2], cx, cy) / area;
+      float w1 = edge(x[2], y[2], x[0], y[0], cx, cy) / area;
+      float w2 = 1.0 - w0 - w1;
+      if(w0 < 0.0 || w1 < 0.0 || w2 < 0.0)
+        continue;
+
+      ovrVector2f r, g, b;
+      r.x = w0 * v[0]->TanEyeAnglesR.x + w1 * v[1]->TanEyeAnglesR.x + w2 * v[2]->TanEyeAnglesR.x;
+      r.y = w0 * v[0]->TanEyeAnglesR.y + w1 * v[1]->TanEyeAnglesR.y + w2 * v[2]->TanEyeAnglesR.y;
+      g.x = w0 * v[0]->TanEyeAnglesG.x + w1 * v[1]->TanEyeAnglesG.x + w2 * v[2]->TanEyeAnglesG.x;
+      g.y = w0 * v[0]->TanEyeAnglesG.y + w1 * v[1]->TanEyeAnglesG.y + w2 * v[2]->TanEyeAnglesG.y;
+      b.x = w0 * v[0]->TanEyeAnglesB.x + w1 * v[1]->TanEyeAnglesB.x + w2 * v[2]->TanEyeAnglesB.x;
+      b.y = w0 * v[0]->TanEyeAnglesB.y + w1 * v[1]->TanEyeAnglesB.y + w2 * v[2]->TanEyeAnglesB.y;
+
+      int pixel = py * rp->width + px;
+      rp->lut_r[pixel] = eye_index(rp, eyeArg, eye, r);
+      rp->lut_g[pixel] = eye_index(rp, eyeArg, eye, g);
+      rp->lut_b[pixel] = eye_index(rp, eyeArg, eye, b);
+    }
+  }
+}
+
+// Exported, the copy of setup_rift built into gl-renderer.so links to it
+WL_EXPORT int
+setup_rift_pixman(struct weston_compositor *compositor)
+{
+  struct oculus_rift *rift = compositor->rift;
+  struct rift_pixman *rp;
+  int eye, i;
+
+  rp = calloc(1, sizeof *rp);
+  if(rp == NULL)
+    return -1;
+  rift->pixman = rp;
+
+  rp->width = rift->width;
+  rp->height = rift->height;
+
+  int eyes_height = 0;
+  for(eye = 0; eye < 2; eye++)
+  {
+    rp->eye_x[eye] = rp->eyes_stride;
+    rp->eyes_stride += rift->eyeArgs[eye].textureWidth;
+    if(rift->eyeArgs[eye].textureHeight > eyes_height)
+      eyes_height = rift->eyeArgs[eye].textureHeight;
+  }
+  rp->background = rp->eyes_stride * eyes_height;
+
+  rp->eyes = malloc((rp->background + 1) * sizeof *rp->eyes);
+  rp->lut_r = malloc(rp->width * rp->height * sizeof *rp->lut_r);
+  rp->lut_g = malloc(rp->width * rp->height * sizeof *rp->lut_g);
+  rp->lut_b = malloc(rp->width * rp->height * sizeof *rp->lut_b);
+  rp->scratch = malloc(rp->width * rp->height * sizeof *rp->scratch);
+  if(!rp->eyes || !rp->lut_r || !rp->lut_g || !rp->lut_b || !rp->scratch)
+  {
+    weston_log("rift: out of memory for the software distortion\n");
+    exit(1);
+  }
+
+  for(i = 0; i < rp->background; i++)
+    rp->eyes[i] = RIFT_EYE_CLEAR;
+  rp->eyes[rp->background] = RIFT_DISTORTION_CLEAR;
+  for(i = 0; i < rp->width * rp->height; i++)
+    rp->lut_r[i] = rp->lut_g[i] = rp->lut_b[i] = rp->background;
+
+  for(eye = 0; eye < 2; eye++)
+  {
+    const struct EyeArg *eyeArg = &rift->eyeArgs[eye];
+    const ovrDistortionMesh *mesh = &eyeArg->mesh;
+    unsigned int t;
+
+    for(t = 0; t + 2 < mesh->IndexCount; t += 3)
+    {
+      const ovrDistortionVertex *v[3] = {
+        &mesh->pVertexData[mesh->pIndexData[t]],
+        &mesh->pVertexData[mesh->pIndexData[t + 1]],
+        &mesh->pVertexData[mesh->pIndexData[t + 2]] };
+      rasterize_triangle(rp, eyeArg, eye, v);
+    }
+  }
+
+  rp->pool = worker_pool_create(0);
+  if(rp->pool == NULL)
+  {
+    weston_log("rift: failed to start render threads\n");
+    exit(1);
+  }
+
+  weston_log("rift: software distortion %ix%i, eyes %ix%i, %i threads\n",
+      rp->width, rp->height, rp->eyes_stride, eyes_height,
+      worker_pool_get_threads(rp->pool));
+
+  return 0;
+}
+
+// Maps [-1, 1] quad or NDC coordinates, y up, onto a width x height
+// image, y down
+static void
+ndc_to_pixels(struct pixman_f_transform *t, double x, double width, double height)
+{
+  pixman_f_transform_init_identity(t);
+  t->m[0][0] = width / 2;
+  t->m[0][2] = x + width / 2;
+  t->m[1][1] = -height / 2;
+  t->m[1][2] = height / 2;
+}
+
+// Work out the pixman transform from eye image pixels back to desktop
+// pixels. The virtual screen is a plane, so projecting it is a
+// homography of the quad coordinates. Returns 0 if the screen is not
+// entirely in front of the eye, since pixman cannot clip at w = 0.
+static int
+eye_transform(struct oculus_rift *rift, int eye, ovrPosef eyePose,
+    pixman_image_t *desktop, struct pixman_transform *transform)
+{
+  const struct EyeArg *eyeArg = &rift->eyeArgs[eye];
+  struct rift_screen *screen = rift_screen_for_output(rift, rift->output);
+  struct weston_matrix A, view;
+  struct pixman_f_transform quad_to_clip, clip_to_quad;
+  struct pixman_f_transform eye_pixels, desk_pixels, t;
+  int i;
+
+  // A = Projection * ModelView, A(row, column) = A.d[column * 4 + row]
+  if(screen == NULL)
+    return 0;
+  A = screen->model;
+  rift_eye_view(eyePose, &view);
+  weston_matrix_multiply(&A, &view);
+  weston_matrix_multiply(&A, &eyeArg->projection);
+
+  // The quad lies at z = -0.5, keep the x, y and w rows
+  static const int rows[3] = { 0, 1, 3 };
+  for(i=0; i<3; i++)
+  {
+    quad_to_clip.m[i][0] = A.d[0 * 4 + rows[i]];
+    quad_to_clip.m[i][1] = A.d[1 * 4 + rows[i]];
+    quad_to_clip.m[i][2] = A.d[3 * 4 + rows[i]] - 0.5 * A.d[2 * 4 + rows[i]];
+  }
+
+  for(i=0; i<4; i++)
+  {
+    double x = i & 1 ? 1.0 : -1.0, y = i & 2 ? 1.0 : -1.0;
+    if(quad_to_clip.m[2][0] * x + quad_to_clip.m[2][1] * y + quad_to_clip.m[2][2] <= 0.0)
+      return 0;
+  }
+
+  if(!pixman_f_transform_invert(&clip_to_quad, &quad_to_clip))
+    return 0;
+
+  // In SBS mode each eye only sees its own half of the desktop
+  double desk_width = pixman_image_get_width(desktop);
+  double desk_x = 0.0;
+  if(rift->sbs == 1)
+  {
+    desk_width /= 2;
+    desk_x = eye * desk_width;
+  }
+  ndc_to_pixels(&desk_pixels, desk_x, desk_width, pixman_image_get_height(desktop));
+  ndc_to_pixels(&eye_pixels, 0.0, eyeArg->textureWidth, eyeArg->textureHeight);
+  if(!pixman_f_transform_invert(&t, &eye_pixels))
+    return 0;
+
+  // desktop <- quad <- clip <- eye pixels
+  pixman_f_transform_multiply(&t, &clip_to_quad, &t);
+  pixman_f_transform_multiply(&t, &desk_pixels, &t);
+
+  return pixman_transform_from_pixman_f_transform(transform, &t);
+}
+
+// One band of rows of one eye image
+static void
+eye_task(void *data, int index)
+{
+  struct oculus_rift *rift = data;
+  struct rift_pixman *rp = rift->pixman;
+  int eye = index < rp->eye_bands[0] ? 0 : 1;
+  int band = eye ? index - rp->eye_bands[0] : index;
+  const struct EyeArg *eyeArg = &rift->eyeArgs[eye];
+  int y = band * RIFT_BAND_HEIGHT;
+  int height = MIN(RIFT_BAND_HEIGHT, eyeArg->textureHeight - y);
+  uint32_t *rows = rp->eyes + y * rp->eyes_stride + rp->eye_x[eye];
+  int i, x;
+
+  for(i = 0; i < height; i++)
+    for(x = 0; x < eyeArg->textureWidth; x++)
+      rows[i * rp->eyes_stride + x] = RIFT_EYE_CLEAR;
+
+  if(!rp->eye_visible[eye])
+    return;
+
+  // pixman images are not safe to share between threads, so each task
+  // wraps the pixels it reads and writes in images of its own
+  pixman_image_t *desktop = rp->desktop;
+  pixman_image_t *src = pixman_image_create_bits(
+      pixman_image_get_format(desktop),
+      pixman_image_get_width(desktop), pixman_image_get_height(desktop),
+      pixman_image_get_data(desktop), pixman_image_get_stride(desktop));
+  pixman_image_t *dst = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+      eyeArg->textureWidth, height, rows, rp->eyes_stride * 4);
+
+  pixman_image_set_transform(src, &rp->eye_transform[eye]);
+  pixman_image_set_filter(src, PIXMAN_FILTER_BILINEAR, NULL, 0);
+  pixman_image_composite32(PIXMAN_OP_OVER, src, NULL, dst,
+      0, y, 0, 0, 0, 0, eyeArg->textureWidth, height);
+
+  pixman_image_unref(src);
+  pixman_image_unref(dst);
+}
+
+// One band of rows of the output. Every pixel takes red, green and blue
+// from the eye pixels the lookup table points at.
+static void
+distortion_task(void *data, int index)
+{
+  struct rift_pixman *rp = data;
+  int y0 = index * RIFT_BAND_HEIGHT;
+  int y1 = MIN(y0 + RIFT_BAND_HEIGHT, rp->target_height);
+  const uint32_t *eyes = rp->eyes;
+  int x, y;
+
+  for(y = y0; y < y1; y++)
+  {
+    const uint32_t *r = rp->lut_r + y * rp->width;
+    const uint32_t *g = rp->lut_g + y * rp->width;
+    const uint32_t *b = rp->lut_b + y * rp->width;
+    uint32_t *out = rp->target + y * rp->target_stride;
+
+    for(x = 0; x < rp->width; x++)
+      out[x] = 0xff000000 |
+        (eyes[r[x]] & 0x00ff0000) |
+        (eyes[g[x]] & 0x0000ff00) |
+        (eyes[b[x]] & 0x000000ff);
+  }
+}
+
+WL_EXPORT int
+render_rift_pixman(struct weston_compositor *compositor,
+    pixman_image_t *desktop, pixman_image_t *target)
+{
+  struct oculus_rift *rift = compositor->rift;
+  struct rift_pixman *rp = rift->pixman;
+  ovrPosef eyePoses[2];
+  int eye;
+
+  rift_begin_frame(compositor, eyePoses);
+
+  rp->desktop = desktop;
+  for(eye = 0; eye < 2; eye++)
+  {
+    rp->eye_visible[eye] = eye_transform(rift, eye, eyePoses[eye], desktop,
+        &rp->eye_transform[eye]);
+    rp->eye_bands[eye] = (rift->eyeArgs[eye].textureHeight +
+        RIFT_BAND_HEIGHT - 1) / RIFT_BAND_HEIGHT;
+  }
+  worker_pool_run(rp->pool, eye_task, rift,
+      rp->eye_bands[0] + rp->eye_bands[1]);
+  rift_timing_mark(compositor, RIFT_STAGE_EYES);
+
+  // Straight into the target when it is 32 bit xrgb, through the scratch
+  // buffer for anything else
+  pixman_format_code_t format = pixman_image_get_format(target);
+  int direct = (format == PIXMAN_x8r8g8b8 || format == PIXMAN_a8r8g8b8) &&
+    pixman_image_get_width(target) >= rp->width;
+  if(direct)
+  {
+    rp->target = pixman_image_get_data(target);
+    rp->target_stride = pixman_image_get_stride(target) / 4;
+    rp->target_height = MIN(rp->height, pixman_image_get_height(target));
+  }
+  else
+  {
+    rp->target = rp->scratch;
+    rp->target_stride = rp->width;
+    rp->target_height = rp->height;
+  }
+  worker_pool_run(rp->pool, distortion_task, rp,
+      (rp->target_height + RIFT_BAND_HEIGHT - 1) / RIFT_BAND_HEIGHT);
+
+  if(!direct)
+  {
+    pixman_image_t *scratch = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+        rp->width, rp->height, rp->scratch, rp->width * 4);
+    pixman_image_composite32(PIXMAN_OP_SRC, scratch, NULL, target,
+        0, 0, 0, 0, 0, 0,
+        pixman_image_get_width(target), pixman_image_get_height(target));
+    pixman_image_unref(scratch);
+  }
+  rift_timing_mark(compositor, RIFT_STAGE_DISTORTION);
+
+  ovrHmd_EndFrameTiming(rift->hmd);
+
+  return 0;
+}
@@ -1,6 +1,8 @@
 #include "postcompositor-rift.h"
 #include "compositor.h"
 #include "gl-renderer.h"
+#include <stddef.h>
+#include <math.h>
 #include <wayland-server.h>
 #include <GLES2/gl2.h>
 #include <OVR_CAPI.h>
@@ -14,7 +16,10 @@ static const char* distortion_vertex_shader =
   "uniform vec2 EyeToSourceUVOffset;\n"
   "uniform bool RightEye;\n"
   "uniform float angle;\n"
+  "uniform mat4 EyeRotationStart;\n"
+  "uniform mat4 EyeRotationEnd;\n"
   "attribute vec2 Position;\n"
+  "attribute float TimewarpLerpFactor;\n"
   "attribute vec2 TexCoord0;\n"
   "varying mediump vec2 oTexCoord0;\n"
   "attribute vec2 TexCoordR;\n"
@@ -23,16 +28,25 @@ static const char* distortion_vertex_shader =
   "varying mediump vec2 oTexCoordR;\n"
   //"varying mediump vec2 oTexCoordG;\n"
   "varying mediump vec2 oTexCoordB;\n"
+  // Fraction of the eye image, 0..1 from the bottom left
   "vec2 tanEyeAngleToTexture(vec2 v) {\n"
   "  vec2 result = v * EyeToSourceUVScale + EyeToSourceUVOffset;\n"
   "  result.y = 1.0 - result.y;\n"
   "  return result;\n"
   "}\n"
+  // Rotate the eye ray by the head movement since the eye pass (row-major,
+  // like the eye shader), then project it back onto the tangent plane
+  "vec2 timewarp(vec2 v, mat4 rotation) {\n"
+  "  vec3 transformed = (vec4(v, 1.0, 1.0) * rotation).xyz;\n"
+  "  return tanEyeAngleToTexture(transformed.xy / transformed.z);\n"
+  "}\n"
   "void main() {\n"
-  "  oTexCoord0 = tanEyeAngleToTexture(TexCoord0);\n"
-  "  oTexCoordR = tanEyeAngleToTexture(TexCoordR);\n"
-  //"  oTexCoordG = tanEyeAngleToTexture(TexCoordG);\n"
-  "  oTexCoordB = tanEyeAngleToTexture(TexCoordB);\n"
+  "  mat4 rotation = EyeRotationStart * (1.0 - TimewarpLerpFactor) +\n"
+  "                  EyeRotationEnd * TimewarpLerpFactor;\n"
+  "  oTexCoord0 = timewarp(TexCoord0, rotation);\n"
+  "  oTexCoordR = timewarp(TexCoordR, rotation);\n"
+  //"  oTexCoordG = timewarp(TexCoordG, rotation);\n"
+  "  oTexCoordB = timewarp(TexCoordB, rotation);\n"
   "  vec2 b = Position;\n"
   "  b.x = Position.x*cos(angle) - Position.y*sin(angle);\n"
   "  b.y = Position.y*cos(angle) + Position.x*sin(angle);\n"
@@ -47,15 +61,24 @@ static const char* distortion_fragment_shader =
   //"varying mediump vec2 oTexCoordG;\n"
   "varying mediump vec2 oTexCoordB;\n"
   "uniform sampler2D Texture0;\n"
+  "uniform vec4 LensBreaks;\n"
+  "uniform vec2 LensScales[3];\n"
+  // Eye image fraction to where it is packed in the eye texture, the
+  // cells are piecewise linear per axis
+  "mediump vec2 lensMatch(mediump vec2 f) {\n"
+  "  return min(f, LensBreaks.xy) * LensScales[0] +\n"
+  "         clamp(f - LensBreaks.xy, 0.0, 1.0) * LensScales[1] -\n"
+  "         clamp(f - LensBreaks.zw, 0.0, 1.0) * (LensScales[1] - LensScales[2]);\n"
+  "}\n"
   "void main() {\n"
 /*  "  gl_FragColor.r = texture2D(Texture0, oTexCoordR).r;\n"
   "  gl_FragColor = texture2D(Texture0, oTexCoord0);\n"
   "  gl_FragColor.a = 1.0;\n"
   "  gl_FragColor.g = texture2D(Texture0, oTexCoordG).g;\n"
   "  gl_FragColor.b = texture2D(Texture0, oTexCoordB).b;\n"*/
-  "  mediump float r = texture2D(Texture0, oTexCoordR).r;\n"
-  "  mediump float g = texture2D(Texture0, oTexCoord0).g;\n"
-  "  mediump float b = texture2D(Texture0, oTexCoordB).b;\n"
+  "  mediump float r = texture2D(Texture0, lensMatch(oTexCoordR)).r;\n"
+  "  mediump float g = texture2D(Texture0, lensMatch(oTexCoord0)).g;\n"
+  "  mediump float b = texture2D(Texture0, lensMatch(oTexCoordB)).b;\n"
   "  gl_FragColor = vec4(r, g, b, 1.0);\n"
   "}\n";
 
@@ -66,11 +89,11 @@ static const char* eye_vertex_shader =
   "attribute vec2 TexCoord0;\n"
   "uniform mat4 Projection;\n"
   "uniform mat4 ModelView;\n"
+  "uniform vec4 TexCoordTransform;\n"
   "varying mediump vec2 oTexCoord0;\n"
   "void main() {\n"
-  "  oTexCoord0 = TexCoord0;\n"
-  "  gl_Position = vec4(Position, 1.0) * ModelView * Projection;\n"
-  //"  gl_Position = Projection * ModelView * vec4(Position, 1.0);\n"// * Projection;\n"
+  "  oTexCoord0 = TexCoord0 * TexCoordTransform.xy + TexCoordTransform.zw;\n"
+  "  gl_Position = Projection * ModelView * vec4(Position, 1.0);\n"
   "}\n";
 
 static const char* eye_fragment_shader =
@@ -82,257 +105,108 @@ static const char* eye_fragment_shader =
 
 // End of shaders
 
-// Matrix, Quaternion, and Vector math functions, using ovr types
-// There are weston_matrix functions, maybe use those instead?
+// One vertex of the distortion mesh, as laid out in distortionVertexBuffer
+struct distortion_vertex {
+  GLfloat position[2];
+  GLfloat tanEyeAnglesR[2];
+  GLfloat tanEyeAnglesG[2];
+  GLfloat tanEyeAnglesB[2];
+  GLfloat timeWarpFactor;
+};
 
-static inline ovrMatrix4f initIdentity(void)
-{
-  ovrMatrix4f r;
+// Counts GL entry points issued by render_rift, reported once per change
+#define COUNT_GL(call) (rift->gl_calls++, (call))
 
-  r.M[0][0] = 1; r.M[0][1] = 0; r.M[0][2] = 0; r.M[0][3] = 0;
-  r.M[1][0] = 0; r.M[1][1] = 1; r.M[1][2] = 0; r.M[1][3] = 0;
-  r.M[2][0] = 0; r.M[2][1] = 0; r.M[2][2] = 1; r.M[2][3] = 0;
-  r.M[3][0] = 0; r.M[3][1] = 0; r.M[3][2] = 0; r.M[3][3] = 1;
-
-  return r;
-}
+// Matrix math, on weston_matrix (column-major, column vectors)
 
-static inline ovrMatrix4f initScale(float x, float y, float z)
+static void
+matrix_from_ovr(struct weston_matrix *matrix, const ovrMatrix4f *m)
 {
-  ovrMatrix4f r;
-
-  r.M[0][0] = x; r.M[0][1] = 0; r.M[0][2] = 0; r.M[0][3] = 0;
-  r.M[1][0] = 0; r.M[1][1] = y; r.M[1][2] = 0; r.M[1][3] = 0;
-  r.M[2][0] = 0; r.M[2][1] = 0; r.M[2][2] = z; r.M[2][3] = 0;
-  r.M[3][0] = 0; r.M[3][1] = 0; r.M[3][2] = 0; r.M[3][3] = 1;
+  int r, c;
 
-  return r;
+  for(r=0; r<4; r++)
+    for(c=0; c<4; c++)
+      matrix->d[c * 4 + r] = m->M[r][c];
+  matrix->type = WESTON_MATRIX_TRANSFORM_OTHER;
 }
 
-static inline ovrMatrix4f initTranslationF(float x, float y, float z)
+// The inverse of the head orientation, which turns the world around the
+// eye rather than the eye in the world
+static void
+quatf_to_matrix(struct weston_matrix *matrix, const ovrQuatf q)
 {
-  ovrMatrix4f r;
-
-  r.M[0][0] = 1; r.M[0][1] = 0; r.M[0][2] = 0; r.M[0][3] = x;
-  r.M[1][0] = 0; r.M[1][1] = 1; r.M[1][2] = 0; r.M[1][3] = y;
-  r.M[2][0] = 0; r.M[2][1] = 0; r.M[2][2] = 1; r.M[2][3] = z;
-  r.M[3][0] = 0; r.M[3][1] = 0; r.M[3][2] = 0; r.M[3][3] = 1;
-
-  return r;
+  float *d = matrix->d;
+
+  d[0] = 1 - 2 * (q.y * q.y + q.z * q.z);
+  d[1] = 2 * (q.x * q.y - q.z * q.w);
+  d[2] = 2 * (q.x * q.z + q.y * q.w);
+  d[3] = 0;
+  d[4] = 2 * (q.x * q.y + q.z * q.w);
+  d[5] = 1 - 2 * (q.x * q.x + q.z * q.z);
+  d[6] = 2 * (q.y * q.z - q.x * q.w);
+  d[7] = 0;
+  d[8] = 2 * (q.x * q.z - q.y * q.w);
+  d[9] = 2 * (q.y * q.z + q.x * q.w);
+  d[10] = 1 - 2 * (q.x * q.x + q.y * q.y);
+  d[11] = 0;
+  d[12] = d[13] = d[14] = 0;
+  d[15] = 1;
+  matrix->type = WESTON_MATRIX_TRANSFORM_ROTATE;
 }
 
-static inline ovrMatrix4f matrix4fMul(const ovrMatrix4f m1, const ovrMatrix4f m2)
+// Lay the outputs out in the scene the way they are laid out on the
+// desktop, centred on the headset's own output. A pixel is as large as
+// it always was on the original 3.2 unit wide quad of that output.
+// Only the key bindings and output changes move the screens, so their
+// transforms are kept around instead of being rebuilt every frame.
+static void
+update_screen_models(struct oculus_rift *rift)
 {
-  ovrMatrix4f result;
-  int i, j;
+  struct rift_screen *screen;
+  struct weston_output *center = rift->output;
+  float unit;
 
-  for(i=0; i<4; i++)
+  if(center == NULL)
+    return;
+
+  unit = 6.4 / center->width;
+  wl_list_for_each(screen, &rift->screen_list, link)
   {
-    for(j=0; j<4; j++)
-    {
-      result.M[i][j] = 
-        m1.M[i][0] * m2.M[0][j] +
-        m1.M[i][1] * m2.M[1][j] +
-        m1.M[i][2] * m2.M[2][j] +
-        m1.M[i][3] * m2.M[3][j];
-    }
+    struct weston_output *output = screen->output;
+    float x = output->x + output->width / 2.0 - center->x - center->width / 2.0;
+    float y = output->y + output->height / 2.0 - center->y - center->height / 2.0;
+
+    weston_matrix_init(&screen->model);
+    weston_matrix_scale(&screen->model,
+        output->width / 2.0 * unit, output->height / 2.0 * unit, 1.0);
+    weston_matrix_translate(&screen->model, x * unit, -y * unit, rift->screen_z);
+    weston_matrix_scale(&screen->model, rift->screen_scale, rift->screen_scale, 1.0);
   }
-
-  return result;
 }
 
-static inline ovrMatrix4f quatfToMatrix4f(const ovrQuatf q)
+// A quad is culled when all four corners are outside the same plane of
+// the view frustum
+static int
+screen_visible(const struct weston_matrix *clip)
 {
-  ovrMatrix4f m1, m2;
-
-  m1.M[0][0] = q.w; m1.M[0][1] = q.z; m1.M[0][2] = -q.y; m1.M[0][3] = q.x;
-  m1.M[1][0] = -q.z; m1.M[1][1] = q.w; m1.M[1][2] = q.x; m1.M[1][3] = q.y;
-  m1.M[2][0] = q.y; m1.M[2][1] = -q.x; m1.M[2][2] = q.w; m1.M[2][3] = q.z;
-  m1.M[3][0] = -q.x; m1.M[3][1] = -q.y; m1.M[3][2] = -q.z; m1.M[3][3] = q.w;
-
-  m2.M[0][0] = q.w; m2.M[0][1] = q.z; m2.M[0][2] = -q.y; m2.M[0][3] = -q.x;
-  m2.M[1][0] = -q.z; m2.M[1][1] = q.w; m2.M[1][2] = q.x; m2.M[1][3] = -q.y;
-  m2.M[2][0] = q.y; m2.M[2][1] = -q.x; m2.M[2][2] = q.w; m2.M[2][3] = -q.z;
-  m2.M[3][0] = q.x; m2.M[3][1] = q.y; m2.M[3][2] = q.z; m2.M[3][3] = q.w;
-
-  return matrix4fMul(m1, m2);
-}
-
-static inline ovrMatrix4f initTranslation(const ovrVector3f position)
-{
-  ovrMatrix4f r;
-
-  r.M[0][0] = 1; r.M[0][1] = 0; r.M[0][2] = 0; r.M[0][3] = position.x;
-  r.M[1][0] = 0; r.M[1][1] = 1; r.M[1][2] = 0; r.M[1][3] = position.y;
-  r.M[2][0] = 0; r.M[2][1] = 0; r.M[2][2] = 1; r.M[2][3] = position.z;
-  r.M[3][0] = 0; r.M[3][1] = 0; r.M[3][2] = 0; r.M[3][3] = 1;
-
-  return r;
-}
-
-/* // It turns out we don't need inverse or transpose just yet, we can just use
-   // row-major methods (basically, just reverse order of matrix multiplication)
-
-  static inline ovrMatrix4f inverse(const ovrMatrix4f matrix)
-{
-  float *m = (float *)&matrix.M;
-  ovrMatrix4f result;
-  float *invOut = (float *)&result.M;
-  float inv[16], det;
+  unsigned int outside = ~0u;
   int i;
-  
-    inv[0] = m[5]  * m[10] * m[15] - 
-             m[5]  * m[11] * m[14] - 
-             m[9]  * m[6]  * m[15] + 
-             m[9]  * m[7]  * m[14] +
-             m[13] * m[6]  * m[11] - 
-             m[13] * m[7]  * m[10];
-
-    inv[4] = -m[4]  * m[10] * m[15] + 
-              m[4]  * m[11] * m[14] + 
-              m[8]  * m[6]  * m[15] - 
-              m[8]  * m[7]  * m[14] - 
-              m[12] * m[6]  * m[11] + 
-              m[12] * m[7]  * m[10];
-
-    inv[8] = m[4]  * m[9] * m[15] - 
-             m[4]  * m[11] * m[13] - 
-             m[8]  * m[5] * m[15] + 
-             m[8]  * m[7] * m[13] + 
-             m[12] * m[5] * m[11] - 
-             m[12] * m[7] * m[9];
-
-    inv[12] = -m[4]  * m[9] * m[14] + 
-               m[4]  * m[10] * m[13] +
-               m[8]  * m[5] * m[14] - 
-               m[8]  * m[6] * m[13] - 
-               m[12] * m[5] * m[10] + 
-               m[12] * m[6] * m[9];
-
-    inv[1] = -m[1]  * m[10] * m[15] + 
-              m[1]  * m[11] * m[14] + 
-              m[9]  * m[2] * m[15] - 
-              m[9]  * m[3] * m[14] - 
-              m[13] * m[2] * m[11] + 
-              m[13] * m[3] * m[10];
-
-    inv[5] = m[0]  * m[10] * m[15] - 
-             m[0]  * m[11] * m[14] - 
-             m[8]  * m[2] * m[15] + 
-             m[8]  * m[3] * m[14] + 
-             m[12] * m[2] * m[11] - 
-             m[12] * m[3] * m[10];
-
-    inv[9] = -m[0]  * m[9] * m[15] + 
-              m[0]  * m[11] * m[13] + 
-              m[8]  * m[1] * m[15] - 
-              m[8]  * m[3] * m[13] - 
-              m[12] * m[1] * m[11] + 
-              m[12] * m[3] * m[9];
-
-    inv[13] = m[0]  * m[9] * m[14] - 
-              m[0]  * m[10] * m[13] - 
-              m[8]  * m[1] * m[14] + 
-              m[8]  * m[2] * m[13] + 
-              m[12] * m[1] * m[10] - 
-              m[12] * m[2] * m[9];
-
-    inv[2] = m[1]  * m[6] * m[15] - 
-             m[1]  * m[7] * m[14] - 
-             m[5]  * m[2] * m[15] + 
-             m[5]  * m[3] * m[14] + 
-             m[13] * m[2] * m[7] - 
-             m[13] * m[3] * m[6];
-
-    inv[6] = -m[0]  * m[6] * m[15] + 
-              m[0]  * m[7] * m[14] + 
-              m[4]  * m[2] * m[15] - 
-              m[4]  * m[3] * m[14] - 
-              m[12] * m[2] * m[7] + 
-              m[12] * m[3] * m[6];
-
-    inv[10] = m[0]  * m[5] * m[15] - 
-              m[0]  * m[7] * m[13] - 
-              m[4]  * m[1] * m[15] + 
-              m[4]  * m[3] * m[13] + 
-              m[12] * m[1] * m[7] - 
-              m[12] * m[3] * m[5];
-
-    inv[14] = -m[0]  * m[5] * m[14] + 
-               m[0]  * m[6] * m[13] + 
-               m[4]  * m[1] * m[14] - 
-               m[4]  * m[2] * m[13] - 
-               m[12] * m[1] * m[6] + 
-               m[12] * m[2] * m[5];
-
-    inv[3] = -m[1] * m[6] * m[11] + 
-              m[1] * m[7] * m[10] + 
-              m[5] * m[2] * m[11] - 
-              m[5] * m[3] * m[10] - 
-              m[9] * m[2] * m[7] + 
-              m[9] * m[3] * m[6];
-
-    inv[7] = m[0] * m[6] * m[11] - 
-             m[0] * m[7] * m[10] - 
-             m[4] * m[2] * m[11] + 
-             m[4] * m[3] * m[10] + 
-             m[8] * m[2] * m[7] - 
-             m[8] * m[3] * m[6];
-
-    inv[11] = -m[0] * m[5] * m[11] + 
-               m[0] * m[7] * m[9] + 
-               m[4] * m[1] * m[11] - 
-               m[4] * m[3] * m[9] - 
-               m[8] * m[1] * m[7] + 
-               m[8] * m[3] * m[5];
-
-    inv[15] = m[0] * m[5] * m[10] - 
-              m[0] * m[6] * m[9] - 
-              m[4] * m[1] * m[10] + 
-              m[4] * m[2] * m[9] + 
-              m[8] * m[1] * m[6] - 
-              m[8] * m[2] * m[5];
-
-    det = m[0] * inv[0] + m[1] * inv[4] + m[2] * inv[8] + m[3] * inv[12];
-
-    if (det == 0)
-    {
-      weston_log("Error, matrix inverse determinant is zero\n");
-      return initIdentity();
-    }
-
-    det = 1.0 / det;
-
-    for (i = 0; i < 16; i++)
-        invOut[i] = inv[i] * det;
-
-    return result;
-}
-
-static inline ovrMatrix4f transpose(const ovrMatrix4f m)
-{
-  ovrMatrix4f result;
-  int i, j;
 
   for(i=0; i<4; i++)
   {
-    for(j=0; j<4; j++)
-    {
-      result.M[i][j] = m.M[j][i];
-    }
+    struct weston_vector v = {{ i & 1 ? 1.0 : -1.0, i & 2 ? 1.0 : -1.0, -0.5, 1.0 }};
+    unsigned int planes = 0;
+
+    weston_matrix_transform((struct weston_matrix *) clip, &v);
+    if(v.f[3] <= 0.0) planes |= 1 << 0;
+    if(v.f[0] < -v.f[3]) planes |= 1 << 1;
+    if(v.f[0] > v.f[3]) planes |= 1 << 2;
+    if(v.f[1] < -v.f[3]) planes |= 1 << 3;
+    if(v.f[1] > v.f[3]) planes |= 1 << 4;
+    outside &= planes;
   }
-  return result;
-}*/
-
-static inline ovrMatrix4f posefToMatrix4f(const ovrPosef pose)
-{
-  ovrMatrix4f orientation = quatfToMatrix4f(pose.Orientation);
-  ovrMatrix4f translation = initTranslation(pose.Position);
-  translation.M[0][3] = -translation.M[0][3];
-  translation.M[1][3] = -translation.M[1][3];
-  translation.M[2][3] = -translation.M[2][3];
 
-  return matrix4fMul(translation, orientation);
+  return outside == 0;
 }
 
 // End of Matrix, Quaternion, and Vector math
@@ -464,6 +338,7 @@ move_in(struct weston_seat *seat, uint32_t time, uint32_t key, void *data)
 {
   struct weston_compositor *compositor = data;
   compositor->rift->screen_z += 0.1;
+  update_screen_models(compositor->rift);
 }
 
 static void
@@ -471,6 +346,7 @@ move_out(struct weston_seat *seat, uint32_t time, uint32_t key, void *data)
 {
   struct weston_compositor *compositor = data;
   compositor->rift->screen_z -= 0.1;
+  update_screen_models(compositor->rift);
 }
 
 static void
@@ -478,6 +354,7 @@ scale_up(struct weston_seat *seat, uint32_t time, uint32_t key, void *data)
 {
   struct weston_compositor *compositor = data;
   compositor->rift->screen_scale += 0.1;
+  update_screen_models(compositor->rift);
 }
 
 static void
@@ -485,15 +362,368 @@ scale_down(struct weston_seat *seat, uint32_t time, uint32_t key, void *data)
 {
   struct weston_compositor *compositor = data;
   compositor->rift->screen_scale -= 0.1;
+  update_screen_models(compositor->rift);
+}
+
+// Split an eye axis in three cells, the outer two at lens_matched_density
+static void
+layout_eye_axis(struct oculus_rift *rift, float tanMin, float tanMax,
+    int size, float ndc[4], int pixels[4])
+{
+  float center = rift->lens_matched ? rift->lens_matched_center : 1.0;
+  float density = rift->lens_matched ? rift->lens_matched_density : 1.0;
+  float end;
+  int i;
+
+  ndc[0] = -1.0;
+  ndc[1] = 2.0 * (center - 1.0) * tanMin / (tanMax - tanMin) - 1.0;
+  ndc[2] = 2.0 * (center * tanMax - tanMin) / (tanMax - tanMin) - 1.0;
+  ndc[3] = 1.0;
+
+  pixels[0] = 0;
+  end = 0.0;
+  for(i=1; i<4; i++)
+  {
+    end += (ndc[i] - ndc[i-1]) / 2.0 * size * (i == 2 ? 1.0 : density);
+    pixels[i] = roundf(end);
+  }
+}
+
+// Size the eye viewports for the given pixel density, inside eye textures
+// that were allocated for the maximum density
+static void
+set_pixel_density(struct oculus_rift *rift, float density)
+{
+  int eye;
+
+  rift->pixel_density = density;
+  for(eye = 0; eye < 2; eye++)
+  {
+    struct EyeArg *eyeArg = &rift->eyeArgs[eye];
+    ovrFovPort fov = eyeArg->fov;
+    ovrSizei size = ovrHmd_GetFovTextureSize(rift->hmd, eye, fov, density);
+    ovrRecti viewport;
+    ovrVector2f scaleAndOffset[2];
+    float ndc[2][4];
+    int pixels[2][4];
+    int axis, x, y;
+
+    size.w = MIN(size.w, eyeArg->textureWidth);
+    size.h = MIN(size.h, eyeArg->textureHeight);
+    layout_eye_axis(rift, -fov.LeftTan, fov.RightTan, size.w, ndc[0], pixels[0]);
+    layout_eye_axis(rift, -fov.DownTan, fov.UpTan, size.h, ndc[1], pixels[1]);
+    eyeArg->viewportWidth = pixels[0][3];
+    eyeArg->viewportHeight = pixels[1][3];
+
+    // Tangents to a fraction of the eye image, the fragment shader
+    // finds where that ended up in the texture
+    viewport.Pos.x = viewport.Pos.y = 0;
+    viewport.Size = size;
+    ovrHmd_GetRenderScaleAndOffset(fov, size, viewport, scaleAndOffset);
+    eyeArg->scale = scaleAndOffset[0];
+    eyeArg->offset = scaleAndOffset[1];
+
+    for(axis = 0; axis < 2; axis++)
+    {
+      float texels = axis ? eyeArg->textureHeight : eyeArg->textureWidth;
+      int i;
+
+      eyeArg->lensBreaks[axis] = (ndc[axis][1] + 1.0) / 2.0;
+      eyeArg->lensBreaks[2 + axis] = (ndc[axis][2] + 1.0) / 2.0;
+      for(i = 0; i < 3; i++)
+      {
+        float from = (ndc[axis][i + 1] - ndc[axis][i]) / 2.0;
+        float to = (pixels[axis][i + 1] - pixels[axis][i]) / texels;
+        eyeArg->lensScales[i * 2 + axis] = from > 0.0 ? to / from : 0.0;
+      }
+      // empty outer cells continue the inner one
+      for(i = 0; i < 3; i += 2)
+        if(eyeArg->lensScales[i * 2 + axis] == 0.0)
+          eyeArg->lensScales[i * 2 + axis] = eyeArg->lensScales[2 + axis];
+    }
+
+    // One projection per cell, each stretching its part of the eye
+    // frustum over its own viewport
+    eyeArg->cellCount = 0;
+    for(y = 0; y < 3; y++)
+      for(x = 0; x < 3; x++)
+      {
+        int c = eyeArg->cellCount;
+        struct weston_matrix *m = &eyeArg->cellProjections[c];
+
+        if(pixels[0][x + 1] == pixels[0][x] || pixels[1][y + 1] == pixels[1][y])
+          continue;
+
+        eyeArg->cellViewports[c][0] = pixels[0][x];
+        eyeArg->cellViewports[c][1] = pixels[1][y];
+        eyeArg->cellViewports[c][2] = pixels[0][x + 1] - pixels[0][x];
+        eyeArg->cellViewports[c][3] = pixels[1][y + 1] - pixels[1][y];
+        *m = eyeArg->projection;
+        weston_matrix_translate(m, -(ndc[0][x] + ndc[0][x + 1]) / 2.0,
+            -(ndc[1][y] + ndc[1][y + 1]) / 2.0, 0.0);
+        weston_matrix_scale(m, 2.0 / (ndc[0][x + 1] - ndc[0][x]),
+            2.0 / (ndc[1][y + 1] - ndc[1][y]), 1.0);
+        eyeArg->cellCount++;
+      }
+  }
+}
+
+// Track the frame interval and trade eye resolution for frame rate: drop
+// the pixel density as soon as we miss the refresh budget, and only creep
+// back up after a couple of seconds of making every frame
+static void
+update_pixel_density(struct weston_compositor *compositor)
+{
+  struct oculus_rift *rift = compositor->rift;
+  struct timespec now;
+  float interval, budget;
+  float density = rift->pixel_density;
+
+  clock_gettime(compositor->presentation_clock, &now);
+  interval = (now.tv_sec - rift->last_frame.tv_sec) * 1000.0 +
+    (now.tv_nsec - rift->last_frame.tv_nsec) / 1000000.0;
+  rift->last_frame = now;
+
+  budget = 1000000.0 / rift->refresh;
+  if(interval > budget * 4)
+  {
+    // idle or stalled for reasons that have nothing to do with us
+    rift->frame_time = budget;
+    rift->headroom_frames = 0;
+    return;
+  }
+  rift->frame_time = rift->frame_time * 0.9 + interval * 0.1;
+
+  if(rift->frame_time > budget * 1.25)
+  {
+    density = fmaxf(density - 0.1, rift->min_pixel_density);
+    rift->frame_time = budget;
+    rift->headroom_frames = 0;
+  }
+  else if(rift->frame_time < budget * 1.05)
+  {
+    if(++rift->headroom_frames > rift->refresh / 500)
+    {
+      density = fminf(density + 0.05, rift->max_pixel_density);
+      rift->headroom_frames = 0;
+    }
+  }
+  else
+  {
+    rift->headroom_frames = 0;
+  }
+
+  if(density != rift->pixel_density)
+  {
+    set_pixel_density(rift, density);
+    weston_log("rift: pixel density %.2f\n", density);
+  }
+}
+
+void
+rift_begin_frame(struct weston_compositor *compositor, ovrPosef eyePoses[2])
+{
+  struct oculus_rift *rift = compositor->rift;
+  static int frameIndex = 0;
+
+  ++frameIndex;
+  ovrHmd_BeginFrameTiming(rift->hmd, frameIndex);
+  ovrHmd_GetEyePoses(rift->hmd, frameIndex, rift->hmdToEyeOffsets, eyePoses, NULL);
+}
+
+void
+rift_eye_view(ovrPosef eyePose, struct weston_matrix *view)
+{
+  quatf_to_matrix(view, eyePose.Orientation);
+  weston_matrix_translate(view, -eyePose.Position.x,
+      -eyePose.Position.y, -eyePose.Position.z);
+}
+
+struct rift_screen *
+rift_screen_for_output(struct oculus_rift *rift, struct weston_output *output)
+{
+  struct rift_screen *screen;
+
+  wl_list_for_each(screen, &rift->screen_list, link)
+    if(screen->output == output)
+      return screen;
+
+  return NULL;
+}
+
+static void
+add_screen(struct oculus_rift *rift, struct weston_output *output)
+{
+  struct rift_screen *screen = calloc(1, sizeof *screen);
+
+  if(screen == NULL)
+    return;
+  screen->output = output;
+  screen->width = output->current_mode->width;
+  screen->height = output->current_mode->height;
+  screen->dirty = 1;
+  wl_list_insert(rift->screen_list.prev, &screen->link);
+  update_screen_models(rift);
+}
+
+static void
+output_created(struct wl_listener *listener, void *data)
+{
+  struct oculus_rift *rift =
+    container_of(listener, struct oculus_rift, output_created_listener);
+
+  add_screen(rift, data);
+}
+
+static void
+output_destroyed(struct wl_listener *listener, void *data)
+{
+  struct oculus_rift *rift =
+    container_of(listener, struct oculus_rift, output_destroyed_listener);
+  struct rift_screen *screen = rift_screen_for_output(rift, data);
+
+  if(screen == NULL)
+    return;
+  if(screen->texture)
+  {
+    glDeleteFramebuffers(1, &screen->framebuffer);
+    glDeleteTextures(1, &screen->texture);
+  }
+  wl_list_remove(&screen->link);
+  free(screen);
+  if(rift->output == data)
+    rift->output = NULL;
+  update_screen_models(rift);
+}
+
+static void
+output_moved(struct wl_listener *listener, void *data)
+{
+  struct oculus_rift *rift =
+    container_of(listener, struct oculus_rift, output_moved_listener);
+
+  update_screen_models(rift);
+}
+
+// Point GL rendering at the texture of the output's virtual screen,
+// creating it on first use
+struct rift_screen *
+rift_screen_bind(struct weston_compositor *compositor, struct weston_output *output)
+{
+  struct rift_screen *screen = rift_screen_for_output(compositor->rift, output);
+
+  if(screen == NULL)
+    return NULL;
+
+  if(!screen->texture)
+  {
+    glGenTextures(1, &screen->texture);
+    glBindTexture(GL_TEXTURE_2D, screen->texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, screen->width, screen->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    glGenFramebuffers(1, &screen->framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, screen->framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, screen->texture, 0); show_error();
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+      switch(glCheckFramebufferStatus(GL_FRAMEBUFFER))
+      {
+        case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT: weston_log("incomplete attachment\n"); break;
+        case GL_FRAMEBUFFER_INCOMPLETE_DIMENSIONS: weston_log("incomplete dimensions\n"); break;
+        case GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT: weston_log("incomplete missing attachment\n"); break;
+        case GL_FRAMEBUFFER_UNSUPPORTED: weston_log("unsupported\n"); break;
+      }
+
+      weston_log("framebuffer not working\n");
+      show_error();
+      exit(1);
+    }
+    glClear(GL_COLOR_BUFFER_BIT);
+    screen->dirty = 1;
+  }
+
+  glBindFramebuffer(GL_FRAMEBUFFER, screen->framebuffer);
+  glViewport(0, 0, screen->width, screen->height);
+
+  return screen;
+}
+
+// Outputs other than the headset's still show their own desktop: copy
+// the virtual screen texture to the output's framebuffer
+int
+rift_screen_present(struct weston_compositor *compositor,
+    struct rift_screen *screen, GLuint original_program)
+{
+  struct oculus_rift *rift = compositor->rift;
+  struct eye_shader_ *e = rift->eye_shader;
+  struct weston_matrix identity;
+  static const GLfloat identity_uv[4] = { 1.0, 1.0, 0.0, 0.0 };
+
+  weston_matrix_init(&identity);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glViewport(0, 0, screen->width, screen->height);
+  glDisable(GL_BLEND);
+  glActiveTexture(GL_TEXTURE0);
+  glUseProgram(e->program);
+  glUniform1i(e->virtualScreenTexture, 0);
+  glUniformMatrix4fv(e->Projection, 1, GL_FALSE, identity.d);
+  glUniformMatrix4fv(e->ModelView, 1, GL_FALSE, identity.d);
+  if(screen->direct_texture)
+  {
+    glUniform4fv(e->TexCoordTransform, 1, screen->direct_uv);
+    glBindTexture(GL_TEXTURE_2D, screen->direct_texture);
+  }
+  else
+  {
+    glUniform4fv(e->TexCoordTransform, 1, identity_uv);
+    glBindTexture(GL_TEXTURE_2D, screen->texture);
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, rift->scene->vertexBuffer);
+  glVertexAttribPointer(e->Position, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), NULL);
+  glVertexAttribPointer(e->TexCoord0, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), (void *)(3 * sizeof(GLfloat)));
+  glEnableVertexAttribArray(e->Position);
+  glEnableVertexAttribArray(e->TexCoord0);
+  glDrawArrays(GL_TRIANGLES, 0, 6);
+  glDisableVertexAttribArray(e->Position);
+  glDisableVertexAttribArray(e->TexCoord0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glUseProgram(original_program);
+
+  return 0;
 }
 
 int
 setup_rift(struct weston_compositor *compositor)
 {
   struct oculus_rift *rift = compositor->rift;
+  struct weston_config_section *section;
+  struct weston_output *output;
+  double density;
 
   rift->enabled = 1;
 
+  section = weston_config_get_section(compositor->config, "rift", NULL, NULL);
+  weston_config_section_get_double(section, "pixel-density", &density, 1.0);
+  rift->max_pixel_density = density;
+  weston_config_section_get_double(section, "min-pixel-density", &density, 0.5);
+  rift->min_pixel_density = fminf(density, rift->max_pixel_density);
+  weston_config_section_get_bool(section, "adaptive-resolution",
+      &rift->adaptive_resolution, 0);
+  weston_config_section_get_bool(section, "lens-matched",
+      &rift->lens_matched, 0);
+  weston_config_section_get_double(section, "lens-matched-center", &density, 0.5);
+  rift->lens_matched_center = fminf(fmaxf(density, 0.1), 1.0);
+  weston_config_section_get_double(section, "lens-matched-density", &density, 0.5);
+  rift->lens_matched_density = fminf(fmaxf(density, 0.1), 1.0);
+  // the software eye pass renders the eye images in one go
+  if(rift->renderer != RIFT_RENDERER_GL)
+    rift->lens_matched = 0;
+
   rift->screen_z = -5.0;
   rift->screen_scale = 1.0;
 
@@ -510,6 +740,9 @@ setup_rift(struct weston_compositor *compositor)
   weston_compositor_add_key_binding(compositor, KEY_0, MODIFIER_SUPER, 
       scale_down, compositor);
 
+  if(rift_timing_setup(compositor) < 0)
+    weston_log("rift: failed to set up frame timing\n");
+
   /*// use this at some point in the future to detect and grab the rift display
   struct weston_output *output;
   wl_list_for_each(output, &compositor->output_list, link)
@@ -518,6 +751,79 @@ setup_rift(struct weston_compositor *compositor)
         output->width, output->height);
   }*/
 
+  // The desktop texture and the distortion pass both match the output
+  // the headset is driven through
+  if(wl_list_empty(&compositor->output_list))
+  {
+    weston_log("rift: no output to render to\n");
+    exit(1);
+  }
+  output = container_of(compositor->output_list.next, struct weston_output, link);
+  rift->output = output;
+  rift->width = output->current_mode->width;
+  rift->height = output->current_mode->height;
+  rift->refresh = output->current_mode->refresh ? output->current_mode->refresh : 60000;
+
+  // Every output becomes a virtual screen of its own
+  wl_list_init(&rift->screen_list);
+  wl_list_for_each(output, &compositor->output_list, link)
+    add_screen(rift, output);
+  rift->output_created_listener.notify = output_created;
+  wl_signal_add(&compositor->output_created_signal, &rift->output_created_listener);
+  rift->output_destroyed_listener.notify = output_destroyed;
+  wl_signal_add(&compositor->output_destroyed_signal, &rift->output_destroyed_listener);
+  rift->output_moved_listener.notify = output_moved;
+  wl_signal_add(&compositor->output_moved_signal, &rift->output_moved_listener);
+
+  ovr_Initialize(0);
+  rift->hmd = ovrHmd_Create(0);
+  if(rift->hmd == NULL)
+  {
+    rift->hmd = ovrHmd_CreateDebug(ovrHmd_DK2);
+  }
+  ovrHmd_ConfigureTracking(rift->hmd, ovrTrackingCap_Orientation | 
+      ovrTrackingCap_Position | ovrTrackingCap_MagYawCorrection, 0);
+  ovrHmd_ResetFrameTiming(rift->hmd, 0);
+
+  int eye;
+  unsigned int vertexCount = 0, indexCount = 0;
+  for(eye = 0; eye < 2; eye++)
+  {
+    ovrFovPort fov = rift->hmd->DefaultEyeFov[eye];
+    ovrEyeRenderDesc renderDesc = ovrHmd_GetRenderDesc(rift->hmd, eye, fov);
+    struct EyeArg *eyeArg = &rift->eyeArgs[eye];
+
+    ovrMatrix4f projection = ovrMatrix4f_Projection(fov, 0.1, 100000, true);
+    matrix_from_ovr(&eyeArg->projection, &projection);
+    rift->hmdToEyeOffsets[eye] = renderDesc.HmdToEyeViewOffset;
+    eyeArg->fov = fov;
+    ovrSizei textureSize = ovrHmd_GetFovTextureSize(rift->hmd, eye, fov,
+        rift->max_pixel_density);
+    eyeArg->textureWidth = textureSize.w;
+    eyeArg->textureHeight = textureSize.h;
+
+    ovrHmd_CreateDistortionMesh(rift->hmd, eye, fov, ovrDistortionCap_TimeWarp, &eyeArg->mesh);
+    eyeArg->indexCount = eyeArg->mesh.IndexCount;
+    eyeArg->indexOffset = indexCount * sizeof(unsigned short);
+    vertexCount += eyeArg->mesh.VertexCount;
+    indexCount += eyeArg->mesh.IndexCount;
+  }
+  set_pixel_density(rift, rift->max_pixel_density);
+
+  // Everything above is renderer independent, the rest is up to whoever
+  // composites the desktop
+  switch(rift->renderer)
+  {
+    case RIFT_RENDERER_GL:
+      break;
+    case RIFT_RENDERER_PIXMAN:
+      return setup_rift_pixman(compositor);
+    default:
+      weston_log("rift: renderer not supported, post-compositor disabled\n");
+      rift->enabled = 0;
+      return -1;
+  }
+
   rift->distortion_shader = calloc(1, sizeof *(rift->distortion_shader));
   struct distortion_shader_ *d = rift->distortion_shader;
   d->program = CreateProgram(distortion_vertex_shader, distortion_fragment_shader);
@@ -525,93 +831,54 @@ setup_rift(struct weston_compositor *compositor)
   d->EyeToSourceUVOffset = glGetUniformLocation(d->program, "EyeToSourceUVOffset");
   d->RightEye = glGetUniformLocation(d->program, "RightEye");
   d->angle = glGetUniformLocation(d->program, "angle");
+  d->EyeRotationStart = glGetUniformLocation(d->program, "EyeRotationStart");
+  d->EyeRotationEnd = glGetUniformLocation(d->program, "EyeRotationEnd");
   d->Position = glGetAttribLocation(d->program, "Position");
   d->TexCoord0 = glGetAttribLocation(d->program, "TexCoord0");
   d->TexCoordR = glGetAttribLocation(d->program, "TexCoordR");
-  d->TexCoordG = glGetAttribLocation(d->program, "TexCoordG");
   d->TexCoordB = glGetAttribLocation(d->program, "TexCoordB");
-  d->eyeTexture = glGetAttribLocation(d->program, "Texture0");
+  d->TimewarpLerpFactor = glGetAttribLocation(d->program, "TimewarpLerpFactor");
+  d->eyeTexture = glGetUniformLocation(d->program, "Texture0");
+  d->LensBreaks = glGetUniformLocation(d->program, "LensBreaks");
+  d->LensScales = glGetUniformLocation(d->program, "LensScales");
 
   rift->eye_shader = calloc(1, sizeof *(rift->eye_shader));
   struct eye_shader_ *e = rift->eye_shader;
   e->program = CreateProgram(eye_vertex_shader, eye_fragment_shader);
-  e->Position = glGetAttribLocation(d->program, "Position");
-  e->TexCoord0 = glGetAttribLocation(d->program, "TexCoord0");
+  e->Position = glGetAttribLocation(e->program, "Position");
+  e->TexCoord0 = glGetAttribLocation(e->program, "TexCoord0");
   e->Projection = glGetUniformLocation(e->program, "Projection");
   e->ModelView = glGetUniformLocation(e->program, "ModelView");
-  e->virtualScreenTexture = glGetAttribLocation(d->program, "Texture0");
+  e->virtualScreenTexture = glGetUniformLocation(e->program, "Texture0");
+  e->TexCoordTransform = glGetUniformLocation(e->program, "TexCoordTransform");
 
+  // x, y, z, u, v for the whole screen quad, then the left and right
+  // halves used in SBS mode, so one buffer serves every eye pass
   rift->scene = calloc(1, sizeof *(rift->scene));
   glGenBuffers(1, &rift->scene->vertexBuffer);
   glBindBuffer(GL_ARRAY_BUFFER, rift->scene->vertexBuffer);
-  static const GLfloat rectangle[] = 
-    {-1.0f, -1.0f, -0.5f, 
-      1.0f, -1.0f, -0.5f, 
-     -1.0f, 1.0f, -0.5f,
-      1.0f, -1.0f, -0.5f, 
-      1.0f, 1.0f, -0.5f,
-     -1.0f, 1.0f, -0.5f};
-  glBufferData(GL_ARRAY_BUFFER, sizeof(rectangle), rectangle, GL_STATIC_DRAW);
-
-  glGenBuffers(2, &rift->scene->SBSuvsBuffer[0]);
-  glGenBuffers(1, &rift->scene->uvsBuffer);
-  static const GLfloat uvs[3][12] = 
-   {{ 0.0, 0.0,
-      0.5, 0.0,
-      0.0, 1.0,
-      0.5, 0.0,
-      0.5, 1.0,
-      0.0, 1.0},
-   {  0.5, 0.0,
-      1.0, 0.0,
-      0.5, 1.0,
-      1.0, 0.0,
-      1.0, 1.0,
-      0.5, 1.0},
-   {  0.0, 0.0,
-      1.0, 0.0,
-      0.0, 1.0,
-      1.0, 0.0,
-      1.0, 1.0,
-      0.0, 1.0}};
-  glBindBuffer(GL_ARRAY_BUFFER, rift->scene->SBSuvsBuffer[0]);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(uvs[0]), uvs[0], GL_STATIC_DRAW);
-
-  glBindBuffer(GL_ARRAY_BUFFER, rift->scene->SBSuvsBuffer[1]);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(uvs[1]), uvs[1], GL_STATIC_DRAW);
-
-  glBindBuffer(GL_ARRAY_BUFFER, rift->scene->uvsBuffer);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(uvs[2]), uvs[2], GL_STATIC_DRAW);
-
-  rift->width = 1920;
-  rift->height = 1080;
-
-  glGenTextures(1, &rift->fbTexture);
-  glBindTexture(GL_TEXTURE_2D, rift->fbTexture);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, rift->width, rift->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
-  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  static const GLfloat quads[3][30] =
+   {{-1.0f, -1.0f, -0.5f, 0.0, 0.0,
+      1.0f, -1.0f, -0.5f, 1.0, 0.0,
+     -1.0f,  1.0f, -0.5f, 0.0, 1.0,
+      1.0f, -1.0f, -0.5f, 1.0, 0.0,
+      1.0f,  1.0f, -0.5f, 1.0, 1.0,
+     -1.0f,  1.0f, -0.5f, 0.0, 1.0},
+    {-1.0f, -1.0f, -0.5f, 0.0, 0.0,
+      1.0f, -1.0f, -0.5f, 0.5, 0.0,
+     -1.0f,  1.0f, -0.5f, 0.0, 1.0,
+      1.0f, -1.0f, -0.5f, 0.5, 0.0,
+      1.0f,  1.0f, -0.5f, 0.5, 1.0,
+     -1.0f,  1.0f, -0.5f, 0.0, 1.0},
+    {-1.0f, -1.0f, -0.5f, 0.5, 0.0,
+      1.0f, -1.0f, -0.5f, 1.0, 0.0,
+     -1.0f,  1.0f, -0.5f, 0.5, 1.0,
+      1.0f, -1.0f, -0.5f, 1.0, 0.0,
+      1.0f,  1.0f, -0.5f, 1.0, 1.0,
+     -1.0f,  1.0f, -0.5f, 0.5, 1.0}};
+  glBufferData(GL_ARRAY_BUFFER, sizeof(quads), quads, GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-  glGenFramebuffers(1, &rift->redirectedFramebuffer);
-  glBindFramebuffer(GL_FRAMEBUFFER, rift->redirectedFramebuffer);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, rift->fbTexture, 0); show_error();
-  if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
-  {
-    switch(glCheckFramebufferStatus(GL_FRAMEBUFFER))
-    {
-      case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT: weston_log("incomplete attachment\n"); break;
-      case GL_FRAMEBUFFER_INCOMPLETE_DIMENSIONS: weston_log("incomplete dimensions\n"); break;
-      case GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT: weston_log("incomplete missing attachment\n"); break;
-      case GL_FRAMEBUFFER_UNSUPPORTED: weston_log("unsupported\n"); break;
-    }
-
-    weston_log("framebuffer not working\n");
-    show_error();
-    exit(1);
-  }
-  glClear(GL_COLOR_BUFFER_BIT);
 
   /*EGLint pbufferAttributes[] = {
      EGL_WIDTH,           rift->width,
@@ -637,41 +904,10 @@ setup_rift(struct weston_compositor *compositor)
   eglBindTexImage(rift->egl_display, rift->pbuffer, EGL_BACK_BUFFER);
   eglMakeCurrent(rift->egl_display, rift->orig_surface, rift->orig_surface, rift->egl_context);*/
 
-  ovr_Initialize(0);
-  rift->hmd = ovrHmd_Create(0);
-  if(rift->hmd == NULL)
-  {
-    rift->hmd = ovrHmd_CreateDebug(ovrHmd_DK2);
-  }
-  ovrHmd_ConfigureTracking(rift->hmd, ovrTrackingCap_Orientation | 
-      ovrTrackingCap_Position | ovrTrackingCap_MagYawCorrection, 0);
-  ovrHmd_ResetFrameTiming(rift->hmd, 0);
-
-  int eye;
   for(eye = 0; eye < 2; eye++)
   {
-    ovrFovPort fov = rift->hmd->DefaultEyeFov[eye];
-    ovrEyeRenderDesc renderDesc = ovrHmd_GetRenderDesc(rift->hmd, eye, fov);
     struct EyeArg *eyeArg = &rift->eyeArgs[eye];
 
-    eyeArg->projection = ovrMatrix4f_Projection(fov, 0.1, 100000, true);
-    /*int j, k;
-    for(k=0; k<4; k++)
-    {
-      for(j=0; j<4; j++)
-      {
-        printf("%f\t", eyeArg->projection.M[k][j]);
-      }
-      printf("\n");
-    }*/
-    rift->hmdToEyeOffsets[eye] = renderDesc.HmdToEyeViewOffset;
-    ovrRecti texRect;
-    texRect.Size = ovrHmd_GetFovTextureSize(rift->hmd, eye, rift->hmd->DefaultEyeFov[eye],
-        1.0f);
-    texRect.Pos.x = texRect.Pos.y = 0;
-    eyeArg->textureWidth = texRect.Size.w;
-    eyeArg->textureHeight = texRect.Size.h;
-
     glGenTextures(1, &eyeArg->texture);
     glBindTexture(GL_TEXTURE_2D, eyeArg->texture);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, eyeArg->textureWidth, eyeArg->textureHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
@@ -708,8 +944,8 @@ setup_rift(struct weston_compositor *compositor)
     glClear(GL_COLOR_BUFFER_BIT); show_error();
 
     /*EGLint eyePbufferAttributes[] = {
-       EGL_WIDTH,           texRect.Size.w,
-       EGL_HEIGHT,          texRect.Size.h,
+       EGL_WIDTH,           textureSize.w,
+       EGL_HEIGHT,          textureSize.h,
        EGL_TEXTURE_FORMAT,  EGL_TEXTURE_RGB,
        EGL_TEXTURE_TARGET,  EGL_TEXTURE_2D,
        EGL_NONE
@@ -718,49 +954,97 @@ setup_rift(struct weston_compositor *compositor)
     eyeArg.surface = eglCreatePbufferSurface(
         rift->egl_display, rift->egl_config, 
         eyePbufferAttributes);*/
+  }
 
-    ovrVector2f scaleAndOffset[2];
-    ovrHmd_GetRenderScaleAndOffset(fov, texRect.Size, texRect, scaleAndOffset);
-    eyeArg->scale = scaleAndOffset[0];
-    eyeArg->offset = scaleAndOffset[1];
+  // Both meshes go into one vertex and one index buffer, with the right
+  // eye's indices rebased past the left eye's vertices
+  if(vertexCount > 65536)
+  {
+    weston_log("rift: distortion mesh too large (%u vertices)\n", vertexCount);
+    exit(1);
+  }
+
+  struct distortion_vertex *vertices = calloc(vertexCount, sizeof *vertices);
+  unsigned short *indices = calloc(indexCount, sizeof *indices);
+  struct distortion_vertex *v = vertices;
+  unsigned short *index = indices;
+  unsigned int base = 0;
+  for(eye = 0; eye < 2; eye++)
+  {
+    ovrDistortionMesh *mesh = &rift->eyeArgs[eye].mesh;
+    unsigned int i;
+    for(i=0; i<mesh->VertexCount; i++, v++)
+    {
+      const ovrDistortionVertex *vertex = &mesh->pVertexData[i];
+      v->position[0] = vertex->ScreenPosNDC.x;
+      v->position[1] = vertex->ScreenPosNDC.y;
+      v->tanEyeAnglesR[0] = vertex->TanEyeAnglesR.x;
+      v->tanEyeAnglesR[1] = vertex->TanEyeAnglesR.y;
+      v->tanEyeAnglesG[0] = vertex->TanEyeAnglesG.x;
+      v->tanEyeAnglesG[1] = vertex->TanEyeAnglesG.y;
+      v->tanEyeAnglesB[0] = vertex->TanEyeAnglesB.x;
+      v->tanEyeAnglesB[1] = vertex->TanEyeAnglesB.y;
+      v->timeWarpFactor = vertex->TimeWarpFactor;
+    }
+    for(i=0; i<mesh->IndexCount; i++)
+      *index++ = mesh->pIndexData[i] + base;
+    base += mesh->VertexCount;
+  }
+
+  glGenBuffers(1, &rift->distortionVertexBuffer);
+  glBindBuffer(GL_ARRAY_BUFFER, rift->distortionVertexBuffer);
+  glBufferData(GL_ARRAY_BUFFER, vertexCount * sizeof *vertices, vertices, GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  glGenBuffers(1, &rift->distortionIndexBuffer);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, rift->distortionIndexBuffer);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexCount * sizeof *indices, indices, GL_STATIC_DRAW);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+  free(vertices);
+  free(indices);
 
-    ovrHmd_CreateDistortionMesh(rift->hmd, eye, fov, 0, &eyeArg->mesh);
+  return 0;
+}
+
+// Draw every screen in view of one cell of an eye's frustum
+static void
+draw_screens(struct oculus_rift *rift, int eye,
+    const struct weston_matrix *view, const struct weston_matrix *projection)
+{
+  static const GLfloat identity_uv[4] = { 1.0, 1.0, 0.0, 0.0 };
+  struct eye_shader_ *e = rift->eye_shader;
+  struct rift_screen *screen;
+
+  COUNT_GL(glUniformMatrix4fv(e->Projection, 1, GL_FALSE, projection->d));
+
+  wl_list_for_each(screen, &rift->screen_list, link)
+  {
+    struct weston_matrix MV = screen->model, clip;
 
-    glGenBuffers(1, &eyeArg->indexBuffer);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, eyeArg->indexBuffer);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, eyeArg->mesh.IndexCount * sizeof(unsigned short), eyeArg->mesh.pIndexData, GL_STATIC_DRAW);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    if(!screen->texture)
+      continue;
+    weston_matrix_multiply(&MV, view);
+    clip = MV;
+    weston_matrix_multiply(&clip, projection);
+    if(!screen_visible(&clip))
+      continue;
 
-    float vertices_buffer[eyeArg->mesh.VertexCount*2];
-    float uvs_buffer[3][eyeArg->mesh.VertexCount*2];
-    uint i;
-    for(i=0; i<eyeArg->mesh.VertexCount; i++)
+    if(screen->direct_texture)
     {
-      ovrDistortionVertex vertex = eyeArg->mesh.pVertexData[i];
-      vertices_buffer[i*2] = vertex.ScreenPosNDC.x;
-      vertices_buffer[(i*2)+1] = vertex.ScreenPosNDC.y;
-      uvs_buffer[0][i*2] = vertex.TanEyeAnglesR.x;
-      uvs_buffer[0][(i*2)+1] = vertex.TanEyeAnglesR.y;
-      uvs_buffer[1][i*2] = vertex.TanEyeAnglesG.x;
-      uvs_buffer[1][(i*2)+1] = vertex.TanEyeAnglesG.y;
-      uvs_buffer[2][i*2] = vertex.TanEyeAnglesB.x;
-      uvs_buffer[2][(i*2)+1] = vertex.TanEyeAnglesB.y;
+      COUNT_GL(glBindTexture(GL_TEXTURE_2D, screen->direct_texture));
+      COUNT_GL(glUniform4fv(e->TexCoordTransform, 1, screen->direct_uv));
     }
-
-    glGenBuffers(1, &eyeArg->vertexBuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, eyeArg->vertexBuffer);
-    glBufferData(GL_ARRAY_BUFFER, eyeArg->mesh.VertexCount * sizeof(GL_FLOAT) * 2, vertices_buffer, GL_STATIC_DRAW);
-    glGenBuffers(3, &eyeArg->uvsBuffer[0]);
-    for(i=0; i<3; i++)
+    else
     {
-      glBindBuffer(GL_ARRAY_BUFFER, eyeArg->uvsBuffer[i]);
-      glBufferData(GL_ARRAY_BUFFER, eyeArg->mesh.VertexCount * sizeof(GL_FLOAT) * 2, uvs_buffer[i], GL_STATIC_DRAW);
-      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      COUNT_GL(glBindTexture(GL_TEXTURE_2D, screen->texture));
+      COUNT_GL(glUniform4fv(e->TexCoordTransform, 1, identity_uv));
     }
+    COUNT_GL(glUniformMatrix4fv(e->ModelView, 1, GL_FALSE, MV.d));
+    COUNT_GL(glDrawArrays(GL_TRIANGLES, rift->sbs == 1 ? 6 + 6 * eye : 0, 6));
   }
-
-  return 0;
 }
+
 int
 render_rift(struct weston_compositor *compositor, GLuint original_program)
 {
@@ -776,120 +1060,138 @@ render_rift(struct weston_compositor *compositor, GLuint original_program)
   eglMakeCurrent(rift->egl_display, rift->orig_surface, rift->orig_surface, rift->egl_context);*/
   // render eyes
 
-  static int frameIndex = 0;
-  ++frameIndex;
   ovrPosef eyePoses[2];
-  ovrHmd_BeginFrameTiming(rift->hmd, frameIndex);
-  ovrHmd_GetEyePoses(rift->hmd, frameIndex, rift->hmdToEyeOffsets, eyePoses, NULL);
+  rift_begin_frame(compositor, eyePoses);
+
+  if(rift->adaptive_resolution)
+    update_pixel_density(compositor);
+
+  rift->gl_calls = 0;
+
+  // Eye passes: the quad buffer is bound once, each eye switches
+  // framebuffer, each cell of it viewport and projection, each screen
+  // its texture, model view and (in SBS mode) its quad
+  struct eye_shader_ *e = rift->eye_shader;
+  COUNT_GL(glEnable(GL_DEPTH_TEST));
+  COUNT_GL(glActiveTexture(GL_TEXTURE0));
+  COUNT_GL(glUseProgram(e->program));
+  COUNT_GL(glUniform1i(e->virtualScreenTexture, 0));
+  COUNT_GL(glBindBuffer(GL_ARRAY_BUFFER, rift->scene->vertexBuffer));
+  COUNT_GL(glVertexAttribPointer(e->Position, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), NULL));
+  COUNT_GL(glVertexAttribPointer(e->TexCoord0, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), (void *)(3 * sizeof(GLfloat))));
+  COUNT_GL(glEnableVertexAttribArray(e->Position));
+  COUNT_GL(glEnableVertexAttribArray(e->TexCoord0));
+  COUNT_GL(glClearColor(0.0, 0.0, 0.2, 1.0));
 
-  glEnable(GL_DEPTH_TEST);
-  glUseProgram(rift->eye_shader->program);
   int i;
   for(i=0; i<2; i++)
   {
     const ovrEyeType eye = rift->hmd->EyeRenderOrder[i];
-    struct EyeArg eyeArg = rift->eyeArgs[eye];
-    
-    ovrMatrix4f Model = initTranslationF(0.0, 0.0, rift->screen_z);
-    Model = matrix4fMul(initScale(
-          3.2 * rift->screen_scale, 
-          1.8 * rift->screen_scale, 
-          1.0), Model);
-    ovrMatrix4f MV = matrix4fMul(posefToMatrix4f(eyePoses[eye]), Model);
-    //MV = initIdentity();
-    //MV.M[2][3] = 5;
-
-    glBindFramebuffer(GL_FRAMEBUFFER, eyeArg.framebuffer);
-    glViewport(0, 0, eyeArg.textureWidth, eyeArg.textureHeight);
-    glClearColor(0.0, 0.0, 0.2, 1.0);
-    glClear(GL_COLOR_BUFFER_BIT);
+    const struct EyeArg *eyeArg = &rift->eyeArgs[eye];
+    struct weston_matrix view;
+    rift_eye_view(eyePoses[eye], &view);
 
-    glUniform1i(rift->eye_shader->virtualScreenTexture, 0);
-    glUniformMatrix4fv(rift->eye_shader->Projection, 1, GL_FALSE, &eyeArg.projection.M[0][0]);
-    glUniformMatrix4fv(rift->eye_shader->ModelView, 1, GL_FALSE, &MV.M[0][0]);
+    COUNT_GL(glBindFramebuffer(GL_FRAMEBUFFER, eyeArg->framebuffer));
+    COUNT_GL(glClear(GL_COLOR_BUFFER_BIT));
 
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
-
-    glBindTexture(GL_TEXTURE_2D, rift->fbTexture);
-    glBindBuffer(GL_ARRAY_BUFFER, rift->scene->vertexBuffer);
-    glVertexAttribPointer(rift->eye_shader->Position, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), NULL);
-    if(rift->sbs == 1)
-      glBindBuffer(GL_ARRAY_BUFFER, rift->scene->SBSuvsBuffer[eye]);
-    else
-      glBindBuffer(GL_ARRAY_BUFFER, rift->scene->uvsBuffer);
-    glVertexAttribPointer(rift->eye_shader->TexCoord0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), NULL);
-    glDrawArrays(GL_TRIANGLES, 0, 6);
-
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glDisableVertexAttribArray(0);
-    glDisableVertexAttribArray(1);
-    //render_eye(rift, eyeArg);
+    int cell;
+    for(cell=0; cell<eyeArg->cellCount; cell++)
+    {
+      const int *viewport = eyeArg->cellViewports[cell];
+      COUNT_GL(glViewport(viewport[0], viewport[1], viewport[2], viewport[3]));
+      draw_screens(rift, eye, &view, &eyeArg->cellProjections[cell]);
+    }
   }
 
-  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  COUNT_GL(glDisableVertexAttribArray(e->Position));
+  COUNT_GL(glDisableVertexAttribArray(e->TexCoord0));
+  COUNT_GL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+  rift_timing_mark(compositor, RIFT_STAGE_EYES);
 
-  // render distortion
-  glUseProgram(rift->distortion_shader->program);
-  glViewport(0, 0, 1920, 1080);
+  // render distortion, both eyes from the shared mesh buffers
+  struct distortion_shader_ *d = rift->distortion_shader;
+  COUNT_GL(glUseProgram(d->program));
+  COUNT_GL(glViewport(0, 0, rift->width, rift->height));
 
-  glClearColor(0.0, 0.1, 0.0, 1.0);
-  glClear(GL_COLOR_BUFFER_BIT);
-  glDisable(GL_BLEND);
-  glDisable(GL_CULL_FACE);
-  glDisable(GL_DEPTH_TEST);
+  COUNT_GL(glClearColor(0.0, 0.1, 0.0, 1.0));
+  COUNT_GL(glClear(GL_COLOR_BUFFER_BIT));
+  COUNT_GL(glDisable(GL_BLEND));
+  COUNT_GL(glDisable(GL_CULL_FACE));
+  COUNT_GL(glDisable(GL_DEPTH_TEST));
 
   float angle = 0.0;
   if(rift->rotate == 1)
   {
     angle = 1.57079633; // 90 degrees, in radians
-    glViewport(0, 0, 1080, 1920);
+    COUNT_GL(glViewport(0, 0, rift->height, rift->width));
   }
 
+  COUNT_GL(glUniform1f(d->angle, angle));
+  COUNT_GL(glUniform1i(d->eyeTexture, 0));
+
+  const GLsizei stride = sizeof(struct distortion_vertex);
+  COUNT_GL(glBindBuffer(GL_ARRAY_BUFFER, rift->distortionVertexBuffer));
+  COUNT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, rift->distortionIndexBuffer));
+  COUNT_GL(glVertexAttribPointer(d->Position, 2, GL_FLOAT, GL_FALSE, stride,
+        (void *)offsetof(struct distortion_vertex, position)));
+  COUNT_GL(glVertexAttribPointer(d->TexCoordR, 2, GL_FLOAT, GL_FALSE, stride,
+        (void *)offsetof(struct distortion_vertex, tanEyeAnglesR)));
+  COUNT_GL(glVertexAttribPointer(d->TexCoord0, 2, GL_FLOAT, GL_FALSE, stride,
+        (void *)offsetof(struct distortion_vertex, tanEyeAnglesG)));
+  COUNT_GL(glVertexAttribPointer(d->TexCoordB, 2, GL_FLOAT, GL_FALSE, stride,
+        (void *)offsetof(struct distortion_vertex, tanEyeAnglesB)));
+  COUNT_GL(glVertexAttribPointer(d->TimewarpLerpFactor, 1, GL_FLOAT, GL_FALSE, stride,
+        (void *)offsetof(struct distortion_vertex, timeWarpFactor)));
+  COUNT_GL(glEnableVertexAttribArray(d->Position));
+  COUNT_GL(glEnableVertexAttribArray(d->TexCoordR));
+  COUNT_GL(glEnableVertexAttribArray(d->TexCoord0));
+  COUNT_GL(glEnableVertexAttribArray(d->TexCoordB));
+  COUNT_GL(glEnableVertexAttribArray(d->TimewarpLerpFactor));
+
   int eye;
   for(eye=0; eye<2; eye++)
   {
-    struct EyeArg eyeArg = rift->eyeArgs[eye];
-    glUniform2fv(rift->distortion_shader->EyeToSourceUVScale, 1, (float *)&eyeArg.scale);
-    glUniform2fv(rift->distortion_shader->EyeToSourceUVOffset, 1, (float *)&eyeArg.offset);
-    glUniform1i(rift->distortion_shader->RightEye, eye);
-    glUniform1f(rift->distortion_shader->angle, angle);
-    glUniform1i(rift->distortion_shader->eyeTexture, 0);
-
-    //glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, eyeArg.texture);
-
-    glBindBuffer(GL_ARRAY_BUFFER, eyeArg.vertexBuffer);
-    glVertexAttribPointer(rift->distortion_shader->Position, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), NULL);
-    glEnableVertexAttribArray(rift->distortion_shader->Position);
-
-    glBindBuffer(GL_ARRAY_BUFFER, eyeArg.uvsBuffer[1]);
-    glVertexAttribPointer(rift->distortion_shader->TexCoord0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), NULL);
-    glEnableVertexAttribArray(rift->distortion_shader->TexCoord0);
-    glBindBuffer(GL_ARRAY_BUFFER, eyeArg.uvsBuffer[0]);
-    glVertexAttribPointer(rift->distortion_shader->TexCoordR, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), NULL);
-    glEnableVertexAttribArray(rift->distortion_shader->TexCoordR);
-    glBindBuffer(GL_ARRAY_BUFFER, eyeArg.uvsBuffer[1]);
-    glVertexAttribPointer(rift->distortion_shader->TexCoordG, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), NULL);
-    glEnableVertexAttribArray(rift->distortion_shader->TexCoordG);
-    glBindBuffer(GL_ARRAY_BUFFER, eyeArg.uvsBuffer[2]);
-    glVertexAttribPointer(rift->distortion_shader->TexCoordB, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), NULL);
-    glEnableVertexAttribArray(rift->distortion_shader->TexCoordB);
-
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, eyeArg.indexBuffer);
-
-    glDrawElements(GL_TRIANGLES, eyeArg.mesh.IndexCount, GL_UNSIGNED_SHORT, 0);
-
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    const struct EyeArg *eyeArg = &rift->eyeArgs[eye];
+
+    // Late latch: sample the head pose again as close to scanout as we
+    // can and let the shader rotate the eye image by the difference
+    // from the pose the eye pass was rendered with
+    ovrMatrix4f timeWarpMatrices[2];
+    ovrHmd_GetEyeTimewarpMatrices(rift->hmd, eye, eyePoses[eye], timeWarpMatrices);
+    COUNT_GL(glUniformMatrix4fv(d->EyeRotationStart, 1, GL_FALSE, &timeWarpMatrices[0].M[0][0]));
+    COUNT_GL(glUniformMatrix4fv(d->EyeRotationEnd, 1, GL_FALSE, &timeWarpMatrices[1].M[0][0]));
+
+    COUNT_GL(glUniform2fv(d->EyeToSourceUVScale, 1, (float *)&eyeArg->scale));
+    COUNT_GL(glUniform2fv(d->EyeToSourceUVOffset, 1, (float *)&eyeArg->offset));
+    COUNT_GL(glUniform4fv(d->LensBreaks, 1, eyeArg->lensBreaks));
+    COUNT_GL(glUniform2fv(d->LensScales, 3, eyeArg->lensScales));
+    COUNT_GL(glUniform1i(d->RightEye, eye));
+    COUNT_GL(glBindTexture(GL_TEXTURE_2D, eyeArg->texture));
+    COUNT_GL(glDrawElements(GL_TRIANGLES, eyeArg->indexCount, GL_UNSIGNED_SHORT,
+          (void *)eyeArg->indexOffset));
   }
 
+  COUNT_GL(glDisableVertexAttribArray(d->Position));
+  COUNT_GL(glDisableVertexAttribArray(d->TexCoordR));
+  COUNT_GL(glDisableVertexAttribArray(d->TexCoord0));
+  COUNT_GL(glDisableVertexAttribArray(d->TexCoordB));
+  COUNT_GL(glDisableVertexAttribArray(d->TimewarpLerpFactor));
+  COUNT_GL(glBindBuffer(GL_ARRAY_BUFFER, 0));
+  COUNT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0));
+
   //glEnable(GL_CULL_FACE);
-  glEnable(GL_DEPTH_TEST);
+  COUNT_GL(glEnable(GL_DEPTH_TEST));
+  rift_timing_mark(compositor, RIFT_STAGE_DISTORTION);
 
   ovrHmd_EndFrameTiming(rift->hmd);
 
   // set program back to original shader program
-  glUseProgram(original_program);
+  COUNT_GL(glUseProgram(original_program));
+
+  if(rift->gl_calls != rift->gl_calls_reported)
+  {
+    weston_log("rift: %i GL calls per frame\n", rift->gl_calls);
+    rift->gl_calls_reported = rift->gl_calls;
+  }
   return 0;
 }
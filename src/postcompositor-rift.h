@@ -40,4 +40,53 @@ setup_rift(struct weston_compositor *compositor);
 int
 render_rift(struct weston_compositor *compositor, GLuint original_program);
 
+// Starts the frame timing of the HMD and predicts where the eyes are
+void
+rift_begin_frame(struct weston_compositor *compositor, ovrPosef eyePoses[2]);
+
+// World to eye, for one eye pose
+void
+rift_eye_view(ovrPosef eyePose, struct weston_matrix *view);
+
+struct rift_screen *
+rift_screen_for_output(struct oculus_rift *rift, struct weston_output *output);
+
+struct rift_screen *
+rift_screen_bind(struct weston_compositor *compositor, struct weston_output *output);
+
+int
+rift_screen_present(struct weston_compositor *compositor,
+    struct rift_screen *screen, GLuint original_program);
+
+// CPU path, see postcompositor-rift-pixman.c
+int
+setup_rift_pixman(struct weston_compositor *compositor);
+
+int
+render_rift_pixman(struct weston_compositor *compositor,
+    pixman_image_t *desktop, pixman_image_t *target);
+
+// Frame timing, see rift-timing.c
+enum rift_timing_stage {
+  RIFT_STAGE_COMPOSITE,
+  RIFT_STAGE_EYES,
+  RIFT_STAGE_DISTORTION,
+  RIFT_STAGE_SWAP,
+  RIFT_TIMING_STAGES
+};
+
+int
+rift_timing_setup(struct weston_compositor *compositor);
+
+void
+rift_timing_begin(struct weston_compositor *compositor);
+
+// Ends the given stage, which started at the previous mark
+void
+rift_timing_mark(struct weston_compositor *compositor,
+    enum rift_timing_stage stage);
+
+void
+rift_timing_end(struct weston_compositor *compositor);
+
 #endif
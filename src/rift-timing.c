@@ -0,0 +1,458 @@
+/*
+ * Copyright © 2014 Chameleon
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Per stage timing of the rift post-compositor.
+//
+// The renderers bracket every rift frame with rift_timing_begin() and
+// rift_timing_end() and call rift_timing_mark() as each stage finishes.
+// CPU times come from CLOCK_MONOTONIC. With the GL renderer, and
+// timer-queries set in the [rift] section, every mark also drops a
+// GL_EXT_disjoint_timer_query timestamp into the command stream; those
+// are collected a few frames later, once the GPU has caught up.
+//
+// Finished frames go into a ring buffer, are sent to weston_rift_timing
+// clients, and are summarized in the log every timing-summary seconds.
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+#include <EGL/egl.h>
+
+#include "postcompositor-rift.h"
+#include "compositor.h"
+#include "rift-timing-server-protocol.h"
+
+// Frames kept for the summary, a power of two
+#define RIFT_TIMING_FRAMES 1024
+// Frames of GPU timestamps that may be in flight
+#define RIFT_TIMING_QUERY_FRAMES 4
+
+static const char *stage_names[RIFT_TIMING_STAGES] = {
+  "composite", "eyes", "distortion", "swap"
+};
+
+struct rift_frame_timing {
+  uint32_t sequence;
+  uint32_t cpu[RIFT_TIMING_STAGES]; // us
+  uint32_t gpu[RIFT_TIMING_STAGES]; // us, 0 until the queries are back
+};
+
+struct rift_timing_queries {
+  // Timestamp at the frame start, then one per stage
+  GLuint queries[RIFT_TIMING_STAGES + 1];
+  uint32_t marked; // bit per stage that got a timestamp
+  uint32_t sequence;
+  int pending;
+};
+
+struct rift_timing {
+  struct weston_compositor *compositor;
+  struct wl_global *global;
+  struct wl_list resource_list;
+  struct wl_event_source *summary_timer;
+  int summary_interval; // ms, 0 for no summary
+  struct wl_listener destroy_listener;
+
+  struct rift_frame_timing frames[RIFT_TIMING_FRAMES];
+  uint32_t recorded; // frames that went into the ring
+  uint32_t summarized; // value of recorded at the last summary
+
+  struct rift_frame_timing current;
+  struct timespec last_mark;
+  int in_frame;
+
+  int timer_queries; // asked for in weston.ini
+  int gpu; // 1 when the extension works, -1 when it does not
+  struct rift_timing_queries inflight[RIFT_TIMING_QUERY_FRAMES];
+  PFNGLGENQUERIESEXTPROC gen_queries;
+  PFNGLQUERYCOUNTEREXTPROC query_counter;
+  PFNGLGETQUERYOBJECTIVEXTPROC get_query_objectiv;
+  PFNGLGETQUERYOBJECTUI64VEXTPROC get_query_objectui64v;
+};
+
+static uint32_t
+elapsed_us(const struct timespec *from, const struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) * 1000000 +
+    (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+// Called on the first GL frame, where there is a current context to
+// look at
+static void
+gpu_init(struct rift_timing *timing)
+{
+  const char *extensions;
+  int i;
+
+  timing->gpu = -1;
+  if(!timing->timer_queries ||
+      timing->compositor->rift->renderer != RIFT_RENDERER_GL)
+    return;
+
+  extensions = (const char *) glGetString(GL_EXTENSIONS);
+  if(!extensions || !strstr(extensions, "GL_EXT_disjoint_timer_query"))
+  {
+    weston_log("rift: GL_EXT_disjoint_timer_query not available, "
+        "GPU timing disabled\n");
+    return;
+  }
+
+  timing->gen_queries = (void *) eglGetProcAddress("glGenQueriesEXT");
+  timing->query_counter = (void *) eglGetProcAddress("glQueryCounterEXT");
+  timing->get_query_objectiv = (void *) eglGetProcAddress("glGetQueryObjectivEXT");
+  timing->get_query_objectui64v = (void *) eglGetProcAddress("glGetQueryObjectui64vEXT");
+  if(!timing->gen_queries || !timing->query_counter || !timing->get_query_objectiv ||
+      !timing->get_query_objectui64v)
+    return;
+
+  for(i=0; i<RIFT_TIMING_QUERY_FRAMES; i++)
+    timing->gen_queries(RIFT_TIMING_STAGES + 1, timing->inflight[i].queries);
+  timing->gpu = 1;
+}
+
+static void
+send_frame(struct rift_timing *timing, const struct rift_frame_timing *frame,
+    int gpu)
+{
+  struct wl_resource *resource;
+  const uint32_t *t = gpu ? frame->gpu : frame->cpu;
+
+  wl_resource_for_each(resource, &timing->resource_list)
+  {
+    if(gpu)
+      weston_rift_timing_send_gpu_frame(resource, frame->sequence,
+          t[RIFT_STAGE_COMPOSITE], t[RIFT_STAGE_EYES],
+          t[RIFT_STAGE_DISTORTION], t[RIFT_STAGE_SWAP]);
+    else
+      weston_rift_timing_send_frame(resource, frame->sequence,
+          t[RIFT_STAGE_COMPOSITE], t[RIFT_STAGE_EYES],
+          t[RIFT_STAGE_DISTORTION], t[RIFT_STAGE_SWAP]);
+  }
+}
+
+// Pick up every in-flight frame whose timestamps have landed. Results
+// are thrown away if the driver reports a disjoint event, since the
+// timestamps may then not be comparable.
+static void
+gpu_collect(struct rift_timing *timing)
+{
+  GLint disjoint = 0;
+  int i, stage;
+
+  glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+
+  for(i=0; i<RIFT_TIMING_QUERY_FRAMES; i++)
+  {
+    struct rift_timing_queries *q = &timing->inflight[i];
+    GLint available = 0;
+    GLuint64 start, end;
+
+    if(!q->pending)
+      continue;
+
+    // The last stamp of a frame is the last one to become available
+    for(stage = RIFT_TIMING_STAGES - 1; stage >= 0; stage--)
+      if(q->marked & (1 << stage))
+        break;
+    if(stage < 0)
+    {
+      q->pending = 0;
+      continue;
+    }
+    timing->get_query_objectiv(q->queries[stage + 1],
+        GL_QUERY_RESULT_AVAILABLE_EXT, &available);
+    if(!available && !disjoint)
+      continue;
+
+    q->pending = 0;
+    if(disjoint)
+      continue;
+
+    struct rift_frame_timing *frame =
+      &timing->frames[q->sequence & (RIFT_TIMING_FRAMES - 1)];
+    if(frame->sequence != q->sequence)
+      continue; // already overwritten in the ring
+
+    timing->get_query_objectui64v(q->queries[0], GL_QUERY_RESULT_EXT, &start);
+    for(stage = 0; stage < RIFT_TIMING_STAGES; stage++)
+    {
+      if(!(q->marked & (1 << stage)))
+        continue;
+      timing->get_query_objectui64v(q->queries[stage + 1],
+          GL_QUERY_RESULT_EXT, &end);
+      frame->gpu[stage] = (end - start) / 1000;
+      start = end;
+    }
+    send_frame(timing, frame, 1);
+  }
+}
+
+WL_EXPORT void
+rift_timing_begin(struct weston_compositor *compositor)
+{
+  struct rift_timing *timing = compositor->rift->timing;
+
+  if(timing == NULL)
+    return;
+
+  memset(&timing->current, 0, sizeof timing->current);
+  timing->current.sequence = timing->recorded;
+  clock_gettime(CLOCK_MONOTONIC, &timing->last_mark);
+  timing->in_frame = 1;
+
+  if(timing->gpu == 0)
+    gpu_init(timing);
+  if(timing->gpu < 0)
+    return;
+
+  gpu_collect(timing);
+
+  // If the GPU is that far behind, give up on the oldest frame
+  struct rift_timing_queries *q =
+    &timing->inflight[timing->current.sequence % RIFT_TIMING_QUERY_FRAMES];
+  q->pending = 0;
+  q->marked = 0;
+  q->sequence = timing->current.sequence;
+  timing->query_counter(q->queries[0], GL_TIMESTAMP_EXT);
+}
+
+WL_EXPORT void
+rift_timing_mark(struct weston_compositor *compositor,
+    enum rift_timing_stage stage)
+{
+  struct rift_timing *timing = compositor->rift->timing;
+  struct timespec now;
+
+  if(timing == NULL || !timing->in_frame)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  timing->current.cpu[stage] = elapsed_us(&timing->last_mark, &now);
+  timing->last_mark = now;
+
+  if(timing->gpu > 0)
+  {
+    struct rift_timing_queries *q =
+      &timing->inflight[timing->current.sequence % RIFT_TIMING_QUERY_FRAMES];
+    timing->query_counter(q->queries[stage + 1], GL_TIMESTAMP_EXT);
+    q->marked |= 1 << stage;
+  }
+}
+
+WL_EXPORT void
+rift_timing_end(struct weston_compositor *compositor)
+{
+  struct rift_timing *timing = compositor->rift->timing;
+
+  if(timing == NULL || !timing->in_frame)
+    return;
+
+  timing->in_frame = 0;
+  timing->frames[timing->recorded & (RIFT_TIMING_FRAMES - 1)] = timing->current;
+  timing->recorded++;
+
+  if(timing->gpu > 0)
+    timing->inflight[timing->current.sequence % RIFT_TIMING_QUERY_FRAMES].pending = 1;
+
+  send_frame(timing, &timing->current, 0);
+}
+
+static int
+compare_uint32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+// Sorts values in place and prints its median and 99th percentile
+static int
+format_percentiles(char *buf, size_t size, uint32_t *values, int count)
+{
+  qsort(values, count, sizeof *values, compare_uint32);
+
+  return snprintf(buf, size, " %.2f/%.2f",
+      values[count / 2] / 1000.0, values[(count * 99) / 100] / 1000.0);
+}
+
+static void
+log_summary(struct rift_timing *timing, int gpu)
+{
+  uint32_t values[RIFT_TIMING_FRAMES];
+  char line[256];
+  int len, stage, count, i;
+
+  count = timing->recorded - timing->summarized;
+  if(count > RIFT_TIMING_FRAMES)
+    count = RIFT_TIMING_FRAMES;
+
+  len = snprintf(line, sizeof line, "rift: %s ms p50/p99 over %i frames:",
+      gpu ? "gpu" : "cpu", count);
+  for(stage = 0; stage < RIFT_TIMING_STAGES; stage++)
+  {
+    int n = 0;
+    for(i = 0; i < count; i++)
+    {
+      const struct rift_frame_timing *frame =
+        &timing->frames[(timing->recorded - 1 - i) & (RIFT_TIMING_FRAMES - 1)];
+      uint32_t t = gpu ? frame->gpu[stage] : frame->cpu[stage];
+      // A zero GPU time is one that has not come back (yet)
+      if(!gpu || t)
+        values[n++] = t;
+    }
+    if(n == 0)
+      continue;
+
+    len += snprintf(line + len, sizeof line - len, " %s", stage_names[stage]);
+    len += format_percentiles(line + len, sizeof line - len, values, n);
+  }
+  weston_log("%s\n", line);
+}
+
+static int
+summary_handler(void *data)
+{
+  struct rift_timing *timing = data;
+
+  if(timing->recorded != timing->summarized)
+  {
+    log_summary(timing, 0);
+    if(timing->gpu > 0)
+      log_summary(timing, 1);
+    timing->summarized = timing->recorded;
+  }
+
+  wl_event_source_timer_update(timing->summary_timer,
+      timing->summary_interval);
+  return 1;
+}
+
+static void
+timing_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+  wl_resource_destroy(resource);
+}
+
+static const struct weston_rift_timing_interface timing_implementation = {
+  timing_destroy
+};
+
+static void
+unbind_timing(struct wl_resource *resource)
+{
+  // Resources outliving the compositor were already taken off the list
+  if(wl_resource_get_user_data(resource) == NULL)
+    return;
+
+  wl_list_remove(wl_resource_get_link(resource));
+}
+
+static void
+bind_timing(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+  struct rift_timing *timing = data;
+  struct wl_resource *resource;
+
+  resource = wl_resource_create(client, &weston_rift_timing_interface, 1, id);
+  if(resource == NULL)
+  {
+    wl_client_post_no_memory(client);
+    return;
+  }
+
+  wl_resource_set_implementation(resource, &timing_implementation,
+      timing, unbind_timing);
+  wl_list_insert(&timing->resource_list, wl_resource_get_link(resource));
+}
+
+static void
+timing_compositor_destroy(struct wl_listener *listener, void *data)
+{
+  struct rift_timing *timing =
+    container_of(listener, struct rift_timing, destroy_listener);
+  struct wl_resource *resource, *tmp;
+
+  // The clients, and with them their resources, are only destroyed
+  // later with the display, so cut the resources loose from timing
+  wl_resource_for_each_safe(resource, tmp, &timing->resource_list)
+  {
+    wl_list_init(wl_resource_get_link(resource));
+    wl_resource_set_user_data(resource, NULL);
+  }
+
+  if(timing->summary_timer)
+    wl_event_source_remove(timing->summary_timer);
+  wl_global_destroy(timing->global);
+  timing->compositor->rift->timing = NULL;
+  free(timing);
+}
+
+WL_EXPORT int
+rift_timing_setup(struct weston_compositor *compositor)
+{
+  struct rift_timing *timing;
+  struct weston_config_section *section;
+  struct wl_event_loop *loop;
+  int seconds;
+
+  timing = calloc(1, sizeof *timing);
+  if(timing == NULL)
+    return -1;
+
+  timing->compositor = compositor;
+  wl_list_init(&timing->resource_list);
+
+  section = weston_config_get_section(compositor->config, "rift", NULL, NULL);
+  weston_config_section_get_int(section, "timing-summary", &seconds, 10);
+  weston_config_section_get_bool(section, "timer-queries",
+      &timing->timer_queries, 0);
+
+  timing->global = wl_global_create(compositor->wl_display,
+      &weston_rift_timing_interface, 1, timing, bind_timing);
+  if(timing->global == NULL)
+  {
+    free(timing);
+    return -1;
+  }
+
+  if(seconds > 0)
+  {
+    timing->summary_interval = seconds * 1000;
+    loop = wl_display_get_event_loop(compositor->wl_display);
+    timing->summary_timer = wl_event_loop_add_timer(loop, summary_handler, timing);
+    wl_event_source_timer_update(timing->summary_timer,
+        timing->summary_interval);
+  }
+
+  timing->destroy_listener.notify = timing_compositor_destroy;
+  wl_signal_add(&compositor->destroy_signal, &timing->destroy_listener);
+
+  compositor->rift->timing = timing;
+  return 0;
+}
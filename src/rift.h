@@ -23,28 +23,41 @@
 #ifndef _RIFT_H_
 #define _RIFT_H_
 
+#include <stdint.h>
+#include <time.h>
+#include <wayland-server.h>
 #include <EGL/egl.h>
 #include <GLES2/gl2.h>
 #include <OVR_CAPI.h>
 
+#include "matrix.h"
+
 struct EyeArg {
   GLuint framebuffer;
   ovrVector2f scale;
   ovrVector2f offset;
   ovrDistortionMesh mesh;
-  ovrMatrix4f projection;
-  GLuint indexBuffer;
-  GLuint vertexBuffer;
-  GLuint uvsBuffer[3];
+  struct weston_matrix projection;
+  ovrFovPort fov;
+  GLsizei indexCount;
+  GLintptr indexOffset; // byte offset into the shared distortion index buffer
   GLuint texture;
   int textureWidth;
   int textureHeight;
+  int viewportWidth; // part of the texture rendered at the current density
+  int viewportHeight;
+  // The eye image is rendered as a grid of cells, one unless lens matched
+  // rendering packs the outer ones at a lower density
+  int cellCount;
+  int cellViewports[9][4]; // x, y, width, height in the texture
+  struct weston_matrix cellProjections[9];
+  GLfloat lensBreaks[4]; // inner cells start x, y and end x, y, 0..1 over the eye image
+  GLfloat lensScales[6]; // texture coordinate per eye image before, in and after them
 };
 
 struct scene_ {
+  // Interleaved position/uv quads: whole screen, then SBS left and right
   GLuint vertexBuffer;
-  GLuint SBSuvsBuffer[2];
-  GLuint uvsBuffer;
 };
 
 struct distortion_shader_ {
@@ -53,12 +66,16 @@ struct distortion_shader_ {
   GLint EyeToSourceUVOffset;
   GLint RightEye;
   GLint angle;
+  GLint EyeRotationStart;
+  GLint EyeRotationEnd;
   GLint Position;
   GLint TexCoord0;
   GLint TexCoordR;
-  GLint TexCoordG;
   GLint TexCoordB;
+  GLint TimewarpLerpFactor;
   GLint eyeTexture;
+  GLint LensBreaks;
+  GLint LensScales;
 };
 
 struct eye_shader_ {
@@ -68,25 +85,74 @@ struct eye_shader_ {
   GLint Projection;
   GLint ModelView;
   GLint virtualScreenTexture;
+  GLint TexCoordTransform; // scale xy, offset zw
+};
+
+// Which renderer the post-compositor runs on top of
+enum rift_renderer {
+  RIFT_RENDERER_NONE = 0,
+  RIFT_RENDERER_GL,
+  RIFT_RENDERER_PIXMAN
+};
+
+struct rift_pixman;
+struct rift_timing;
+
+// One weston_output, shown as its own quad in the scene
+struct rift_screen {
+  struct wl_list link;
+  struct weston_output *output;
+  GLuint texture; // created on the first GL repaint of the output
+  GLuint framebuffer;
+  int width;
+  int height;
+  int dirty; // texture contents are stale, recomposite everything
+  // When a single view covers the output, its own texture is sampled
+  // instead and nothing is composited
+  GLuint direct_texture;
+  GLfloat direct_uv[4]; // screen quad uv to view texture coordinates
+  struct weston_matrix model; // quad to world, follows the output layout
 };
 
 struct oculus_rift {
+  enum rift_renderer renderer;
   /*EGLSurface pbuffer;
   EGLSurface orig_surface;
   EGLConfig egl_config;
   EGLContext egl_context;
   EGLDisplay egl_display;
   GLuint texture;*/
-  GLuint redirectedFramebuffer;
-  GLuint fbTexture;
+  struct wl_list screen_list;
+  struct weston_output *output; // the one the headset is driven through
+  struct wl_listener output_created_listener;
+  struct wl_listener output_destroyed_listener;
+  struct wl_listener output_moved_listener;
   struct distortion_shader_ *distortion_shader;
   struct eye_shader_ *eye_shader;
   struct scene_ *scene;
   struct EyeArg eyeArgs[2];
+  // Distortion meshes of both eyes, interleaved into one vertex buffer
+  GLuint distortionVertexBuffer;
+  GLuint distortionIndexBuffer;
+  int gl_calls; // GL calls issued by render_rift this frame
+  int gl_calls_reported;
+  struct rift_pixman *pixman; // CPU eye and distortion passes
+  struct rift_timing *timing; // NULL unless the rift is enabled
   ovrVector3f hmdToEyeOffsets[2];
   ovrHmd hmd;
   int width;
   int height;
+  uint32_t refresh; // mHz, of the output the headset is driven through
+  float pixel_density;
+  float min_pixel_density;
+  float max_pixel_density;
+  int adaptive_resolution;
+  int lens_matched;
+  float lens_matched_center; // part of the tangent range kept at full density
+  float lens_matched_density; // relative density of the periphery
+  struct timespec last_frame;
+  float frame_time; // running average of the frame interval, ms
+  int headroom_frames;
   int enabled;
   int sbs;
   int rotate;
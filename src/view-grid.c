@@ -0,0 +1,175 @@
+/*
+ * Copyright © 2014 Chameleon
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include "view-grid.h"
+
+/* 128 pixel cells: with a few hundred subsurfaces and tooltips on a
+ * 1080p output, smaller cells mean more list entries to maintain and
+ * larger ones more candidates per pick */
+#define VIEW_GRID_CELL_SHIFT 7
+#define VIEW_GRID_MAX_CELLS 64
+
+static struct wl_list *
+grid_bucket(struct view_grid *grid, int32_t cx, int32_t cy)
+{
+	uint32_t hash = (uint32_t) cx * 73856093u ^ (uint32_t) cy * 19349663u;
+
+	return &grid->buckets[hash & (VIEW_GRID_BUCKETS - 1)];
+}
+
+static int
+box_contains(const pixman_box32_t *box, int32_t x, int32_t y)
+{
+	return x >= box->x1 && x < box->x2 && y >= box->y1 && y < box->y2;
+}
+
+static int
+entry_linked(struct view_grid_entry *entry)
+{
+	return entry->nrefs > 0 || !wl_list_empty(&entry->large_link);
+}
+
+static void
+entry_unlink(struct view_grid_entry *entry)
+{
+	int i;
+
+	for (i = 0; i < entry->nrefs; i++)
+		wl_list_remove(&entry->refs[i].link);
+	entry->nrefs = 0;
+
+	wl_list_remove(&entry->large_link);
+	wl_list_init(&entry->large_link);
+}
+
+void
+view_grid_init(struct view_grid *grid)
+{
+	int i;
+
+	for (i = 0; i < VIEW_GRID_BUCKETS; i++)
+		wl_list_init(&grid->buckets[i]);
+	wl_list_init(&grid->large);
+}
+
+void
+view_grid_entry_init(struct view_grid_entry *entry)
+{
+	entry->box.x1 = entry->box.y1 = 0;
+	entry->box.x2 = entry->box.y2 = 0;
+	entry->refs = NULL;
+	entry->nrefs = 0;
+	entry->size = 0;
+	wl_list_init(&entry->large_link);
+	entry->data = NULL;
+}
+
+void
+view_grid_update(struct view_grid *grid, struct view_grid_entry *entry,
+		 const pixman_box32_t *box)
+{
+	struct view_grid_ref *refs;
+	int32_t cx1, cy1, cx2, cy2, cx, cy;
+	int64_t cells;
+	int i;
+
+	if (entry_linked(entry) &&
+	    box->x1 == entry->box.x1 && box->y1 == entry->box.y1 &&
+	    box->x2 == entry->box.x2 && box->y2 == entry->box.y2)
+		return;
+
+	entry_unlink(entry);
+	entry->box = *box;
+
+	if (box->x1 >= box->x2 || box->y1 >= box->y2)
+		return;
+
+	cx1 = box->x1 >> VIEW_GRID_CELL_SHIFT;
+	cy1 = box->y1 >> VIEW_GRID_CELL_SHIFT;
+	cx2 = (box->x2 - 1) >> VIEW_GRID_CELL_SHIFT;
+	cy2 = (box->y2 - 1) >> VIEW_GRID_CELL_SHIFT;
+	cells = (int64_t) (cx2 - cx1 + 1) * (cy2 - cy1 + 1);
+
+	if (cells > entry->size && cells <= VIEW_GRID_MAX_CELLS) {
+		refs = realloc(entry->refs, cells * sizeof *refs);
+		if (refs) {
+			entry->refs = refs;
+			entry->size = cells;
+		}
+	}
+
+	if (cells > entry->size) {
+		wl_list_insert(&grid->large, &entry->large_link);
+		return;
+	}
+
+	i = 0;
+	for (cy = cy1; cy <= cy2; cy++) {
+		for (cx = cx1; cx <= cx2; cx++) {
+			entry->refs[i].entry = entry;
+			entry->refs[i].cx = cx;
+			entry->refs[i].cy = cy;
+			wl_list_insert(grid_bucket(grid, cx, cy),
+				       &entry->refs[i].link);
+			i++;
+		}
+	}
+	entry->nrefs = i;
+}
+
+void
+view_grid_remove(struct view_grid_entry *entry)
+{
+	entry_unlink(entry);
+	free(entry->refs);
+	entry->refs = NULL;
+	entry->size = 0;
+}
+
+/* Calls func for every entry whose box contains the point, in no
+ * particular order. */
+void
+view_grid_for_each_at(struct view_grid *grid, int32_t x, int32_t y,
+		      view_grid_func_t func, void *data)
+{
+	struct view_grid_ref *ref;
+	struct view_grid_entry *entry;
+	int32_t cx = x >> VIEW_GRID_CELL_SHIFT;
+	int32_t cy = y >> VIEW_GRID_CELL_SHIFT;
+
+	wl_list_for_each(ref, grid_bucket(grid, cx, cy), link) {
+		if (ref->cx != cx || ref->cy != cy)
+			continue;
+		if (box_contains(&ref->entry->box, x, y) &&
+		    func(ref->entry, data))
+			return;
+	}
+
+	wl_list_for_each(entry, &grid->large, large_link) {
+		if (box_contains(&entry->box, x, y) && func(entry, data))
+			return;
+	}
+}
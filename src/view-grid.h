@@ -0,0 +1,80 @@
+/*
+ * Copyright © 2014 Chameleon
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _WESTON_VIEW_GRID_H_
+#define _WESTON_VIEW_GRID_H_
+
+#include <stdint.h>
+#include <pixman.h>
+#include <wayland-util.h>
+
+/* A uniform grid over global coordinates, used to find the views under
+ * a point without walking the whole view list. Entries are hashed into
+ * buckets by the cells their box touches; entries covering too many
+ * cells to be worth it are kept on one list checked for every query.
+ */
+
+#define VIEW_GRID_BUCKETS 512
+
+struct view_grid {
+	struct wl_list buckets[VIEW_GRID_BUCKETS];
+	struct wl_list large;
+};
+
+struct view_grid_entry;
+
+struct view_grid_ref {
+	struct wl_list link;
+	struct view_grid_entry *entry;
+	int32_t cx, cy;
+};
+
+struct view_grid_entry {
+	pixman_box32_t box;
+	struct view_grid_ref *refs;
+	int nrefs;
+	int size;
+	struct wl_list large_link;
+	void *data;		/* for the owner of the entry */
+};
+
+/* Return non-zero to stop the iteration */
+typedef int (*view_grid_func_t)(struct view_grid_entry *entry, void *data);
+
+void
+view_grid_init(struct view_grid *grid);
+
+void
+view_grid_entry_init(struct view_grid_entry *entry);
+
+void
+view_grid_update(struct view_grid *grid, struct view_grid_entry *entry,
+		 const pixman_box32_t *box);
+
+void
+view_grid_remove(struct view_grid_entry *entry);
+
+void
+view_grid_for_each_at(struct view_grid *grid, int32_t x, int32_t y,
+		      view_grid_func_t func, void *data);
+
+#endif
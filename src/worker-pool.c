@@ -0,0 +1,183 @@
+/*
+ * Copyright © 2014 Chameleon
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "worker-pool.h"
+
+struct worker_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	pthread_t *threads;
+	int nthreads; /* including the calling thread */
+
+	/* The batch in flight, protected by mutex */
+	worker_func_t func;
+	void *data;
+	int count;
+	int next;
+	int pending;
+	unsigned int generation;
+	int destroying;
+};
+
+/* Claims and runs tasks of the current batch until none are left.
+ * Called and returns with the mutex held. */
+static void
+run_tasks(struct worker_pool *pool)
+{
+	worker_func_t func = pool->func;
+	void *data = pool->data;
+	int index;
+
+	while (pool->next < pool->count) {
+		index = pool->next++;
+
+		pthread_mutex_unlock(&pool->mutex);
+		func(data, index);
+		pthread_mutex_lock(&pool->mutex);
+
+		if (--pool->pending == 0)
+			pthread_cond_signal(&pool->done_cond);
+	}
+}
+
+static void *
+worker_thread(void *data)
+{
+	struct worker_pool *pool = data;
+	unsigned int generation = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (1) {
+		while (!pool->destroying && pool->generation == generation)
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+
+		if (pool->destroying)
+			break;
+
+		generation = pool->generation;
+		run_tasks(pool);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+struct worker_pool *
+worker_pool_create(int threads)
+{
+	struct worker_pool *pool;
+	int i;
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+
+	pool = calloc(1, sizeof *pool);
+	if (!pool)
+		return NULL;
+
+	pool->threads = calloc(threads, sizeof *pool->threads);
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	/* The calling thread is worker 0 */
+	pool->nthreads = 1;
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL,
+				   worker_thread, pool) != 0)
+			break;
+		pool->nthreads++;
+	}
+
+	return pool;
+}
+
+void
+worker_pool_destroy(struct worker_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->destroying = 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 1; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+}
+
+int
+worker_pool_get_threads(struct worker_pool *pool)
+{
+	return pool->nthreads;
+}
+
+void
+worker_pool_run(struct worker_pool *pool,
+		worker_func_t func, void *data, int count)
+{
+	int i;
+
+	if (count <= 0)
+		return;
+
+	if (pool->nthreads == 1 || count == 1) {
+		for (i = 0; i < count; i++)
+			func(data, i);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->func = func;
+	pool->data = data;
+	pool->count = count;
+	pool->next = 0;
+	pool->pending = count;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->work_cond);
+
+	run_tasks(pool);
+
+	while (pool->pending > 0)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
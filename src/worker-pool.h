@@ -0,0 +1,53 @@
+/*
+ * Copyright © 2014 Chameleon
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _WESTON_WORKER_POOL_H_
+#define _WESTON_WORKER_POOL_H_
+
+/* A fixed set of threads to spread CPU-bound rendering over. The caller
+ * hands out a batch of independent tasks and blocks until all of them
+ * are done, taking part in the work itself, so nothing ever runs
+ * behind the compositor's back.
+ */
+
+struct worker_pool;
+
+typedef void (*worker_func_t)(void *data, int index);
+
+/* threads <= 0 means one per online CPU. A pool of one thread runs
+ * everything on the calling thread. */
+struct worker_pool *
+worker_pool_create(int threads);
+
+void
+worker_pool_destroy(struct worker_pool *pool);
+
+int
+worker_pool_get_threads(struct worker_pool *pool);
+
+/* Calls func(data, i) for every i in [0, count), and returns once all
+ * calls have returned. */
+void
+worker_pool_run(struct worker_pool *pool,
+		worker_func_t func, void *data, int count);
+
+#endif
@@ -0,0 +1,545 @@
+/*
+ * Copyright © 2014 Chameleon
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Throughput benchmarks, run by "make bench" rather than "make check".
+ * Each workload drives the compositor for BENCH_SECONDS and appends one
+ * line of JSON with its results to $WESTON_BENCH_RESULTS, or prints it
+ * to stdout:
+ *
+ *   fps			frame callbacks per second of the busiest client
+ *   latency_*_us	commit to presentation, from presentation feedback
+ *   cpu_us_per_frame	CPU time of the compositor process per frame
+ *   repaint_us		time in weston_output_repaint, from the frame
+ *			profiler
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "weston-test-client-helper.h"
+#include "presentation_timing-client-protocol.h"
+
+#define ARRAY_LENGTH(a) (sizeof (a) / sizeof (a)[0])
+
+#define BENCH_SECONDS 2
+
+struct bench {
+	const char *workload;
+	struct client **clients;
+	int n_clients;
+
+	struct presentation *presentation;
+	clockid_t clock_id;
+
+	int frames;
+	struct timespec start;
+	uint64_t cpu_start;
+	pid_t compositor_pid;
+
+	uint64_t *latencies; /* ns */
+	int n_latencies;
+	int latency_size;
+};
+
+struct bench_feedback {
+	struct bench *bench;
+	struct presentation_feedback *obj;
+	struct timespec commit;
+};
+
+static inline void *
+xzalloc(size_t size)
+{
+	void *p;
+
+	p = calloc(1, size);
+	assert(p);
+
+	return p;
+}
+
+static uint64_t
+timespec_ns(const struct timespec *ts)
+{
+	return (uint64_t) ts->tv_sec * 1000000000ull + ts->tv_nsec;
+}
+
+/* utime + stime of the compositor, in clock ticks */
+static uint64_t
+compositor_cpu_ticks(pid_t pid)
+{
+	char path[64], buf[1024], *p;
+	unsigned long long utime, stime;
+	FILE *f;
+	size_t len;
+
+	snprintf(path, sizeof path, "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	len = fread(buf, 1, sizeof buf - 1, f);
+	fclose(f);
+	buf[len] = '\0';
+
+	/* The command name may contain spaces, skip past it */
+	p = strrchr(buf, ')');
+	if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+			 "%llu %llu", &utime, &stime) != 2)
+		return 0;
+
+	return utime + stime;
+}
+
+static void
+presentation_clock_id(void *data, struct presentation *presentation,
+		      uint32_t clk_id)
+{
+	struct bench *bench = data;
+
+	bench->clock_id = clk_id;
+}
+
+static const struct presentation_listener presentation_listener = {
+	presentation_clock_id
+};
+
+static void
+feedback_sync_output(void *data, struct presentation_feedback *feedback,
+		     struct wl_output *output)
+{
+}
+
+static void
+feedback_done(struct bench_feedback *fb)
+{
+	presentation_feedback_destroy(fb->obj);
+	free(fb);
+}
+
+static void
+feedback_presented(void *data, struct presentation_feedback *feedback,
+		   uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec,
+		   uint32_t refresh_nsec, uint32_t seq_hi, uint32_t seq_lo,
+		   uint32_t flags)
+{
+	struct bench_feedback *fb = data;
+	struct bench *bench = fb->bench;
+	uint64_t presented, *latencies;
+	int size;
+
+	presented = (((uint64_t) tv_sec_hi << 32) + tv_sec_lo) *
+		1000000000ull + tv_nsec;
+
+	if (bench->n_latencies == bench->latency_size) {
+		size = bench->latency_size ? bench->latency_size * 2 : 1024;
+		latencies = realloc(bench->latencies,
+				    size * sizeof *latencies);
+		assert(latencies);
+		bench->latencies = latencies;
+		bench->latency_size = size;
+	}
+
+	if (presented > timespec_ns(&fb->commit))
+		bench->latencies[bench->n_latencies++] =
+			presented - timespec_ns(&fb->commit);
+
+	feedback_done(fb);
+}
+
+static void
+feedback_discarded(void *data, struct presentation_feedback *feedback)
+{
+	feedback_done(data);
+}
+
+static const struct presentation_feedback_listener feedback_listener = {
+	feedback_sync_output,
+	feedback_presented,
+	feedback_discarded
+};
+
+static struct presentation *
+bind_presentation(struct client *client, struct bench *bench)
+{
+	struct presentation *presentation = NULL;
+	struct global *g;
+
+	wl_list_for_each(g, &client->global_list, link) {
+		if (strcmp(g->interface, "presentation"))
+			continue;
+
+		presentation = wl_registry_bind(client->wl_registry, g->name,
+						&presentation_interface, 1);
+	}
+	assert(presentation && "no presentation found");
+
+	presentation_add_listener(presentation, &presentation_listener, bench);
+	client_roundtrip(client);
+
+	return presentation;
+}
+
+static struct wl_subcompositor *
+bind_subcompositor(struct client *client)
+{
+	struct wl_subcompositor *sub = NULL;
+	struct global *g;
+
+	wl_list_for_each(g, &client->global_list, link) {
+		if (strcmp(g->interface, "wl_subcompositor"))
+			continue;
+
+		sub = wl_registry_bind(client->wl_registry, g->name,
+				       &wl_subcompositor_interface, 1);
+	}
+	assert(sub && "no wl_subcompositor found");
+
+	return sub;
+}
+
+static void
+bench_init(struct bench *bench, const char *workload, int n_clients)
+{
+	struct client *first;
+	struct ucred cred;
+	socklen_t len = sizeof cred;
+	int i;
+
+	memset(bench, 0, sizeof *bench);
+	bench->workload = workload;
+	bench->n_clients = n_clients;
+	bench->clients = xzalloc(n_clients * sizeof *bench->clients);
+
+	for (i = 0; i < n_clients; i++)
+		bench->clients[i] = client_create(40 * i, 30 * i, 200, 200);
+	first = bench->clients[0];
+
+	bench->presentation = bind_presentation(first, bench);
+
+	assert(getsockopt(wl_display_get_fd(first->wl_display), SOL_SOCKET,
+			  SO_PEERCRED, &cred, &len) == 0);
+	bench->compositor_pid = cred.pid;
+}
+
+static void
+bench_start(struct bench *bench)
+{
+	struct client *first = bench->clients[0];
+
+	/* Only count repaints from here on */
+	get_frame_profile(first);
+	first->test->frame_profile_since =
+		first->test->frame_profile_sequence + 1;
+
+	bench->frames = 0;
+	bench->n_latencies = 0;
+	bench->cpu_start = compositor_cpu_ticks(bench->compositor_pid);
+	clock_gettime(CLOCK_MONOTONIC, &bench->start);
+}
+
+static int
+bench_running(struct bench *bench)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec - bench->start.tv_sec < BENCH_SECONDS ||
+		(now.tv_sec - bench->start.tv_sec == BENCH_SECONDS &&
+		 now.tv_nsec < bench->start.tv_nsec);
+}
+
+/* Commits a surface of the first client with presentation feedback and
+ * a frame callback; the caller has attached and damaged it already. */
+static void
+bench_commit(struct bench *bench, struct wl_surface *surface, int *done)
+{
+	struct bench_feedback *fb;
+
+	fb = xzalloc(sizeof *fb);
+	fb->bench = bench;
+	fb->obj = presentation_feedback(bench->presentation, surface);
+	presentation_feedback_add_listener(fb->obj, &feedback_listener, fb);
+
+	frame_callback_set(surface, done);
+	clock_gettime(bench->clock_id, &fb->commit);
+	wl_surface_commit(surface);
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+bench_finish(struct bench *bench)
+{
+	struct client *first = bench->clients[0];
+	struct timespec end;
+	uint64_t cpu, latency_sum = 0;
+	double seconds, p50 = 0, p99 = 0, max = 0, mean = 0;
+	double repaint_us = 0;
+	char cpu_us[32];
+	const char *path;
+	FILE *out;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	cpu = compositor_cpu_ticks(bench->compositor_pid) - bench->cpu_start;
+
+	/* Collect outstanding feedback */
+	client_roundtrip(first);
+
+	seconds = (timespec_ns(&end) - timespec_ns(&bench->start)) / 1e9;
+	/* No frames, for a compositor that stalled, has no per frame cost
+	 * and nan is not valid JSON */
+	if (bench->frames > 0)
+		snprintf(cpu_us, sizeof cpu_us, "%.1f",
+			 cpu * 1e6 / sysconf(_SC_CLK_TCK) / bench->frames);
+	else
+		snprintf(cpu_us, sizeof cpu_us, "null");
+
+	if (bench->n_latencies > 0) {
+		qsort(bench->latencies, bench->n_latencies,
+		      sizeof *bench->latencies, compare_u64);
+		for (i = 0; i < bench->n_latencies; i++)
+			latency_sum += bench->latencies[i];
+		mean = latency_sum / 1e3 / bench->n_latencies;
+		p50 = bench->latencies[bench->n_latencies / 2] / 1e3;
+		p99 = bench->latencies[bench->n_latencies * 99 / 100] / 1e3;
+		max = bench->latencies[bench->n_latencies - 1] / 1e3;
+	}
+
+	if (get_frame_profile(first) > 0)
+		repaint_us = first->test->frame_profile_ns / 1e3 /
+			first->test->n_frame_profiles;
+
+	path = getenv("WESTON_BENCH_RESULTS");
+	out = path ? fopen(path, "a") : stdout;
+	assert(out);
+
+	fprintf(out, "{\"workload\": \"%s\", \"clients\": %d, "
+		"\"frames\": %d, \"seconds\": %.3f, \"fps\": %.1f, "
+		"\"latency_mean_us\": %.1f, \"latency_p50_us\": %.1f, "
+		"\"latency_p99_us\": %.1f, \"latency_max_us\": %.1f, "
+		"\"cpu_us_per_frame\": %s, \"repaint_us\": %.1f}\n",
+		bench->workload, bench->n_clients, bench->frames, seconds,
+		bench->frames / seconds, mean, p50, p99, max,
+		cpu_us, repaint_us);
+
+	if (out != stdout)
+		fclose(out);
+
+	free(bench->latencies);
+	free(bench->clients);
+}
+
+static void
+fill_rect(struct surface *surface, int x, int y, int w, int h, uint32_t c)
+{
+	uint32_t *p = surface->data;
+	int i, j;
+
+	for (j = y; j < y + h; j++)
+		for (i = x; i < x + w; i++)
+			p[j * surface->width + i] = c;
+}
+
+TEST(bench_shm_clients)
+{
+	struct bench bench;
+	struct surface *surface;
+	unsigned int seed = 1;
+	int done[8], i, x, y, w, h;
+
+	bench_init(&bench, "shm_clients", ARRAY_LENGTH(done));
+	bench_start(&bench);
+
+	while (bench_running(&bench)) {
+		for (i = 0; i < bench.n_clients; i++) {
+			surface = bench.clients[i]->surface;
+			w = 1 + rand_r(&seed) % surface->width;
+			h = 1 + rand_r(&seed) % surface->height;
+			x = rand_r(&seed) % (surface->width - w + 1);
+			y = rand_r(&seed) % (surface->height - h + 1);
+			fill_rect(surface, x, y, w, h, 0xff000000 | rand_r(&seed));
+
+			wl_surface_attach(surface->wl_surface,
+					  surface->wl_buffer, 0, 0);
+			wl_surface_damage(surface->wl_surface, x, y, w, h);
+			if (i == 0) {
+				bench_commit(&bench, surface->wl_surface,
+					     &done[i]);
+			} else {
+				frame_callback_set(surface->wl_surface,
+						   &done[i]);
+				wl_surface_commit(surface->wl_surface);
+			}
+		}
+
+		for (i = 0; i < bench.n_clients; i++)
+			frame_callback_wait(bench.clients[i], &done[i]);
+		bench.frames++;
+	}
+
+	bench_finish(&bench);
+}
+
+#define TREE_DEPTH 32
+
+TEST(bench_subsurface_tree)
+{
+	struct bench bench;
+	struct client *client;
+	struct wl_subcompositor *subco;
+	struct wl_surface *surfaces[TREE_DEPTH + 1];
+	struct wl_subsurface *subs[TREE_DEPTH];
+	struct wl_buffer *buffer;
+	void *data;
+	int done, i;
+
+	bench_init(&bench, "subsurface_tree", 1);
+	client = bench.clients[0];
+	subco = bind_subcompositor(client);
+
+	/* A chain of subsurfaces, each one nested in the previous */
+	buffer = create_shm_buffer(client, 100, 100, &data);
+	memset(data, 0x80, 100 * 100 * 4);
+
+	surfaces[0] = client->surface->wl_surface;
+	for (i = 0; i < TREE_DEPTH; i++) {
+		surfaces[i + 1] =
+			wl_compositor_create_surface(client->wl_compositor);
+		subs[i] = wl_subcompositor_get_subsurface(subco,
+							  surfaces[i + 1],
+							  surfaces[i]);
+		wl_subsurface_set_position(subs[i], 4, 4);
+		wl_subsurface_set_desync(subs[i]);
+		wl_surface_attach(surfaces[i + 1], buffer, 0, 0);
+		wl_surface_damage(surfaces[i + 1], 0, 0, 100, 100);
+		wl_surface_commit(surfaces[i + 1]);
+	}
+
+	wl_surface_attach(surfaces[0], client->surface->wl_buffer, 0, 0);
+	wl_surface_damage(surfaces[0], 0, 0, 200, 200);
+	frame_callback_set(surfaces[0], &done);
+	wl_surface_commit(surfaces[0]);
+	frame_callback_wait(client, &done);
+
+	bench_start(&bench);
+
+	while (bench_running(&bench)) {
+		/* Damage every level, the root last */
+		for (i = TREE_DEPTH; i > 0; i--) {
+			wl_surface_attach(surfaces[i], buffer, 0, 0);
+			wl_surface_damage(surfaces[i], 0, 0, 100, 100);
+			wl_surface_commit(surfaces[i]);
+		}
+
+		wl_surface_attach(surfaces[0], client->surface->wl_buffer,
+				  0, 0);
+		wl_surface_damage(surfaces[0], 0, 0, 200, 200);
+		bench_commit(&bench, surfaces[0], &done);
+		frame_callback_wait(client, &done);
+		bench.frames++;
+	}
+
+	bench_finish(&bench);
+}
+
+#define RESIZE_STEPS 16
+
+TEST(bench_resize_storm)
+{
+	struct bench bench;
+	struct client *client;
+	struct wl_surface *surface;
+	struct wl_buffer *buffers[RESIZE_STEPS];
+	void *data;
+	int done, i, size;
+
+	bench_init(&bench, "resize_storm", 1);
+	client = bench.clients[0];
+	surface = client->surface->wl_surface;
+
+	for (i = 0; i < RESIZE_STEPS; i++) {
+		size = 64 + 24 * i;
+		buffers[i] = create_shm_buffer(client, size, size, &data);
+		memset(data, i * 16, size * size * 4);
+	}
+
+	bench_start(&bench);
+
+	for (i = 0; bench_running(&bench); i++) {
+		size = 64 + 24 * (i % RESIZE_STEPS);
+		wl_surface_attach(surface, buffers[i % RESIZE_STEPS], 0, 0);
+		wl_surface_damage(surface, 0, 0, size, size);
+		bench_commit(&bench, surface, &done);
+		frame_callback_wait(client, &done);
+		bench.frames++;
+	}
+
+	bench_finish(&bench);
+}
+
+#define MOTIONS_PER_FRAME 64
+
+TEST(bench_pointer_flood)
+{
+	struct bench bench;
+	struct client *client;
+	struct surface *surface;
+	int done, i, n = 0;
+
+	bench_init(&bench, "pointer_flood", 1);
+	client = bench.clients[0];
+	surface = client->surface;
+
+	bench_start(&bench);
+
+	while (bench_running(&bench)) {
+		/* Zigzag across the surface, entering and leaving it */
+		for (i = 0; i < MOTIONS_PER_FRAME; i++, n++)
+			wl_test_move_pointer(client->test->wl_test,
+					     surface->x - 10 + n % 220,
+					     surface->y + (n * 7) % 200);
+
+		wl_surface_attach(surface->wl_surface, surface->wl_buffer,
+				  0, 0);
+		wl_surface_damage(surface->wl_surface, 0, 0, 1, 1);
+		bench_commit(&bench, surface->wl_surface, &done);
+		frame_callback_wait(client, &done);
+		bench.frames++;
+	}
+
+	bench_finish(&bench);
+}
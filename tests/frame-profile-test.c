@@ -0,0 +1,65 @@
+/*
+ * Copyright © 2014 Chameleon
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+
+#include "weston-test-client-helper.h"
+
+TEST(frame_profile_records_repaints)
+{
+	struct client *client;
+	struct wl_surface *surface;
+	uint32_t first;
+	int frame, n, i;
+
+	client = client_create(100, 100, 100, 100);
+	assert(client);
+	surface = client->surface->wl_surface;
+
+	for (i = 0; i < 3; i++) {
+		wl_surface_attach(surface, client->surface->wl_buffer, 0, 0);
+		wl_surface_damage(surface, 0, 0, 100, 100);
+		frame_callback_set(surface, &frame);
+		wl_surface_commit(surface);
+		frame_callback_wait(client, &frame);
+	}
+
+	n = get_frame_profile(client);
+	assert(n >= 3);
+	assert(client->test->frame_profile_stages == 8);
+	first = client->test->frame_profile_sequence;
+
+	/* Records keep coming, newest last */
+	wl_surface_damage(surface, 0, 0, 100, 100);
+	frame_callback_set(surface, &frame);
+	wl_surface_commit(surface);
+	frame_callback_wait(client, &frame);
+
+	n = get_frame_profile(client);
+	assert(n >= 4);
+	assert(client->test->frame_profile_sequence > first);
+
+	/* The surface damage made it into the records */
+	assert(client->test->frame_profile_damage >= 100 * 100);
+}
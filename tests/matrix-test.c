@@ -212,6 +212,42 @@ test_inverse(struct weston_matrix *m)
 	return errsup;
 }
 
+/* Compare weston_matrix_multiply() against the textbook product,
+ * computed in double precision. Returns the largest relative error.
+ */
+static double
+test_multiply(void)
+{
+	struct weston_matrix m, n, product;
+	double errsup = 0.0;
+	unsigned r, c, k;
+
+	for (k = 0; k < 16; ++k) {
+		m.d[k] = frand();
+		n.d[k] = frand();
+	}
+	m.type = n.type = WESTON_MATRIX_TRANSFORM_OTHER;
+
+	product = m;
+	weston_matrix_multiply(&product, &n);
+
+	/* weston_matrix_multiply(m, n) leaves n * m in m */
+	for (r = 0; r < 4; ++r) {
+		for (c = 0; c < 4; ++c) {
+			double expected = 0.0, err;
+
+			for (k = 0; k < 4; ++k)
+				expected += (double)n.d[r + k * 4] * m.d[k + c * 4];
+			err = fabs(product.d[r + c * 4] - expected) /
+			      (fabs(expected) + 1.0);
+			if (err > errsup)
+				errsup = err;
+		}
+	}
+
+	return errsup;
+}
+
 enum {
 	TEST_OK,
 	TEST_NOT_INVERTIBLE_OK,
@@ -292,6 +328,32 @@ test_loop_speed_matrixvector(void)
 	       count, t, 1e9 * t / count);
 }
 
+static void __attribute__((noinline))
+test_loop_speed_multiply(void)
+{
+	struct weston_matrix m, n;
+	unsigned long count = 0;
+	double t;
+
+	printf("\nRunning 3 s test on weston_matrix_multiply()...\n");
+
+	weston_matrix_init(&m);
+	weston_matrix_init(&n);
+	weston_matrix_rotate_xy(&n, 0.6, 0.8);
+
+	running = 1;
+	alarm(3);
+	reset_timer();
+	while (running) {
+		weston_matrix_multiply(&m, &n);
+		count++;
+	}
+	t = read_timer();
+
+	printf("%lu iterations in %f seconds, avg. %.1f ns/iter.\n",
+	       count, t, 1e9 * t / count);
+}
+
 static void __attribute__((noinline))
 test_loop_speed_inversetransform(void)
 {
@@ -411,8 +473,16 @@ int main(void)
 	print_matrix(&M);
 	printf("max abs error: %g, original determinant %g\n", errsup, det);
 
+	errsup = 0.0;
+	for (ret = 0; ret < 1000; ++ret)
+		errsup = fmax(errsup, test_multiply());
+	printf("\nweston_matrix_multiply() max relative error: %g\n", errsup);
+	if (errsup > 1e-6)
+		return 1;
+
 	test_loop_precision();
 	test_loop_speed_matrixvector();
+	test_loop_speed_multiply();
 	test_loop_speed_inversetransform();
 	test_loop_speed_invert();
 	test_loop_speed_invert_explicit();
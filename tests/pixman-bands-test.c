@@ -0,0 +1,124 @@
+/*
+ * Copyright © 2014 Chameleon
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "../src/compositor.h"
+
+/* pixman-bands-test.ini asks for a pixman worker pool, and the output
+ * is too short to be cut into bands, so it has to be composited
+ * serially with the pool around. */
+
+struct bands_test {
+	struct weston_compositor *compositor;
+	struct weston_output *output;
+	struct weston_layer layer;
+	struct weston_surface *surface;
+	struct wl_listener frame_listener;
+};
+
+static void
+bands_test_done(void *data)
+{
+	struct bands_test *test = data;
+	struct weston_compositor *compositor = test->compositor;
+
+	weston_surface_destroy(test->surface);
+	wl_list_remove(&test->layer.link);
+	free(test);
+
+	wl_display_terminate(compositor->wl_display);
+}
+
+static void
+output_frame(struct wl_listener *listener, void *data)
+{
+	struct bands_test *test =
+		container_of(listener, struct bands_test, frame_listener);
+	struct weston_compositor *compositor = test->compositor;
+	uint32_t pixel = 0;
+	int ret;
+
+	ret = compositor->renderer->read_pixels(test->output,
+						PIXMAN_a8r8g8b8, &pixel,
+						test->output->width / 2, 0,
+						1, 1);
+	assert(ret == 0);
+
+	fprintf(stderr, "output pixel is 0x%08x\n", pixel);
+	assert((pixel & 0xffffff) == 0xff0000);
+
+	/* Still in the middle of the repaint, so tear down from idle */
+	wl_list_remove(&test->frame_listener.link);
+	wl_event_loop_add_idle(wl_display_get_event_loop(compositor->wl_display),
+			       bands_test_done, test);
+}
+
+static void
+bands_test(void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct bands_test *test;
+	struct weston_view *view;
+
+	test = calloc(1, sizeof *test);
+	assert(test);
+	test->compositor = compositor;
+	test->output = container_of(compositor->output_list.next,
+				    struct weston_output, link);
+
+	/* On top of everything, the shell's startup fade included */
+	weston_layer_init(&test->layer, &compositor->layer_list);
+
+	test->surface = weston_surface_create(compositor);
+	assert(test->surface);
+	view = weston_view_create(test->surface);
+	assert(view);
+
+	weston_surface_set_color(test->surface, 1.0, 0.0, 0.0, 1.0);
+	weston_surface_set_size(test->surface,
+				test->output->width, test->output->height);
+	weston_view_set_position(view, test->output->x, test->output->y);
+	weston_layer_entry_insert(&test->layer.view_list, &view->layer_link);
+	weston_view_update_transform(view);
+	weston_surface_damage(test->surface);
+
+	test->frame_listener.notify = output_frame;
+	wl_signal_add(&test->output->frame_signal, &test->frame_listener);
+	weston_compositor_schedule_repaint(compositor);
+}
+
+WL_EXPORT int
+module_init(struct weston_compositor *compositor, int *argc, char *argv[])
+{
+	struct wl_event_loop *loop;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+
+	wl_event_loop_add_idle(loop, bands_test, compositor);
+
+	return 0;
+}
@@ -0,0 +1,260 @@
+/*
+ * Copyright © 2014 Chameleon
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Times damage accumulation for synthetic scenes of N views spread over
+ * P planes, run by "make bench". The module takes over the output's
+ * assign_planes hook to deal the views out to the planes and measures
+ * from there until the backend repaint is called, which is the damage
+ * pass plus a walk over the view list collecting frame callbacks. Every
+ * scene appends one line of JSON to $WESTON_BENCH_RESULTS, or prints it
+ * to stdout.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+
+#include "../src/compositor.h"
+
+#define MAX_VIEWS 1024
+#define MAX_PLANES 16
+#define FRAMES 30
+
+static const struct {
+	int views;
+	int planes;
+} scenes[] = {
+	{   64,  1 },
+	{   64,  4 },
+	{   64, 16 },
+	{ 1024,  1 },
+	{ 1024,  4 },
+	{ 1024, 16 },
+};
+
+struct bench {
+	struct weston_compositor *compositor;
+	struct weston_output *output;
+	void (*assign_planes)(struct weston_output *output);
+	int (*repaint)(struct weston_output *output,
+		       pixman_region32_t *damage);
+
+	struct weston_layer layer;
+	struct weston_surface *surfaces[MAX_VIEWS];
+	struct weston_plane planes[MAX_PLANES];
+
+	int scene;
+	int frame;
+	struct timespec start;
+	uint64_t total_ns;
+};
+
+/* The output hooks only get the output */
+static struct bench *the_bench;
+
+static uint64_t
+timespec_ns(const struct timespec *ts)
+{
+	return (uint64_t) ts->tv_sec * 1000000000ull + ts->tv_nsec;
+}
+
+static struct weston_plane *
+scene_plane(struct bench *bench, int i)
+{
+	if (i == 0)
+		return &bench->compositor->primary_plane;
+
+	return &bench->planes[i - 1];
+}
+
+static void
+bench_assign_planes(struct weston_output *output)
+{
+	struct bench *bench = the_bench;
+	struct weston_view *view;
+	int planes = scenes[bench->scene].planes;
+	int i = 0;
+
+	/* Deal the views out round robin, so every plane has views all
+	 * through the stacking order like sprites and the cursor would.
+	 */
+	wl_list_for_each(view, &output->compositor->view_list, link)
+		weston_view_move_to_plane(view, scene_plane(bench, i++ % planes));
+
+	clock_gettime(CLOCK_MONOTONIC, &bench->start);
+}
+
+static void
+scene_create(struct bench *bench)
+{
+	struct weston_compositor *ec = bench->compositor;
+	struct weston_surface *surface;
+	struct weston_view *view;
+	int i;
+
+	for (i = 0; i < scenes[bench->scene].planes - 1; i++) {
+		weston_plane_init(&bench->planes[i], ec, 0, 0);
+		weston_compositor_stack_plane(ec, &bench->planes[i],
+					      &ec->primary_plane);
+	}
+
+	for (i = 0; i < scenes[bench->scene].views; i++) {
+		surface = weston_surface_create(ec);
+		assert(surface);
+		view = weston_view_create(surface);
+		assert(view);
+
+		surface->width = 64 + (i * 37) % 256;
+		surface->height = 64 + (i * 59) % 256;
+		weston_view_set_position(view,
+					 (i * 97) % bench->output->width,
+					 (i * 53) % bench->output->height);
+		weston_layer_entry_insert(&bench->layer.view_list,
+					  &view->layer_link);
+		weston_view_update_transform(view);
+
+		bench->surfaces[i] = surface;
+	}
+}
+
+static void
+scene_destroy(struct bench *bench)
+{
+	int i;
+
+	for (i = 0; i < scenes[bench->scene].views; i++)
+		weston_surface_destroy(bench->surfaces[i]);
+
+	for (i = 0; i < scenes[bench->scene].planes - 1; i++)
+		weston_plane_release(&bench->planes[i]);
+}
+
+static void
+scene_report(struct bench *bench)
+{
+	const char *path;
+	FILE *out;
+
+	path = getenv("WESTON_BENCH_RESULTS");
+	out = path ? fopen(path, "a") : stdout;
+	if (!out)
+		return;
+
+	fprintf(out, "{\"workload\": \"plane-damage\", \"views\": %d, "
+		"\"planes\": %d, \"frames\": %d, \"damage_us\": %.2f}\n",
+		scenes[bench->scene].views, scenes[bench->scene].planes,
+		FRAMES - 1, bench->total_ns / 1000.0 / (FRAMES - 1));
+
+	if (out != stdout)
+		fclose(out);
+}
+
+static void
+scene_damage(void *data)
+{
+	struct bench *bench = data;
+	int i;
+
+	if (bench->frame == FRAMES) {
+		scene_report(bench);
+		scene_destroy(bench);
+		bench->scene++;
+		bench->frame = 0;
+		bench->total_ns = 0;
+
+		if (bench->scene == (int) ARRAY_LENGTH(scenes)) {
+			bench->output->assign_planes = bench->assign_planes;
+			bench->output->repaint = bench->repaint;
+			wl_display_terminate(bench->compositor->wl_display);
+			return;
+		}
+
+		scene_create(bench);
+	}
+
+	for (i = 0; i < scenes[bench->scene].views; i++)
+		weston_surface_damage(bench->surfaces[i]);
+}
+
+static int
+bench_repaint(struct weston_output *output, pixman_region32_t *damage)
+{
+	struct bench *bench = the_bench;
+	struct wl_event_loop *loop;
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	/* The first frame of a scene also pays for its setup */
+	if (bench->frame > 0)
+		bench->total_ns += timespec_ns(&end) - timespec_ns(&bench->start);
+	bench->frame++;
+
+	/* Damage for the next frame has to come after this repaint is
+	 * done, or the repaint scheduled by it would be dropped.
+	 */
+	loop = wl_display_get_event_loop(output->compositor->wl_display);
+	wl_event_loop_add_idle(loop, scene_damage, bench);
+
+	return bench->repaint(output, damage);
+}
+
+static void
+bench_start(void *data)
+{
+	struct bench *bench = data;
+	struct weston_compositor *ec = bench->compositor;
+
+	assert(!wl_list_empty(&ec->output_list));
+	bench->output = container_of(ec->output_list.next,
+				     struct weston_output, link);
+
+	bench->assign_planes = bench->output->assign_planes;
+	bench->repaint = bench->output->repaint;
+	bench->output->assign_planes = bench_assign_planes;
+	bench->output->repaint = bench_repaint;
+
+	weston_layer_init(&bench->layer, &ec->cursor_layer.link);
+
+	scene_create(bench);
+	scene_damage(bench);
+}
+
+WL_EXPORT int
+module_init(struct weston_compositor *compositor, int *argc, char *argv[])
+{
+	struct wl_event_loop *loop;
+	struct bench *bench;
+
+	bench = zalloc(sizeof *bench);
+	if (!bench)
+		return -1;
+
+	bench->compositor = compositor;
+	the_bench = bench;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	wl_event_loop_add_idle(loop, bench_start, bench);
+
+	return 0;
+}
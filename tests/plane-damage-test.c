@@ -0,0 +1,255 @@
+/*
+ * Copyright © 2014 Chameleon
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/* Checks the damage and clip that compositor_accumulate_damage() leaves
+ * on each plane and view for a small scene on two planes, with the
+ * views of both planes interleaved in the stacking order:
+ *
+ *   T  plane, opaque	  0,0   100x100
+ *   M  primary, opaque	 50,50  100x100
+ *   U  plane, opaque	  0,50  100x100
+ *   B  primary		  0,0   200x200
+ *   G  primary, opaque	the whole output, never damaged
+ *
+ * G hides everything below the test's layer, so no other view adds
+ * damage. The first frame only settles the scene; the second damages
+ * parts of the surfaces and is checked.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "../src/compositor.h"
+
+enum { VIEW_T, VIEW_M, VIEW_U, VIEW_B, VIEW_G, VIEW_COUNT };
+
+static const struct {
+	int32_t x, y, width, height;
+	int opaque;
+	int plane;
+} views[] = {
+	{  0,  0, 100, 100, 1, 1 },
+	{ 50, 50, 100, 100, 1, 0 },
+	{  0, 50, 100, 100, 1, 1 },
+	{  0,  0, 200, 200, 0, 0 },
+	{  0,  0,   0,   0, 1, 0 },	/* sized to the output */
+};
+
+struct damage_test {
+	struct weston_compositor *compositor;
+	struct weston_output *output;
+	void (*assign_planes)(struct weston_output *output);
+	int (*repaint)(struct weston_output *output,
+		       pixman_region32_t *damage);
+
+	struct weston_layer layer;
+	struct weston_plane plane;
+	struct weston_surface *surfaces[VIEW_COUNT];
+	struct weston_view *views[VIEW_COUNT];
+	int frame;
+};
+
+/* The output hooks only get the output */
+static struct damage_test *test;
+
+static void
+assert_region(pixman_region32_t *region, const pixman_box32_t *boxes,
+	      int count)
+{
+	pixman_region32_t expected;
+
+	pixman_region32_init_rects(&expected, boxes, count);
+	assert(pixman_region32_equal(region, &expected));
+	pixman_region32_fini(&expected);
+}
+
+static void
+check_frame(void)
+{
+	struct weston_compositor *ec = test->compositor;
+	static const pixman_box32_t plane_damage[] = {
+		/* T, and U below T */
+		{ 0, 0, 100, 150 },
+	};
+	static const pixman_box32_t primary_damage[] = {
+		/* M, and the top right of B beside M */
+		{ 100, 0, 200, 50 },
+		{ 50, 50, 200, 100 },
+		{ 50, 100, 150, 150 },
+	};
+	static const pixman_box32_t primary_clip[] = {
+		/* T and U */
+		{ 0, 0, 100, 150 },
+	};
+	static const pixman_box32_t t_box[] = { { 0, 0, 100, 100 } };
+	static const pixman_box32_t m_box[] = { { 50, 50, 150, 150 } };
+
+	assert(!pixman_region32_not_empty(&test->plane.clip));
+	assert_region(&test->plane.damage, plane_damage, 1);
+
+	assert_region(&ec->primary_plane.clip, primary_clip, 1);
+	assert_region(&ec->primary_plane.damage, primary_damage, 3);
+
+	/* Each view is clipped by the opaque views above it on its own
+	 * plane only */
+	assert(!pixman_region32_not_empty(&test->views[VIEW_T]->clip));
+	assert(!pixman_region32_not_empty(&test->views[VIEW_M]->clip));
+	assert_region(&test->views[VIEW_U]->clip, t_box, 1);
+	assert_region(&test->views[VIEW_B]->clip, m_box, 1);
+}
+
+static void
+damage_surfaces(void *data)
+{
+	int i;
+
+	if (test->frame == 2) {
+		test->output->assign_planes = test->assign_planes;
+		test->output->repaint = test->repaint;
+		for (i = 0; i < VIEW_COUNT; i++)
+			weston_surface_destroy(test->surfaces[i]);
+		weston_plane_release(&test->plane);
+		wl_list_remove(&test->layer.link);
+		wl_display_terminate(test->compositor->wl_display);
+		free(test);
+		test = NULL;
+		return;
+	}
+
+	/* All of T, M and U, and the top right quarter of B */
+	for (i = VIEW_T; i <= VIEW_U; i++)
+		pixman_region32_union_rect(&test->surfaces[i]->damage,
+					   &test->surfaces[i]->damage,
+					   0, 0, views[i].width,
+					   views[i].height);
+	pixman_region32_union_rect(&test->surfaces[VIEW_B]->damage,
+				   &test->surfaces[VIEW_B]->damage,
+				   100, 0, 100, 100);
+
+	weston_compositor_schedule_repaint(test->compositor);
+}
+
+static void
+test_assign_planes(struct weston_output *output)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct weston_view *view;
+	int i;
+
+	wl_list_for_each(view, &ec->view_list, link)
+		weston_view_move_to_plane(view, &ec->primary_plane);
+
+	for (i = 0; i < VIEW_COUNT; i++)
+		if (views[i].plane)
+			weston_view_move_to_plane(test->views[i],
+						  &test->plane);
+}
+
+static int
+test_repaint(struct weston_output *output, pixman_region32_t *damage)
+{
+	struct weston_compositor *ec = output->compositor;
+	int ret;
+
+	if (test->frame == 1)
+		check_frame();
+
+	ret = test->repaint(output, damage);
+
+	/* Start the next frame from no damage at all */
+	pixman_region32_clear(&test->plane.damage);
+	pixman_region32_clear(&ec->primary_plane.damage);
+
+	test->frame++;
+	wl_event_loop_add_idle(wl_display_get_event_loop(ec->wl_display),
+			       damage_surfaces, NULL);
+
+	return ret;
+}
+
+static void
+damage_test(void *data)
+{
+	struct weston_compositor *ec = data;
+	struct weston_surface *surface;
+	struct weston_view *view;
+	int32_t width, height;
+	int i;
+
+	test = calloc(1, sizeof *test);
+	assert(test);
+	test->compositor = ec;
+	test->output = container_of(ec->output_list.next,
+				    struct weston_output, link);
+
+	weston_layer_init(&test->layer, &ec->layer_list);
+	weston_plane_init(&test->plane, ec, 0, 0);
+	weston_compositor_stack_plane(ec, &test->plane, &ec->primary_plane);
+
+	for (i = 0; i < VIEW_COUNT; i++) {
+		surface = weston_surface_create(ec);
+		assert(surface);
+		view = weston_view_create(surface);
+		assert(view);
+
+		width = views[i].width ? views[i].width : test->output->width;
+		height = views[i].height ? views[i].height :
+			test->output->height;
+		weston_surface_set_size(surface, width, height);
+		if (views[i].opaque)
+			pixman_region32_union_rect(&surface->opaque,
+						   &surface->opaque, 0, 0,
+						   width, height);
+		weston_view_set_position(view, test->output->x + views[i].x,
+					 test->output->y + views[i].y);
+
+		test->surfaces[i] = surface;
+		test->views[i] = view;
+	}
+
+	/* Each goes on top, so T ends up topmost */
+	for (i = VIEW_COUNT - 1; i >= 0; i--)
+		weston_layer_entry_insert(&test->layer.view_list,
+					  &test->views[i]->layer_link);
+
+	test->assign_planes = test->output->assign_planes;
+	test->repaint = test->output->repaint;
+	test->output->assign_planes = test_assign_planes;
+	test->output->repaint = test_repaint;
+	weston_compositor_schedule_repaint(ec);
+}
+
+WL_EXPORT int
+module_init(struct weston_compositor *compositor, int *argc, char *argv[])
+{
+	struct wl_event_loop *loop;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+
+	wl_event_loop_add_idle(loop, damage_test, compositor);
+
+	return 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * Copyright © 2014 Chameleon
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/* Checks which views compositor_cull_views() skips, on a layer on top
+ * of everything:
+ *
+ *   O  opaque		  0,0   200x200
+ *   N  not opaque	300,0   200x200
+ *   A  opaque, alpha 0.5	600,0   200x200
+ *   X			 50,50  100x100, all under O: culled
+ *   P			150,150 100x100, partly under O
+ *   Y			350,50   50x50,  under N
+ *   Z			650,50   50x50,  under A
+ *
+ * Then O moves away, and the area X was culled in has to be repainted.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "../src/compositor.h"
+
+enum { VIEW_O, VIEW_N, VIEW_A, VIEW_X, VIEW_P, VIEW_Y, VIEW_Z, VIEW_COUNT };
+
+static const struct {
+	int32_t x, y, size;
+	int opaque;
+	float alpha;
+} views[] = {
+	{   0,   0, 200, 1, 1.0 },
+	{ 300,   0, 200, 0, 1.0 },
+	{ 600,   0, 200, 1, 0.5 },
+	{  50,  50, 100, 1, 1.0 },
+	{ 150, 150, 100, 1, 1.0 },
+	{ 350,  50,  50, 1, 1.0 },
+	{ 650,  50,  50, 1, 1.0 },
+};
+
+struct cull_test {
+	struct weston_compositor *compositor;
+	struct weston_output *output;
+	int (*repaint)(struct weston_output *output,
+		       pixman_region32_t *damage);
+
+	struct weston_layer layer;
+	struct weston_surface *surfaces[VIEW_COUNT];
+	struct weston_view *views[VIEW_COUNT];
+	int frame;
+};
+
+/* The output hooks only get the output */
+static struct cull_test *test;
+
+static void
+check_culled_views(void)
+{
+	struct weston_compositor *ec = test->compositor;
+	struct weston_view *view;
+	uint32_t culled = 0;
+
+	wl_list_for_each(view, &ec->view_list, link)
+		if (view->occluded)
+			culled++;
+
+	assert(ec->culled_views == culled);
+}
+
+static void
+next_frame(void *data)
+{
+	int i;
+
+	switch (test->frame) {
+	case 1:
+		/* Uncover X, without touching it */
+		weston_view_set_position(test->views[VIEW_O],
+					 test->output->x,
+					 test->output->y + 400);
+		break;
+	default:
+		test->output->repaint = test->repaint;
+		for (i = 0; i < VIEW_COUNT; i++)
+			weston_surface_destroy(test->surfaces[i]);
+		wl_list_remove(&test->layer.link);
+		wl_display_terminate(test->compositor->wl_display);
+		free(test);
+		test = NULL;
+		return;
+	}
+
+	weston_compositor_schedule_repaint(test->compositor);
+}
+
+static int
+test_repaint(struct weston_output *output, pixman_region32_t *damage)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct weston_view *x = test->views[VIEW_X];
+	pixman_box32_t *box;
+	int i;
+
+	switch (test->frame) {
+	case 0:
+		for (i = 0; i < VIEW_COUNT; i++)
+			assert(test->views[i]->occluded == (i == VIEW_X));
+		assert(ec->culled_views >= 1);
+		break;
+	case 1:
+		for (i = 0; i < VIEW_COUNT; i++)
+			assert(!test->views[i]->occluded);
+
+		box = pixman_region32_extents(&x->transform.boundingbox);
+		assert(pixman_region32_contains_rectangle(damage, box) ==
+		       PIXMAN_REGION_IN);
+		break;
+	}
+	check_culled_views();
+
+	test->frame++;
+	wl_event_loop_add_idle(wl_display_get_event_loop(ec->wl_display),
+			       next_frame, NULL);
+
+	return test->repaint(output, damage);
+}
+
+static void
+cull_test(void *data)
+{
+	struct weston_compositor *ec = data;
+	struct weston_surface *surface;
+	struct weston_view *view;
+	int i;
+
+	test = calloc(1, sizeof *test);
+	assert(test);
+	test->compositor = ec;
+	test->output = container_of(ec->output_list.next,
+				    struct weston_output, link);
+
+	weston_layer_init(&test->layer, &ec->layer_list);
+
+	for (i = 0; i < VIEW_COUNT; i++) {
+		surface = weston_surface_create(ec);
+		assert(surface);
+		view = weston_view_create(surface);
+		assert(view);
+
+		weston_surface_set_size(surface, views[i].size, views[i].size);
+		if (views[i].opaque)
+			pixman_region32_union_rect(&surface->opaque,
+						   &surface->opaque, 0, 0,
+						   views[i].size,
+						   views[i].size);
+		view->alpha = views[i].alpha;
+		weston_view_set_position(view, test->output->x + views[i].x,
+					 test->output->y + views[i].y);
+
+		test->surfaces[i] = surface;
+		test->views[i] = view;
+	}
+
+	/* Each goes on top, so O ends up topmost */
+	for (i = VIEW_COUNT - 1; i >= 0; i--)
+		weston_layer_entry_insert(&test->layer.view_list,
+					  &test->views[i]->layer_link);
+
+	test->repaint = test->output->repaint;
+	test->output->repaint = test_repaint;
+	weston_compositor_schedule_repaint(ec);
+}
+
+WL_EXPORT int
+module_init(struct weston_compositor *compositor, int *argc, char *argv[])
+{
+	struct wl_event_loop *loop;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+
+	wl_event_loop_add_idle(loop, cull_test, compositor);
+
+	return 0;
+}
@@ -0,0 +1,243 @@
+/*
+ * Copyright © 2014 Chameleon
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "weston-test-runner.h"
+
+#include "../src/view-grid.h"
+
+#define container_of(ptr, type, member) ({				\
+	const __typeof__( ((type *)0)->member ) *__mptr = (ptr);	\
+	(type *)( (char *)__mptr - offsetof(type,member) );})
+
+/* Stands in for a weston_view: the grid entry plus its stacking order */
+struct test_view {
+	struct view_grid_entry entry;
+	int index;
+};
+
+struct topmost {
+	struct test_view *view;
+	int candidates;
+};
+
+static int
+find_topmost(struct view_grid_entry *entry, void *data)
+{
+	struct test_view *view = container_of(entry, struct test_view, entry);
+	struct topmost *top = data;
+
+	top->candidates++;
+	if (!top->view || view->index < top->view->index)
+		top->view = view;
+
+	return 0;
+}
+
+static struct test_view *
+grid_pick(struct view_grid *grid, int32_t x, int32_t y)
+{
+	struct topmost top = { NULL, 0 };
+
+	view_grid_for_each_at(grid, x, y, find_topmost, &top);
+
+	return top.view;
+}
+
+/* What weston_compositor_pick_view() used to do: walk the whole list.
+ * This only tests the boxes, the real walk also transformed the point
+ * into every view it passed. */
+static struct test_view *
+linear_pick(struct test_view *views, int count, int32_t x, int32_t y)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		pixman_box32_t *box = &views[i].entry.box;
+
+		if (x >= box->x1 && x < box->x2 && y >= box->y1 && y < box->y2)
+			return &views[i];
+	}
+
+	return NULL;
+}
+
+static void
+random_box(pixman_box32_t *box, int max_size)
+{
+	int w = 1 + rand() % max_size;
+	int h = 1 + rand() % max_size;
+
+	box->x1 = rand() % 2400 - 240;
+	box->y1 = rand() % 1400 - 160;
+	box->x2 = box->x1 + w;
+	box->y2 = box->y1 + h;
+}
+
+static struct test_view *
+create_views(struct view_grid *grid, int count, int max_size)
+{
+	struct test_view *views = calloc(count, sizeof *views);
+	pixman_box32_t box;
+	int i;
+
+	assert(views);
+	view_grid_init(grid);
+	for (i = 0; i < count; i++) {
+		views[i].index = i;
+		view_grid_entry_init(&views[i].entry);
+		random_box(&box, max_size);
+		view_grid_update(grid, &views[i].entry, &box);
+	}
+
+	return views;
+}
+
+static void
+destroy_views(struct test_view *views, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		view_grid_remove(&views[i].entry);
+	free(views);
+}
+
+TEST(grid_matches_linear_scan)
+{
+	struct view_grid grid;
+	struct test_view *views;
+	pixman_box32_t box;
+	int i, x, y;
+
+	srand(1);
+	views = create_views(&grid, 600, 3000);
+
+	/* move some around, so updates are covered too */
+	for (i = 0; i < 600; i += 3) {
+		random_box(&box, 400);
+		view_grid_update(&grid, &views[i].entry, &box);
+	}
+
+	for (i = 0; i < 20000; i++) {
+		x = rand() % 2800 - 400;
+		y = rand() % 1800 - 300;
+		assert(grid_pick(&grid, x, y) == linear_pick(views, 600, x, y));
+	}
+
+	destroy_views(views, 600);
+}
+
+TEST(grid_update_and_remove)
+{
+	struct view_grid grid;
+	struct test_view view = { .index = 0 };
+	pixman_box32_t box = { 10, 10, 20, 20 };
+	pixman_box32_t moved = { 1000, -700, 1010, -690 };
+	pixman_box32_t huge = { -100000, -100000, 100000, 100000 };
+	pixman_box32_t empty = { 50, 50, 50, 60 };
+
+	view_grid_init(&grid);
+	view_grid_entry_init(&view.entry);
+
+	view_grid_update(&grid, &view.entry, &box);
+	assert(grid_pick(&grid, 15, 15) == &view);
+	assert(grid_pick(&grid, 20, 15) == NULL);
+
+	view_grid_update(&grid, &view.entry, &moved);
+	assert(grid_pick(&grid, 15, 15) == NULL);
+	assert(grid_pick(&grid, 1000, -691) == &view);
+
+	/* too many cells, goes on the list checked for every point */
+	view_grid_update(&grid, &view.entry, &huge);
+	assert(grid_pick(&grid, -99999, 99999) == &view);
+	assert(grid_pick(&grid, 100000, 0) == NULL);
+
+	view_grid_update(&grid, &view.entry, &box);
+	assert(grid_pick(&grid, -99999, 99999) == NULL);
+	assert(grid_pick(&grid, 19, 19) == &view);
+
+	view_grid_update(&grid, &view.entry, &empty);
+	assert(grid_pick(&grid, 50, 55) == NULL);
+
+	view_grid_update(&grid, &view.entry, &box);
+	view_grid_remove(&view.entry);
+	assert(grid_pick(&grid, 15, 15) == NULL);
+}
+
+static double
+elapsed_ns(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9 +
+		(end->tv_nsec - start->tv_nsec);
+}
+
+/* A kiosk-like scene: a background, and a few hundred subsurfaces and
+ * tooltips on a 1920x1080 output. Prints the cost of one pick. */
+TEST(grid_pick_benchmark)
+{
+	struct view_grid grid;
+	struct test_view *views;
+	pixman_box32_t background = { 0, 0, 1920, 1080 };
+	struct timespec start, end;
+	const int count = 500, picks = 200000;
+	int32_t *points;
+	int i, hits = 0;
+
+	srand(2);
+	views = create_views(&grid, count, 300);
+	view_grid_update(&grid, &views[count - 1].entry, &background);
+
+	points = malloc(picks * 2 * sizeof *points);
+	assert(points);
+	for (i = 0; i < picks; i++) {
+		points[i * 2] = rand() % 1920;
+		points[i * 2 + 1] = rand() % 1080;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < picks; i++)
+		hits += linear_pick(views, count,
+				    points[i * 2], points[i * 2 + 1]) != NULL;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	fprintf(stderr, "linear scan: %.1f ns per pick\n",
+		elapsed_ns(&start, &end) / picks);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < picks; i++)
+		hits -= grid_pick(&grid,
+				  points[i * 2], points[i * 2 + 1]) != NULL;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	fprintf(stderr, "view grid:   %.1f ns per pick\n",
+		elapsed_ns(&start, &end) / picks);
+
+	assert(hits == 0);
+
+	free(points);
+	destroy_views(views, count);
+}
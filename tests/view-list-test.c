@@ -0,0 +1,185 @@
+/*
+ * Copyright © 2014 Chameleon
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "../src/compositor.h"
+
+/* Checks the order of compositor->view_list after each repaint while
+ * the views of a layer on top of everything are restacked and moved
+ * onto the output. The view list is only rebuilt when the scene asks
+ * for it, so every step is a chance for it to go stale. */
+
+enum { VIEW_A, VIEW_B, VIEW_C, VIEW_D, VIEW_COUNT };
+
+struct view_list_test {
+	struct weston_compositor *compositor;
+	struct weston_output *output;
+	struct weston_layer layer;
+	struct weston_surface *surfaces[VIEW_COUNT];
+	struct weston_view *views[VIEW_COUNT];
+	int (*repaint)(struct weston_output *output,
+		       pixman_region32_t *damage);
+	int step;
+};
+
+static struct view_list_test *test;
+
+static void
+check_view_list(const int *expected, int count)
+{
+	struct weston_view *view;
+	int i = 0;
+
+	wl_list_for_each(view, &test->compositor->view_list, link) {
+		if (i == count)
+			break;
+		assert(view == test->views[expected[i]]);
+		i++;
+	}
+	assert(i == count);
+}
+
+static void
+next_step(void *data)
+{
+	struct weston_view *view;
+	int i;
+
+	switch (test->step) {
+	case 1:
+		/* Restack: C to the top of the layer */
+		view = test->views[VIEW_C];
+		weston_layer_entry_remove(&view->layer_link);
+		weston_layer_entry_insert(&test->layer.view_list,
+					  &view->layer_link);
+		break;
+	case 2:
+		/* Map: move D, which was off every output, onto one.
+		 * Nothing is restacked, only its transform changes. */
+		weston_view_set_position(test->views[VIEW_D],
+					 test->output->x, test->output->y);
+		break;
+	default:
+		test->output->repaint = test->repaint;
+		for (i = 0; i < VIEW_COUNT; i++)
+			weston_surface_destroy(test->surfaces[i]);
+		wl_list_remove(&test->layer.link);
+		wl_display_terminate(test->compositor->wl_display);
+		free(test);
+		test = NULL;
+		return;
+	}
+
+	weston_compositor_schedule_repaint(test->compositor);
+}
+
+static int
+test_repaint(struct weston_output *output, pixman_region32_t *damage)
+{
+	static const int initial[] = { VIEW_A, VIEW_B, VIEW_C, VIEW_D };
+	static const int restacked[] = { VIEW_C, VIEW_A, VIEW_B, VIEW_D };
+	struct weston_compositor *compositor = test->compositor;
+	struct weston_surface *mapped = test->surfaces[VIEW_D];
+
+	switch (test->step) {
+	case 0:
+		check_view_list(initial, VIEW_COUNT);
+		assert(mapped->output == NULL);
+		break;
+	case 1:
+		check_view_list(restacked, VIEW_COUNT);
+		break;
+	case 2:
+		check_view_list(restacked, VIEW_COUNT);
+		assert(mapped->output == output);
+		assert(!compositor->view_list_needs_rebuild);
+		break;
+	}
+
+	test->step++;
+	wl_event_loop_add_idle(wl_display_get_event_loop(compositor->wl_display),
+			       next_step, NULL);
+
+	return test->repaint(output, damage);
+}
+
+static void
+view_list_test(void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct weston_surface *surface;
+	struct weston_view *view;
+	int i;
+
+	test = calloc(1, sizeof *test);
+	assert(test);
+	test->compositor = compositor;
+	test->output = container_of(compositor->output_list.next,
+				    struct weston_output, link);
+
+	weston_layer_init(&test->layer, &compositor->layer_list);
+
+	for (i = 0; i < VIEW_COUNT; i++) {
+		surface = weston_surface_create(compositor);
+		assert(surface);
+		view = weston_view_create(surface);
+		assert(view);
+
+		weston_surface_set_size(surface, 64, 64);
+		if (i == VIEW_D)
+			weston_view_set_position(view, test->output->x - 1000,
+						 test->output->y - 1000);
+		else
+			weston_view_set_position(view, test->output->x + i * 32,
+						 test->output->y);
+
+		test->surfaces[i] = surface;
+		test->views[i] = view;
+	}
+
+	/* Each goes on top, so A ends up topmost */
+	for (i = VIEW_COUNT - 1; i >= 0; i--)
+		weston_layer_entry_insert(&test->layer.view_list,
+					  &test->views[i]->layer_link);
+
+	test->repaint = test->output->repaint;
+	test->output->repaint = test_repaint;
+	weston_compositor_schedule_repaint(compositor);
+}
+
+WL_EXPORT int
+module_init(struct weston_compositor *compositor, int *argc, char *argv[])
+{
+	struct wl_event_loop *loop;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+
+	wl_event_loop_add_idle(loop, view_list_test, compositor);
+
+	return 0;
+}
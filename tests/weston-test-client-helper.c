@@ -126,6 +126,19 @@ get_n_egl_buffers(struct client *client)
 	return client->test->n_egl_buffers;
 }
 
+int
+get_frame_profile(struct client *client)
+{
+	client->test->n_frame_profiles = 0;
+	client->test->frame_profile_ns = 0;
+	client->test->frame_profile_damage = 0;
+
+	wl_test_get_frame_profile(client->test->wl_test);
+	wl_display_roundtrip(client->wl_display);
+
+	return client->test->n_frame_profiles;
+}
+
 static void
 pointer_handle_enter(void *data, struct wl_pointer *wl_pointer,
 		     uint32_t serial, struct wl_surface *wl_surface,
@@ -363,9 +376,31 @@ test_handle_n_egl_buffers(void *data, struct wl_test *wl_test, uint32_t n)
 	test->n_egl_buffers = n;
 }
 
+static void
+test_handle_frame_profile(void *data, struct wl_test *wl_test,
+			  uint32_t sequence, uint32_t output,
+			  struct wl_array *stages,
+			  uint32_t damage, uint32_t repaint)
+{
+	struct test *test = data;
+	uint32_t *d;
+
+	if (sequence < test->frame_profile_since)
+		return;
+
+	test->n_frame_profiles++;
+	test->frame_profile_sequence = sequence;
+	test->frame_profile_stages = stages->size / sizeof(uint32_t);
+	test->frame_profile_damage += damage;
+
+	wl_array_for_each(d, stages)
+		test->frame_profile_ns += *d;
+}
+
 static const struct wl_test_listener test_listener = {
 	test_handle_pointer_position,
 	test_handle_n_egl_buffers,
+	test_handle_frame_profile,
 };
 
 static void
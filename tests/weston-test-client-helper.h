@@ -54,6 +54,12 @@ struct test {
 	int pointer_x;
 	int pointer_y;
 	uint32_t n_egl_buffers;
+	int n_frame_profiles;
+	uint32_t frame_profile_sequence;	/* of the last one */
+	int frame_profile_stages;		/* of the last one */
+	uint32_t frame_profile_since;		/* older ones are ignored */
+	uint64_t frame_profile_ns;		/* all stages of all of them */
+	uint64_t frame_profile_damage;		/* pixels, all of them */
 };
 
 struct input {
@@ -128,6 +134,9 @@ frame_callback_wait_nofail(struct client *client, int *done);
 int
 get_n_egl_buffers(struct client *client);
 
+int
+get_frame_profile(struct client *client);
+
 void
 skip(const char *fmt, ...);
 
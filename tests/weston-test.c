@@ -28,6 +28,7 @@
 #include <signal.h>
 #include <unistd.h>
 #include "../src/compositor.h"
+#include "../src/frame-profiler.h"
 #include "wayland-test-server-protocol.h"
 
 #ifdef ENABLE_EGL
@@ -235,6 +236,48 @@ get_n_buffers(struct wl_client *client, struct wl_resource *resource)
 	wl_test_send_n_egl_buffers(resource, n_buffers);
 }
 
+static void
+get_frame_profile(struct wl_client *client, struct wl_resource *resource)
+{
+	struct weston_test *test = wl_resource_get_user_data(resource);
+	struct frame_profiler_record *records, *r;
+	struct wl_array stages;
+	uint32_t *d;
+	uint64_t prev;
+	int n, i, stage;
+
+	records = malloc(FRAME_PROFILER_SIZE * sizeof *records);
+	if (!records) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+
+	n = frame_profiler_read(test->compositor->frame_profiler,
+				records, FRAME_PROFILER_SIZE);
+
+	wl_array_init(&stages);
+	for (i = 0; i < n; i++) {
+		r = &records[i];
+
+		stages.size = 0;
+		prev = r->start;
+		for (stage = 0; stage < FRAME_STAGE_COUNT; stage++) {
+			d = wl_array_add(&stages, sizeof *d);
+			if (!d)
+				break;
+			*d = r->end[stage] - prev;
+			prev = r->end[stage];
+		}
+
+		wl_test_send_frame_profile(resource, r->sequence,
+					   r->output_id, &stages,
+					   r->damage_area, r->repaint_area);
+	}
+	wl_array_release(&stages);
+
+	free(records);
+}
+
 static const struct wl_test_interface test_implementation = {
 	move_surface,
 	move_pointer,
@@ -242,6 +285,7 @@ static const struct wl_test_interface test_implementation = {
 	activate_surface,
 	send_key,
 	get_n_buffers,
+	get_frame_profile,
 };
 
 static void